@@ -0,0 +1,186 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "parser.hpp"
+#include "repl.hpp"
+#include "rand.hpp"
+
+namespace cache {
+
+struct AdmissionParams {
+  // "none", "size", "probabilistic", "tinylfu" or "lhd"
+  std::string type = "none";
+  // size: largest object admitted, in bytes
+  uint64_t maxSize = 64 * 1024;
+  // probabilistic: chance of admitting each miss
+  double probability = 0.5;
+  // tinylfu: counters per row of the frequency sketch (a power of two)
+  uint32_t sketchWidth = 1 << 20;
+  // lhd: chance of admitting a miss regardless, so that the policy
+  // keeps learning about objects like it
+  double exploreProbability = 0.01;
+};
+
+// Decides whether Cache::access() inserts a missed object. Rejected
+// objects cause no evictions. admit() gets the first victim the policy
+// would evict for the object if needsVictim(), and INVALID_CANDIDATE if
+// the object fits or the policy wasn't asked.
+class Admission {
+public:
+  virtual ~Admission() {}
+
+  // called on every access
+  virtual void record(const parser::Request& req) {}
+
+  virtual bool admit(const parser::Request& req, repl::candidate_t victim) = 0;
+
+  virtual bool needsVictim() const { return false; }
+
+  virtual const char* name() const = 0;
+
+  // nullptr for type "none"; exits on an unknown type
+  static Admission* create(const AdmissionParams& params, repl::Policy* repl);
+};
+
+// rejects objects larger than maxSize
+class SizeAdmission : public Admission {
+public:
+  SizeAdmission(uint64_t _maxSize) : maxSize(_maxSize) {}
+
+  bool admit(const parser::Request& req, repl::candidate_t victim) {
+    return (uint64_t)req.size() <= maxSize;
+  }
+
+  const char* name() const { return "size"; }
+
+private:
+  const uint64_t maxSize;
+};
+
+// admits each miss with a fixed probability
+class ProbabilisticAdmission : public Admission {
+public:
+  ProbabilisticAdmission(double _probability) : probability(_probability) {}
+
+  bool admit(const parser::Request& req, repl::candidate_t victim) {
+    return (rand.next() >> 11) * (1. / (1ull << 53)) < probability;
+  }
+
+  const char* name() const { return "probabilistic"; }
+
+private:
+  const double probability;
+  misc::Rand rand;
+};
+
+// TinyLFU (Einziger et al., 2017): admits a miss only if it has been
+// requested more often than the victim it would replace, by a
+// count-min sketch of ROWS rows of 4-bit counters (kept one per byte).
+// Every 10 x width recorded accesses all counters are halved, so the
+// sketch tracks recent frequency.
+class TinyLFUAdmission : public Admission {
+public:
+  static constexpr uint32_t ROWS = 4;
+  static constexpr uint8_t MAX_COUNT = 15;
+
+  TinyLFUAdmission(uint32_t width)
+    : logWidth(log2(width))
+    , counters(ROWS << log2(width), 0)
+    , resetInterval(10ull << log2(width)) {}
+
+  void record(const parser::Request& req) {
+    auto id = repl::candidate_t::make(req);
+    for (uint32_t row = 0; row < ROWS; row++) {
+      auto& counter = counters[slot(id, row)];
+      if (counter < MAX_COUNT) { ++counter; }
+    }
+
+    if (++recorded == resetInterval) {
+      for (auto& counter : counters) { counter >>= 1; }
+      recorded = 0;
+    }
+  }
+
+  bool admit(const parser::Request& req, repl::candidate_t victim) {
+    if (victim == repl::INVALID_CANDIDATE) { return true; }
+    return frequency(repl::candidate_t::make(req)) >= frequency(victim);
+  }
+
+  bool needsVictim() const { return true; }
+
+  const char* name() const { return "tinylfu"; }
+
+private:
+  static uint32_t log2(uint32_t width) {
+    uint32_t log = 0;
+    while ((1u << log) < width) { ++log; }
+    return log;
+  }
+
+  inline uint64_t slot(repl::candidate_t id, uint32_t row) const {
+    static constexpr uint64_t SEEDS[ROWS] = {
+      0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+      0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull };
+    uint64_t h = ((uint64_t)id.id ^ ((uint64_t)id.appId << 48)) * SEEDS[row];
+    return ((uint64_t)row << logWidth) + (h >> (64 - logWidth));
+  }
+
+  uint8_t frequency(repl::candidate_t id) const {
+    uint8_t count = MAX_COUNT;
+    for (uint32_t row = 0; row < ROWS; row++) {
+      count = std::min(count, counters[slot(id, row)]);
+    }
+    return count;
+  }
+
+  const uint32_t logWidth;
+  std::vector<uint8_t> counters;
+  const uint64_t resetInterval;
+  uint64_t recorded = 0;
+};
+
+// asks the policy whether the object's expected hit density beats the
+// victim's (Policy::admits(); LHD compares class hit densities)
+class DensityAdmission : public Admission {
+public:
+  DensityAdmission(repl::Policy* _repl, double _exploreProbability)
+    : repl(_repl), exploreProbability(_exploreProbability) {}
+
+  bool admit(const parser::Request& req, repl::candidate_t victim) {
+    if ((rand.next() >> 11) * (1. / (1ull << 53)) < exploreProbability) { return true; }
+    return repl->admits(req, victim);
+  }
+
+  bool needsVictim() const { return true; }
+
+  const char* name() const { return "lhd"; }
+
+private:
+  repl::Policy* repl;
+  const double exploreProbability;
+  misc::Rand rand;
+};
+
+inline Admission* Admission::create(const AdmissionParams& params, repl::Policy* repl) {
+  if (params.type == "none") {
+    return nullptr;
+  } else if (params.type == "size") {
+    return new SizeAdmission(params.maxSize);
+  } else if (params.type == "probabilistic") {
+    return new ProbabilisticAdmission(params.probability);
+  } else if (params.type == "tinylfu") {
+    return new TinyLFUAdmission(params.sketchWidth);
+  } else if (params.type == "lhd") {
+    return new DensityAdmission(repl, params.exploreProbability);
+  } else {
+    std::cerr << "Invalid admission: " << params.type << std::endl;
+    exit(-2);
+    return nullptr;
+  }
+}
+
+}
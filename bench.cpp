@@ -0,0 +1,417 @@
+// Microbenchmarks of the simulator's hot paths (make bench).
+//
+// Times LHD's rank(), update() (hits and inserts), replaced() and
+// reconfigurations across associativities and table shapes, the LRU
+// policies' operations, and every trace format's decode rate, all on
+// synthetic inputs. Prints one CSV line per benchmark to the results
+// file: name, configuration, operations, ns/op and millions of ops/s.
+// Given the results file of an earlier build as the baseline, it also
+// prints each benchmark's speedup over it.
+//
+// Policies print their own diagnostics to stdout, so results go to a
+// file of their own ("-" for stdout).
+//
+// Usage: ./bin/bench [results.csv] [baseline.csv]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "cache.hpp"
+#include "lhd.hpp"
+#include "lru.hpp"
+#include "parser.hpp"
+#include "rand.hpp"
+
+using namespace std;
+
+namespace {
+
+const uint64_t OBJECTS = 100 * 1000;
+const uint64_t WARMUP = 4 * OBJECTS;
+const uint64_t OPS = 200 * 1000;
+const uint64_t RECONFIGURATIONS = 20;
+const uint64_t TRACE_REQUESTS = 500 * 1000;
+const uint64_t ACCS_PER_RECONFIGURATION = 1 << 16;
+
+// keeps timed results from being optimized away
+volatile uint64_t sink;
+
+class Results {
+public:
+  Results(const char* path, const char* baselinePath)
+    : out(string(path) == "-" ? stdout : fopen(path, "w")) {
+    if (!out) {
+      cerr << "Could not open " << path << endl;
+      exit(-2);
+    }
+    fprintf(out, "# benchmark, config, ops, ns/op, Mops/s\n");
+    if (baselinePath) { readBaseline(baselinePath); }
+  }
+
+  ~Results() {
+    if (out != stdout) { fclose(out); }
+  }
+
+  void report(const string& name, const string& config, uint64_t ops, double seconds) {
+    double ns = 1e9 * seconds / ops;
+    fprintf(out, "%s, %s, %lu, %g, %g\n", name.c_str(), config.c_str(), ops, ns, 1e-6 * ops / seconds);
+    fflush(out);
+
+    auto itr = baseline.find(name + ", " + config);
+    if (itr != baseline.end()) {
+      printf("Bench | %s %s: %g ns/op, baseline %g ns/op, speedup %g\n",
+             name.c_str(), config.c_str(), ns, itr->second, itr->second / ns);
+    }
+  }
+
+private:
+  void readBaseline(const char* path) {
+    ifstream in(path);
+    if (!in.good()) {
+      cerr << "Could not open baseline " << path << endl;
+      exit(-2);
+    }
+    string line;
+    while (getline(in, line)) {
+      if (line.empty() || line[0] == '#') { continue; }
+      // name, config, ops, ns/op, ...
+      vector<string> fields;
+      stringstream ss(line);
+      string field;
+      while (getline(ss, field, ',')) {
+        auto start = field.find_first_not_of(' ');
+        fields.push_back(start == string::npos ? "" : field.substr(start));
+      }
+      if (fields.size() < 4) { continue; }
+      baseline[fields[0] + ", " + fields[1]] = stod(fields[3]);
+    }
+  }
+
+  FILE* out;
+  map<string, double> baseline;
+};
+
+template <typename F>
+double timed(F f) {
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// times update(i) for i in [0, n) on an LHD that has seen updates so
+// far, leaving out the updates that reconfigure (see
+// benchReconfigure()); returns the seconds and sets ops to the number
+// of updates timed
+template <typename F>
+double timedUpdates(uint64_t& updates, uint64_t n, uint64_t& ops, F update) {
+  double seconds = 0;
+  ops = 0;
+  uint64_t i = 0;
+  while (i < n) {
+    // the (ACCS_PER_RECONFIGURATION * k)-th update reconfigures
+    uint64_t chunk = min(n - i, ACCS_PER_RECONFIGURATION - 1 - updates % ACCS_PER_RECONFIGURATION);
+    seconds += timed([&]() {
+        for (uint64_t j = i; j < i + chunk; j++) { update(j); }
+      });
+    i += chunk;
+    updates += chunk;
+    ops += chunk;
+    if (i < n) {
+      update(i++);
+      ++updates;
+    }
+  }
+  return seconds;
+}
+
+// OBJECTS objects of 16 apps, log-uniform between 64B and 16KB, and
+// accesses to them with a heavy head (as in kvbench)
+struct Workload {
+  vector<parser::Request> objects;
+  vector<uint32_t> accesses;
+
+  Workload() {
+    misc::Rand rand(42);
+    for (uint64_t i = 0; i < OBJECTS; i++) {
+      objects.push_back(request(i, rand));
+    }
+    for (uint64_t i = 0; i < WARMUP + OPS; i++) {
+      double u = uniform(rand);
+      accesses.push_back((uint32_t)(OBJECTS * u * u * u));
+    }
+  }
+
+  static double uniform(misc::Rand& rand) {
+    return (rand.next() >> 11) * (1. / (1ull << 53));
+  }
+
+  static parser::Request request(int64_t id, misc::Rand& rand) {
+    int64_t valueSize = (int64_t)(64 * pow(256., uniform(rand)));
+    return parser::Request{0., (int32_t)(rand.next() % 16), parser::GET, 0, valueSize, id, false};
+  }
+};
+
+string lhdConfig(const char* shape, const repl::LHDParams& params) {
+  stringstream ss;
+  ss << "shape " << shape << " assoc " << params.associativity
+     << (params.quantize ? " quantized" : "");
+  return ss.str();
+}
+
+// rank(), update() and replaced() on a policy holding OBJECTS objects,
+// after WARMUP accesses have trained its model
+template <typename LHDT>
+void benchLHD(Results& results, const Workload& workload, const char* shape,
+              repl::LHDParams params) {
+  params.accsPerReconfiguration = ACCS_PER_RECONFIGURATION;
+  string config = lhdConfig(shape, params);
+
+  cache::Cache cache;
+  cache.availableCapacity = 1ull << 30;
+  LHDT lhd(params, &cache);
+
+  for (auto& req : workload.objects) {
+    lhd.update(repl::candidate_t::make(req), req);
+    cache.consumedCapacity += req.size();
+  }
+  for (uint64_t i = 0; i < WARMUP; i++) {
+    auto& req = workload.objects[workload.accesses[i]];
+    lhd.update(repl::candidate_t::make(req), req);
+  }
+  uint64_t updates = OBJECTS + WARMUP;
+  uint64_t ops;
+
+  auto& incoming = workload.objects[0];
+  double seconds = timed([&]() {
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < OPS; i++) { sum += lhd.rank(incoming).id; }
+      sink = sum;
+    });
+  results.report("lhd.rank", config, OPS, seconds);
+
+  seconds = timedUpdates(updates, OPS, ops, [&](uint64_t i) {
+      auto& req = workload.objects[workload.accesses[WARMUP + i]];
+      lhd.update(repl::candidate_t::make(req), req);
+    });
+  results.report("lhd.update.hit", config, ops, seconds);
+
+  // new objects, then their removal, leave the policy as it was
+  misc::Rand rand(7);
+  vector<parser::Request> inserts;
+  for (uint64_t i = 0; i < OPS; i++) { inserts.push_back(Workload::request(OBJECTS + i, rand)); }
+
+  seconds = timedUpdates(updates, OPS, ops, [&](uint64_t i) {
+      lhd.update(repl::candidate_t::make(inserts[i]), inserts[i]);
+    });
+  results.report("lhd.update.insert", config, ops, seconds);
+
+  seconds = timed([&]() {
+      for (auto& req : inserts) { lhd.replaced(repl::candidate_t::make(req)); }
+    });
+  results.report("lhd.replaced", config, OPS, seconds);
+}
+
+// reconfigure() is private; with accsPerReconfiguration = 1 every
+// update() reconfigures, and the update itself is noise next to it
+template <typename LHDT>
+void benchReconfigure(Results& results, const Workload& workload, const char* shape) {
+  repl::LHDParams params;
+  params.accsPerReconfiguration = 1;
+
+  cache::Cache cache;
+  cache.availableCapacity = 1ull << 30;
+  LHDT lhd(params, &cache);
+
+  double seconds = timed([&]() {
+      for (uint64_t i = 0; i < RECONFIGURATIONS; i++) {
+        auto& req = workload.objects[workload.accesses[i]];
+        lhd.update(repl::candidate_t::make(req), req);
+      }
+    });
+  results.report("lhd.reconfigure", string("shape ") + shape, RECONFIGURATIONS, seconds);
+}
+
+template <typename PolicyT>
+void benchLRU(Results& results, const Workload& workload, const char* name) {
+  PolicyT lru;
+  string config = "objects " + to_string(OBJECTS);
+
+  double seconds = timed([&]() {
+      for (auto& req : workload.objects) { lru.update(repl::candidate_t::make(req), req); }
+    });
+  results.report(string(name) + ".update.insert", config, OBJECTS, seconds);
+
+  seconds = timed([&]() {
+      for (uint64_t i = 0; i < OPS; i++) {
+        auto& req = workload.objects[workload.accesses[i]];
+        lru.update(repl::candidate_t::make(req), req);
+      }
+    });
+  results.report(string(name) + ".update.hit", config, OPS, seconds);
+
+  // evicts everything, as the cache would: rank, then replaced
+  auto& incoming = workload.objects[0];
+  seconds = timed([&]() {
+      for (uint64_t i = 0; i < OBJECTS; i++) { lru.replaced(lru.rank(incoming)); }
+    });
+  results.report(string(name) + ".evict", config, OBJECTS, seconds);
+}
+
+// trace formats, by header; see CSVParser::go()
+const char* PARTIAL_HEADER = "appId.size.id-=iqi!";
+const char* MEDIUM_HEADER = "Time.appId.type.keySize.valueSize.id.miss-=fiiiqi?!";
+const char* FULL_HEADER = "Time.appId.type.keySize.valueSize.id.miss-=fiiiqq?!";
+const char* EXPIRING_HEADER = "Time.appId.type.keySize.valueSize.id.miss.ttl-=fiiiqq?i!";
+const char* COSTED_HEADER = "Time.appId.type.keySize.valueSize.id.miss.ttl.cost-=fiiiqq?if!";
+
+void writeCSV(const string& path, const char* header, uint32_t extraColumns) {
+  ofstream out(path);
+  misc::Rand rand(11);
+  out << header << "\n";
+  for (uint64_t i = 0; i < TRACE_REQUESTS; i++) {
+    auto req = Workload::request(rand.next() % OBJECTS, rand);
+    if (string(header) == PARTIAL_HEADER) {
+      out << req.appId << "," << req.valueSize << "," << req.id << "\n";
+      continue;
+    }
+    out << (0.001 * i) << "," << req.appId << "," << req.type << ",20,"
+        << req.valueSize << "," << req.id << ",0";
+    if (extraColumns > 0) { out << ",3600"; }
+    if (extraColumns > 1) { out << ",2.5"; }
+    out << "\n";
+  }
+}
+
+void fillBinary(parser::PartialRequest& r, const parser::Request& req, uint64_t i) {
+  r.size = req.valueSize;
+}
+
+template <typename RequestType>
+void fillBinary(RequestType& r, const parser::Request& req, uint64_t i) {
+  r.time = 0.001 * i;
+  r.type = req.type;
+  r.keySize = 20;
+  r.valueSize = req.valueSize;
+}
+
+template <typename RequestType>
+void writeBinary(const string& path, const char* header) {
+  ofstream out(path, ofstream::binary);
+  misc::Rand rand(11);
+  out << header;
+  for (uint64_t i = 0; i < TRACE_REQUESTS; i++) {
+    auto req = Workload::request(rand.next() % OBJECTS, rand);
+    RequestType r{};
+    r.appId = req.appId;
+    r.id = req.id;
+    fillBinary(r, req, i);
+    out.write((const char*)&r, sizeof(r));
+  }
+}
+
+// decodes the whole trace (binary parsers don't stop at the end of the
+// file, so the visitor does)
+template <typename ParserT>
+void benchParser(Results& results, const string& path, const char* name, const char* format) {
+  uint64_t requests = 0;
+  double seconds = timed([&]() {
+      ParserT parser(path.c_str());
+      uint64_t sum = 0;
+      parser.go([&](const parser::Request& req) {
+          sum += req.size();
+          return ++requests < TRACE_REQUESTS;
+        });
+      sink = sum;
+    });
+  results.report(name, format, requests, seconds);
+}
+
+void benchParsers(Results& results) {
+  char dir[] = "/tmp/lhd-bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    cerr << "Could not create a directory for traces" << endl;
+    exit(-2);
+  }
+
+  struct Format {
+    const char* name;
+    const char* header;
+    uint32_t extraColumns;
+  };
+  const Format FORMATS[] = {
+    { "partial", PARTIAL_HEADER, 0 },
+    { "medium", MEDIUM_HEADER, 0 },
+    { "full", FULL_HEADER, 0 },
+    { "ttl", EXPIRING_HEADER, 1 },
+    { "cost", COSTED_HEADER, 2 },
+  };
+
+  for (auto& format : FORMATS) {
+    string path = string(dir) + "/" + format.name + ".csvt";
+    writeCSV(path, format.header, format.extraColumns);
+    benchParser<parser::CSVParser>(results, path, "parser.csv", format.name);
+    unlink(path.c_str());
+  }
+
+  string path = string(dir) + "/trace.bin";
+  writeBinary<parser::PartialRequest>(path, PARTIAL_HEADER);
+  benchParser<parser::BinaryParser>(results, path, "parser.binary", "partial");
+  writeBinary<parser::MediumRequest>(path, MEDIUM_HEADER);
+  benchParser<parser::BinaryParser>(results, path, "parser.binary", "medium");
+  writeBinary<parser::FullRequest>(path, FULL_HEADER);
+  benchParser<parser::BinaryParser>(results, path, "parser.binary", "full");
+  writeBinary<parser::ExpiringRequest>(path, EXPIRING_HEADER);
+  benchParser<parser::BinaryParser>(results, path, "parser.binary", "ttl");
+  writeBinary<parser::CostedRequest>(path, COSTED_HEADER);
+  benchParser<parser::BinaryParser>(results, path, "parser.binary", "cost");
+  unlink(path.c_str());
+
+  rmdir(dir);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  Results results(argc > 1 ? argv[1] : "-", argc > 2 ? argv[2] : nullptr);
+  Workload workload;
+
+  // associativity, on the default shape
+  for (int associativity : { 8, 32, 64, 128 }) {
+    repl::LHDParams params;
+    params.associativity = associativity;
+    benchLHD<repl::LHD<16, 16, 20000>>(results, workload, "16x16x20000", params);
+  }
+  {
+    repl::LHDParams params;
+    params.quantize = true;
+    benchLHD<repl::LHD<16, 16, 20000>>(results, workload, "16x16x20000", params);
+  }
+
+  // table sizes (hit age classes x app classes x max age [x size classes])
+  repl::LHDParams params;
+  benchLHD<repl::LHD<16,  1, 20000>>(results, workload, "16x1x20000", params);
+  benchLHD<repl::LHD<16, 64, 20000>>(results, workload, "16x64x20000", params);
+  benchLHD<repl::LHD<16, 16,  4096>>(results, workload, "16x16x4096", params);
+  benchLHD<repl::LHD<16,  1,  4096, 8>>(results, workload, "16x1x4096x8", params);
+
+  benchReconfigure<repl::LHD<16, 16, 20000>>(results, workload, "16x16x20000");
+  benchReconfigure<repl::LHD<16,  1, 20000>>(results, workload, "16x1x20000");
+  benchReconfigure<repl::LHD<16, 64, 20000>>(results, workload, "16x64x20000");
+  benchReconfigure<repl::LHD<16, 16,  4096>>(results, workload, "16x16x4096");
+  benchReconfigure<repl::LHD<16,  1,  4096, 8>>(results, workload, "16x1x4096x8");
+
+  benchLRU<repl::LRU>(results, workload, "lru");
+  benchLRU<repl::LinkedLRU>(results, workload, "linkedlru");
+
+  benchParsers(results);
+
+  return 0;
+}
@@ -1,4 +1,4 @@
-#include <ctime>
+#include <chrono>
 #include <string>
 #include <libconfig.h++>
 
@@ -6,12 +6,15 @@
 #include "parser.hpp"
 #include "repl.hpp"
 #include "cache.hpp"
+#include "runner.hpp"
+#include "tiered.hpp"
 #include "config.hpp"
 
 using namespace std;
 using namespace parser;
 
 cache::Cache* _cache;
+cache::Runner* _runner;
 
 const int64_t DEFAULT_WARMUP_ACCESSES = 128 * 1000 * 1000;
 const int64_t DEFAULT_TOTAL_ACCESSES = 512 * 1024 * 1024;
@@ -24,15 +27,6 @@ const string MSR_TRACE_PREFIX = "./";
 const string FULL_TRACE = "/n/memcachier/full.trace";
 const string APP_TRACE_PREFIX = "/n/memcachier/traces/";
 
-bool simulateCache(const Request& req) {
-  if (filterApp != -1 && req.appId != filterApp) {
-    return true;
-  }
-
-  _cache->access(req);
-  return _cache->accesses < TOTAL_ACCESSES - parser::FAST_FORWARD;
-}
-
 int main(int argc, char* argv[]) {
   if (argc != 2) {
     fprintf(stderr, "Usage: ./cache <config-file>\n");
@@ -61,8 +55,93 @@ int main(int argc, char* argv[]) {
   WARMUP_ACCESSES = cfg.read<int>("trace.warmupAccesses", DEFAULT_WARMUP_ACCESSES);
   _cache = new cache::Cache();
   _cache->availableCapacity = (uint64_t)capacity * 1024 * 1024;
-  _cache->repl = repl::Policy::create(_cache, root);
+  _cache->batchEviction = cfg.read<bool>("cache.batchEviction", false);
+  _cache->replayWrites = cfg.read<bool>("cache.writes", false);
+  _cache->fillMisses = cfg.read<bool>("cache.fillMisses", false);
+  if (cfg.read<bool>("cache.slabs", false)) {
+    cache::SlabParams slabParams;
+    slabParams.pageSize = cfg.read<int>("cache.slabPageSize", slabParams.pageSize);
+    slabParams.minChunkSize = cfg.read<int>("cache.slabMinChunkSize", slabParams.minChunkSize);
+    slabParams.growthFactor = cfg.read<double>("cache.slabGrowthFactor", slabParams.growthFactor);
+    slabParams.associativity = cfg.read<int>("cache.assoc", slabParams.associativity);
+    slabParams.automove = cfg.read<bool>("cache.slabAutomove", false);
+    slabParams.automoveInterval = cfg.read<int>("cache.slabAutomoveInterval", slabParams.automoveInterval);
+    _cache->slabs = new cache::SlabModel(_cache->availableCapacity, slabParams);
+  }
+  _runner = repl::Policy::create(_cache, root);
   std::cout << "Cache Capacity: " << capacity << "MB" << std::endl;
+
+  cache::AdmissionParams admissionParams;
+  admissionParams.type = cfg.read<const char*>("cache.admission", admissionParams.type.c_str());
+  admissionParams.maxSize = cfg.read<int>("cache.admitMaxSize", admissionParams.maxSize);
+  admissionParams.probability = cfg.read<double>("cache.admitProbability", admissionParams.probability);
+  admissionParams.sketchWidth = cfg.read<int>("cache.sketchWidth", admissionParams.sketchWidth);
+  admissionParams.exploreProbability =
+    cfg.read<double>("cache.admitExploreProbability", admissionParams.exploreProbability);
+  _cache->admission = cache::Admission::create(admissionParams, _cache->repl);
+  std::cout << "Admission: " << admissionParams.type << std::endl;
+
+  if (cfg.read<bool>("cache.ttl", false)) {
+    cache::ExpiryParams expiryParams;
+    expiryParams.defaultTTL = cfg.read<int>("cache.defaultTTL", expiryParams.defaultTTL);
+    // a list of (appId, seconds) pairs
+    if (cfg.exists("cache.appTTLs")) {
+      const libconfig::Setting& appTTLs = root["cache"]["appTTLs"];
+      for (int i = 0; i < appTTLs.getLength(); i++) {
+        expiryParams.appTTLs[(int)appTTLs[i][0]] = (int)appTTLs[i][1];
+      }
+    }
+    _cache->expiry = new cache::Expiry(expiryParams);
+    std::cout << "TTLs: default " << expiryParams.defaultTTL << "s, "
+              << expiryParams.appTTLs.size() << " per-app" << std::endl;
+  }
+
+  if (cfg.read<bool>("cache.missCosts", false)) {
+    cache::CostParams costParams;
+    costParams.defaultCost = cfg.read<double>("cache.defaultMissCost", costParams.defaultCost);
+    costParams.costPerByte = cfg.read<double>("cache.missCostPerByte", costParams.costPerByte);
+    // a list of (appId, cost) pairs
+    if (cfg.exists("cache.appMissCosts")) {
+      const libconfig::Setting& appCosts = root["cache"]["appMissCosts"];
+      for (int i = 0; i < appCosts.getLength(); i++) {
+        costParams.appCosts[(int)appCosts[i][0]] = (double)appCosts[i][1];
+      }
+    }
+    _cache->costs = new cache::CostModel(costParams);
+    std::cout << "Miss costs: default " << costParams.defaultCost << ", "
+              << costParams.appCosts.size() << " per-app, "
+              << costParams.costPerByte << " per byte" << std::endl;
+  }
+
+  // a flash group puts a second cache, with its own cache and repl
+  // settings, behind this one (tiered.hpp)
+  if (root.exists("flash")) {
+    if (_cache->replayWrites) {
+      std::cerr << "flash replays GETs only; cache.writes is not supported" << std::endl;
+      exit(-2);
+    }
+    const libconfig::Setting& flashRoot = root["flash"];
+    misc::ConfigReader flashCfg(flashRoot);
+
+    cache::TierParams tierParams;
+    tierParams.admission = flashCfg.read<const char*>("admission", tierParams.admission.c_str());
+    tierParams.admitProbability = flashCfg.read<double>("admitProbability", tierParams.admitProbability);
+    tierParams.rejectFirstHistory = flashCfg.read<int>("rejectFirstHistory", tierParams.rejectFirstHistory);
+    tierParams.promote = flashCfg.read<bool>("promote", tierParams.promote);
+    tierParams.dramLatency = flashCfg.read<double>("dramLatency", tierParams.dramLatency);
+    tierParams.flashLatency = flashCfg.read<double>("flashLatency", tierParams.flashLatency);
+    tierParams.missLatency = flashCfg.read<double>("missLatency", tierParams.missLatency);
+
+    auto* flash = new cache::Cache();
+    int flashCapacity = flashCfg.read<int>("cache.capacity");
+    flash->availableCapacity = (uint64_t)flashCapacity * 1024 * 1024;
+    flash->warmupAccesses = 0;
+    std::cout << "Flash tier: " << flashCapacity << "MB" << std::endl;
+    // the flash policy's runner is not used; TieredRunner drives both
+    delete repl::Policy::create(flash, flashRoot);
+
+    _runner = new cache::TieredRunner(_cache, _runner, flash, tierParams);
+  }
     _cache->warmupAccesses = WARMUP_ACCESSES; 
 
   std::string trace;
@@ -89,17 +168,23 @@ int main(int argc, char* argv[]) {
 
   std::cout << "Total Requests: " << TOTAL_ACCESSES << std::endl;
 
-  time_t start = time(NULL);
+  cache::RunOptions options{TOTAL_ACCESSES, filterApp};
+  // offline policies (OPT) read the trace once before it is replayed
+  _runner->policy()->prepare(trace, options);
+
+  auto start = std::chrono::steady_clock::now();
 
-  //BinaryParser parser(trace.c_str(), false);
-  CSVParser parser(trace.c_str());
-  parser.go(simulateCache);
+  _runner->run(trace, options);
 
-  time_t end = time(NULL);
+  auto end = std::chrono::steady_clock::now();
+  double seconds = std::chrono::duration<double>(end - start).count();
 
   _cache->dumpStats();
+  _cache->repl->dumpStats(_cache);
+  _runner->dumpStats();
+  if (misc::OP_TIMING_ENABLED) { misc::opTimes().dumpTotal(); }
 
-  std::cout << "Processed " << _cache->accesses << " in " << (end - start) << " seconds, rate of " << (1. * _cache->accesses / (end - start)) << " accs/sec" << std::endl;
+  std::cout << "Processed " << _cache->accesses << " in " << seconds << " seconds, rate of " << (1. * _cache->accesses / seconds) << " accs/sec (" << (1e9 * seconds / _cache->accesses) << " ns/access)" << std::endl;
 
   return 0;
 }
@@ -1,10 +1,17 @@
 #pragma once
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #include "constants.hpp"
 #include "bytes.hpp"
 #include "repl.hpp"
+#include "slabs.hpp"
+#include "admission.hpp"
+#include "expiry.hpp"
+#include "cost.hpp"
+#include "timing.hpp"
 
 namespace cache {
 
@@ -29,10 +36,35 @@ struct Cache {
   uint64_t fills;
   uint64_t evictions;
   uint64_t accessesTriggeringEvictions;
+	// misses the admission stage let in / turned away, and objects 
+	//	too large to store at all 
+  uint64_t admissions;
+  uint64_t rejections;
+  uint64_t tooLarge;
   uint64_t missesTriggeringEvictions;
+	// number of calls to repl->rank(); with batchEviction, one call 
+	//	can return several victims 
+  uint64_t rankings;
   uint64_t cumulativeAllocatedSpace;
   uint64_t cumulativeFilledSpace;
   uint64_t cumulativeEvictedSpace;
+	// objects reclaimed because their TTL ran out, kept apart from 
+	//	evictions; expiredHits were expired when hit (and count as 
+	//	misses) 
+  uint64_t expirations;
+  uint64_t cumulativeExpiredSpace;
+  uint64_t expiredHits;
+	// write path (cache.writes): stores by SET, ADD and INCREMENT, 
+	//	of which demandFills followed a GET miss of the same object, 
+	//	and objects removed by DELETE 
+  uint64_t writes;
+  uint64_t demandFills;
+  uint64_t cumulativeWrittenSpace;
+  uint64_t deletes;
+  uint64_t cumulativeDeletedSpace;
+	// cost of GETs that missed / hit (cache.missCosts) 
+  double cumulativeMissCost;
+  double cumulativeSavedCost;
 	// number of requests to the cache 
   uint64_t accesses;
   uint64_t availableCapacity;
@@ -42,11 +74,38 @@ struct Cache {
     uint64_t warmupAccesses; 
 	// no. of misses during warm-up 
 	uint64_t warmupMisses; 
+	// replay writes and deletes; GET misses are then filled by the 
+	//	SET that follows them in the trace, not by the GET itself 
+	//	(cache.writes) 
+  bool replayWrites;
+	// with replayWrites, fill GET misses anyway, for traces that 
+	//	don't log the application's fills (cache.fillMisses) 
+  bool fillMisses;
+	// ask the policy for all victims needed by an access at once 
+	//	(cache.batchEviction) 
+  bool batchEviction;
+  std::vector<repl::candidate_t> victims;
+	// memcached-style slab allocation (cache.slabs); nullptr for an
+	//	idealized cache without fragmentation
+  SlabModel* slabs;
+	// decides which misses to insert (cache.admission); nullptr to 
+	//	insert all of them
+  Admission* admission;
+	// TTLs (cache.ttl); nullptr if objects never expire
+  Expiry* expiry;
+	// miss costs (cache.missCosts); nullptr if every miss costs 1
+  CostModel* costs;
+	// when set, access() appends every object it evicts, with its size 
+	//	(for a lower tier; see tiered.hpp) 
+  std::vector<std::pair<repl::candidate_t, uint32_t>>* evictionLog;
 	// candidate_t{int appId; int64_t id;} 
 	//	int64_t id is the object ID 
 	// sizeMap stores key-value pairs. Value is size in uint32_t 
   std::unordered_map<repl::candidate_t, uint32_t> sizeMap;
   repl::CandidateMap<bool> historyAccess;
+	// objects that missed on a GET and haven't been written since 
+	//	(with replayWrites) 
+  std::unordered_set<repl::candidate_t> awaitingFill;
 
   Cache()
     : repl(nullptr)
@@ -56,14 +115,36 @@ struct Cache {
     , fills(0)
     , evictions(0)
     , accessesTriggeringEvictions(0)
+    , admissions(0)
+    , rejections(0)
+    , tooLarge(0)
     , missesTriggeringEvictions(0)
+    , rankings(0)
     , cumulativeAllocatedSpace(0)
     , cumulativeFilledSpace(0)
     , cumulativeEvictedSpace(0)
+    , expirations(0)
+    , cumulativeExpiredSpace(0)
+    , expiredHits(0)
+    , writes(0)
+    , demandFills(0)
+    , cumulativeWrittenSpace(0)
+    , deletes(0)
+    , cumulativeDeletedSpace(0)
+    , cumulativeMissCost(0)
+    , cumulativeSavedCost(0)
     , accesses(0)
     , availableCapacity(-1)
     , consumedCapacity(0)
 	, warmupMisses(0)
+    , replayWrites(false)
+    , fillMisses(false)
+    , batchEviction(false)
+    , slabs(nullptr)
+    , admission(nullptr)
+    , expiry(nullptr)
+    , costs(nullptr)
+    , evictionLog(nullptr)
     , historyAccess(false) {}
 
   uint32_t getSize(repl::candidate_t id) const {
@@ -75,27 +156,16 @@ struct Cache {
     }
   }
 
+  double missCost(const parser::Request& req) const {
+    return costs ? costs->cost(req) : 1.;
+  }
+
   uint32_t getNumObjects() const {
     return sizeMap.size();
   }
 
-  void access(const parser::Request& req) {
-    assert(req.size() > 0);
-    if (req.type != parser::GET) { return; }
-
-	// namespace repl 
-	// repl::struct candidate_t{} defined in candidate.hpp 
-	//	field: int appId, int64_t id
-	// In candidate.hpp, 
-	// struct candidate_t{ 
-	//	static candidate_t make(const parser::Request& req) {...}
-	// }
-	// make(req) returns an object of struct candidate_t 
-    auto id = repl::candidate_t::make(req); // datatype(id) is candidate_t  
-	// struct Cache { std::unordered_map<repl::candidate_t, uint32_t> sizeMap; }
-    auto itr = sizeMap.find(id);
-    bool hit = (itr != sizeMap.end());
-
+  // hit ratio stats of a GET
+  void countAccess(const parser::Request& req, repl::candidate_t id, bool hit) {
 	// struct Cache{repl::CandidateMap<bool> historyAccess; } 
 	//	In candidate.hpp, ...
 	// 	class CandidateMap : public std::unordered_map<candidate_t, T> {} 
@@ -112,6 +182,7 @@ struct Cache {
 	    ++misses; 
     }
     ++accesses;
+    if (costs) { (hit ? cumulativeSavedCost : cumulativeMissCost) += costs->cost(req); }
 
     // stats?
     if ((STATS_INTERVAL > 0) && ((accesses % STATS_INTERVAL) == 0)) {
@@ -122,13 +193,72 @@ struct Cache {
                   << compulsoryMisses << ", "
                   << (100. * hits / accesses)
                   << std::endl;
+        if (misc::OP_TIMING_ENABLED) { misc::opTimes().dumpInterval(accesses); }
     }
 
-    uint32_t requestSize = req.size();
-    if (requestSize >= availableCapacity) {
-        std::cerr << "Request too big: " << requestSize << " > " << availableCapacity << std::endl;
+    if (admission) { admission->record(req); }
+  }
+
+  void access(const parser::Request& req) {
+    misc::OpTimer timer(misc::OP_ACCESS);
+    assert(req.size() > 0);
+    bool get = (req.type == parser::GET);
+    if (!get && !(replayWrites && (req.type == parser::SET || req.type == parser::ADD
+                                   || req.type == parser::INCREMENT || req.type == parser::DELETE))) {
+      return;
+    }
+
+	// namespace repl 
+	// repl::struct candidate_t{} defined in candidate.hpp 
+	//	field: int appId, int64_t id
+	// In candidate.hpp, 
+	// struct candidate_t{ 
+	//	static candidate_t make(const parser::Request& req) {...}
+	// }
+	// make(req) returns an object of struct candidate_t 
+    auto id = repl::candidate_t::make(req); // datatype(id) is candidate_t  
+
+    if (expiry) {
+      // reclaim everything that expired since the last access
+      expiry->advance(req.time, [&](repl::candidate_t expired) {
+          expire(expired);
+        });
+      if (expiry->expired(id, req.time)) {
+        if (get) { ++expiredHits; }
+        expire(id);
+      }
+    }
+
+	// struct Cache { std::unordered_map<repl::candidate_t, uint32_t> sizeMap; }
+    auto itr = sizeMap.find(id);
+    bool hit = (itr != sizeMap.end());
+
+    if (get) {
+      countAccess(req, id, hit);
+      // the trace's own SET fills the miss, if one follows
+      if (replayWrites && !fillMisses && !hit) {
+        awaitingFill.insert(id);
+        return;
+      }
+    } else {
+      // memcached semantics: ADD stores only new objects, INCREMENT
+      // only existing ones (and keeps their TTL)
+      if (req.type == parser::DELETE) {
+        if (hit) {
+          ++deletes;
+          cumulativeDeletedSpace += itr->second;
+          remove(itr);
+        }
+        return;
+      }
+      if ((req.type == parser::ADD && hit) || (req.type == parser::INCREMENT && !hit)) {
+        return;
+      }
+      historyAccess[id] = true;
+      if (awaitingFill.erase(id)) { ++demandFills; }
     }
-    assert(requestSize < availableCapacity);
+
+    uint32_t requestSize = req.size();
     
     uint32_t cachedSize = 0;
     if (hit) {
@@ -136,10 +266,64 @@ struct Cache {
       consumedCapacity -= cachedSize;
     }
 
+    // objects that can't fit are bypassed (and dropped if they were
+    // cached at a smaller size)
+    if (requestSize >= availableCapacity) {
+      if (tooLarge++ == 0) {
+        std::cerr << "Request too big: " << requestSize << " > " << availableCapacity << std::endl;
+      }
+      if (hit) {
+        repl->removed(id);
+        if (slabs) { slabs->remove(id); }
+        if (expiry) { expiry->forget(id); }
+        sizeMap.erase(itr);
+      }
+      return;
+    }
+
     uint32_t evictionsFromThisAccess = 0;
     uint64_t evictedSpaceFromThisAccess = 0;
+    bool placed = true;
+
+    // admission stage: misses may be bypassed, before they cause any
+    // evictions. policies that compare against a victim are asked
+    // after the first ranking round, below.
+    bool checkVictim = false;
+    if (!hit && admission) {
+      checkVictim = admission->needsVictim() && !slabs
+        && consumedCapacity + requestSize > availableCapacity;
+      if (!checkVictim) {
+        placed = admission->admit(req, repl::INVALID_CANDIDATE);
+        ++(placed ? admissions : rejections);
+      }
+    }
+
+    if (slabs && placed) {
+      // victims come from the class the object needs, whether or not
+      // the cache as a whole is full
+      if (hit) { slabs->remove(id); }
+      victims.clear();
+      slabs->tick(repl, victims);
+      placed = slabs->place(repl, req, id, requestSize, victims);
+      if (!placed && hit) {
+        repl->removed(id);
+        if (expiry) { expiry->forget(id); }
+        sizeMap.erase(id);
+      }
+
+      for (auto victim : victims) {
+        auto victimItr = sizeMap.find(victim);
+        assert(victimItr != sizeMap.end());
+        evictionsFromThisAccess += 1;
+        evictedSpaceFromThisAccess += victimItr->second;
+        consumedCapacity -= victimItr->second;
+        if (evictionLog) { evictionLog->emplace_back(victim, victimItr->second); }
+        if (expiry) { expiry->forget(victim); }
+        sizeMap.erase(victimItr);
+      }
+    }
 
-    while (consumedCapacity + requestSize > availableCapacity) {
+    while (!slabs && placed && consumedCapacity + requestSize > availableCapacity) {
       // need to evict stuff!
 	// repl::Policy* repl; 
 	//	class Policy {
@@ -149,24 +333,50 @@ struct Cache {
 	//	class LHD : public virtual Policy {
 	//		candidate_t rank(const parser::Request& req);
 	//	}
-      repl::candidate_t victim = repl->rank(req);
-      auto victimItr = sizeMap.find(victim);
-      if (victimItr == sizeMap.end()) {
-        std::cerr << "Couldn't find victim: " << victim << std::endl;
+      {
+        misc::OpTimer rankTimer(misc::OP_RANK);
+        if (batchEviction) {
+          // one ranking round can return several victims; see
+          // Policy::rank(req, bytesNeeded, victims)
+          victims.clear();
+          repl->rank(req, consumedCapacity + requestSize - availableCapacity, victims);
+        } else {
+          victims.assign(1, repl->rank(req));
+        }
       }
-      assert(victimItr != sizeMap.end());
-
-      repl->replaced(victim);
+      ++rankings;
 
-      // replacing candidate that just hit; don't free space twice
-      if (victim == id) {
-        continue;
+      if (checkVictim) {
+        checkVictim = false;
+        placed = admission->admit(req, victims[0]);
+        ++(placed ? admissions : rejections);
+        if (!placed) { break; }
       }
 
-      evictionsFromThisAccess += 1;
-      evictedSpaceFromThisAccess += victimItr->second;
-      consumedCapacity -= victimItr->second;
-      sizeMap.erase(victimItr);
+      for (auto victim : victims) {
+        auto victimItr = sizeMap.find(victim);
+        if (victimItr == sizeMap.end()) {
+          std::cerr << "Couldn't find victim: " << victim << std::endl;
+        }
+        assert(victimItr != sizeMap.end());
+
+        {
+          misc::OpTimer replacedTimer(misc::OP_REPLACED);
+          repl->replaced(victim);
+        }
+
+        // replacing candidate that just hit; don't free space twice
+        if (victim == id) {
+          continue;
+        }
+
+        evictionsFromThisAccess += 1;
+        evictedSpaceFromThisAccess += victimItr->second;
+        consumedCapacity -= victimItr->second;
+        if (evictionLog) { evictionLog->emplace_back(victim, victimItr->second); }
+        if (expiry) { expiry->forget(victim); }
+        sizeMap.erase(victimItr);
+      }
     }
 
     // indicate where first eviction happens
@@ -178,13 +388,20 @@ struct Cache {
     // measure activity
     evictions += evictionsFromThisAccess;
     cumulativeEvictedSpace += evictedSpaceFromThisAccess;
-    if (hit) {
+    if (!get) {
+      if (placed) {
+        ++writes;
+        cumulativeWrittenSpace += requestSize;
+      }
+    } else if (hit) {
       if (requestSize > cachedSize) {
         cumulativeAllocatedSpace += requestSize - cachedSize;
       }
     } else {
       cumulativeAllocatedSpace += requestSize;
-      if (evictionsFromThisAccess == 0) {
+      if (!placed) {
+        // not stored (rejected by admission, or see SlabModel::place)
+      } else if (evictionsFromThisAccess == 0) {
         // misses that don't require evictions are fills by definition
         ++fills;
         cumulativeFilledSpace += requestSize;
@@ -193,12 +410,42 @@ struct Cache {
       }
     }
 
+    if (!placed) { return; }
+
     // insert request
     sizeMap[id] = requestSize;
     consumedCapacity += requestSize;
 
     assert(consumedCapacity <= availableCapacity);
-    repl->update(id, req);
+    {
+      misc::OpTimer updateTimer(misc::OP_UPDATE);
+      repl->update(id, req);
+    }
+    // the TTL starts when the object is written (or filled after a
+    // miss); GET hits don't extend it, as memcached's exptime is
+    // absolute, and INCREMENT keeps it
+    if (expiry && (!hit || !get) && req.type != parser::INCREMENT) { expiry->schedule(id, req); }
+  }
+
+  // removes an object the policy didn't choose (see expire() and
+  // DELETE)
+  void remove(std::unordered_map<repl::candidate_t, uint32_t>::iterator itr) {
+    auto id = itr->first;
+    repl->removed(id);
+    if (slabs) { slabs->remove(id); }
+    if (expiry) { expiry->forget(id); }
+    consumedCapacity -= itr->second;
+    sizeMap.erase(itr);
+  }
+
+  // removes an expired object. this frees space like an eviction, but
+  // the policy didn't choose it, so it is counted separately.
+  void expire(repl::candidate_t id) {
+    auto itr = sizeMap.find(id);
+    assert(itr != sizeMap.end());
+    ++expirations;
+    cumulativeExpiredSpace += itr->second;
+    remove(itr);
   }
 
   void dumpStats() {
@@ -216,9 +463,44 @@ struct Cache {
       << "  > Evictions: " << evictions << " " << (100. * evictions / accesses) << "%"
       << "\t(" << misc::bytes(cumulativeEvictedSpace) << ")" << endl
       << "  > Accesses triggering evictions: " << accessesTriggeringEvictions << " (" << (1. * evictions / accessesTriggeringEvictions) << " evictions per trigger)" << endl
+      << "  > Ranking rounds: " << rankings << " (" << (1. * evictions / rankings) << " evictions per round)" << endl
         << "  > Warmup misses: " << warmupMisses << endl 
         << "  > Warmup accesses: " << warmupAccesses << endl 
+      << "Effective capacity: " << (100. * consumedCapacity / availableCapacity) << "%"
+      << "\t(" << misc::bytes(consumedCapacity) << " of objects)" << endl
       ;
+    if (admission) {
+      std::cout << "Admission (" << admission->name() << "): " << admissions << " of "
+                << (admissions + rejections) << " misses admitted ("
+                << (100. * admissions / std::max<uint64_t>(admissions + rejections, 1)) << "%)" << endl;
+    }
+    if (expiry) {
+      std::cout << "Expirations: " << expirations << " " << (100. * expirations / accesses) << "%"
+                << "\t(" << misc::bytes(cumulativeExpiredSpace) << ")" << endl
+                << "  > Space reclaimed by expiry: "
+                << (100. * cumulativeExpiredSpace / std::max<uint64_t>(cumulativeExpiredSpace + cumulativeEvictedSpace, 1))
+                << "%, by eviction: "
+                << (100. * cumulativeEvictedSpace / std::max<uint64_t>(cumulativeExpiredSpace + cumulativeEvictedSpace, 1))
+                << "%" << endl
+                << "  > Hit after expiring, before reclaimed: " << expiredHits << endl
+                << "  > Pending timers: " << expiry->pending() << endl;
+    }
+    if (costs) {
+      std::cout << "Miss cost: " << cumulativeMissCost << ", saved by hits: " << cumulativeSavedCost
+                << " (" << (100. * cumulativeSavedCost / std::max(cumulativeMissCost + cumulativeSavedCost, 1e-9))
+                << "% of the cost of all GETs)" << endl;
+    }
+    if (replayWrites) {
+      std::cout << "Writes: " << writes << "\t(" << misc::bytes(cumulativeWrittenSpace) << ")" << endl
+                << "  > Demand fills: " << demandFills << " ("
+                << (100. * demandFills / std::max<uint64_t>(misses, 1)) << "% of misses)" << endl
+                << "  > Misses not yet filled: " << awaitingFill.size() << endl
+                << "Deletes: " << deletes << "\t(" << misc::bytes(cumulativeDeletedSpace) << ")" << endl;
+    }
+    if (tooLarge > 0) {
+      std::cout << "Too large to cache: " << tooLarge << " requests" << endl;
+    }
+    if (slabs) { slabs->dumpStats(consumedCapacity); }
   }
 
 }; // struct Cache
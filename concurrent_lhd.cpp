@@ -0,0 +1,408 @@
+#include <cstdio>
+#include "concurrent_lhd.hpp"
+
+namespace repl {
+
+namespace {
+
+// distinguishes instances in the thread-local state lookup below;
+// addresses can be reused after an instance is deleted
+std::atomic<uint64_t> nextInstance(0);
+
+}
+
+ConcurrentLHD::ConcurrentLHD(const LHDParams& params, uint64_t capacity)
+    : ASSOCIATIVITY(params.associativity)
+    , ADMISSIONS(params.admissions)
+    , AGE_COARSENING_ERROR_TOLERANCE(params.ageCoarseningErrorTolerance)
+    , ACCS_PER_RECONFIGURATION(params.accsPerReconfiguration)
+    , EWMA_DECAY(params.ewmaDecay)
+    , instance(nextInstance++)
+    , shards(NUM_SHARDS)
+    , objects(0)
+    , clock(0)
+    , nextReconfiguration(params.accsPerReconfiguration)
+    , numReconfigurations(0)
+    , explorerBudget(capacity * EXPLORER_BUDGET_FRACTION)
+    , modelGeneration(0)
+    , hits(NUM_CLASSES * MAX_AGE, 0)
+    , evictions(NUM_CLASSES * MAX_AGE, 0) {
+
+    // Initialize policy to ~GDSF by default.
+    auto* initial = new Model();
+    initial->ageCoarseningShift = 10;
+    initial->hitDensities.resize(NUM_CLASSES * MAX_AGE);
+    for (uint32_t c = 0; c < NUM_CLASSES; c++) {
+        for (age_t a = 0; a < MAX_AGE; a++) {
+            initial->hitDensities[c * MAX_AGE + a] =
+                1. * (c + 1) / (a + 1);
+        }
+    }
+    histogramCoarseningShift = initial->ageCoarseningShift;
+    model.reset(initial);
+}
+
+ConcurrentLHD::ThreadState& ConcurrentLHD::local() {
+    // fast path: the thread keeps using the same instance
+    thread_local uint64_t lastInstance = -1;
+    thread_local ThreadState* lastState = nullptr;
+    thread_local std::unordered_map<uint64_t, ThreadState*> states;
+
+    if (lastInstance == instance) { return *lastState; }
+
+    auto itr = states.find(instance);
+    if (itr == states.end()) {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        threads.emplace_back(new ThreadState(threads.size() + 1, ADMISSIONS));
+        itr = states.insert({instance, threads.back().get()}).first;
+    }
+
+    lastInstance = instance;
+    lastState = itr->second;
+    return *lastState;
+}
+
+bool ConcurrentLHD::contains(candidate_t id) {
+    auto& shard = getShard(id);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    return shard.indices.find(id) != shard.indices.end();
+}
+
+candidate_t ConcurrentLHD::rank(const parser::Request& req) {
+    auto& ts = local();
+    refreshModel(ts);
+
+    candidate_t victim = INVALID_CANDIDATE;
+    rank_t victimRank = std::numeric_limits<rank_t>::max();
+
+    // same warmup hack as LHD::rank()
+    uint32_t candidates =
+        (numReconfigurations.load(std::memory_order_relaxed) > 50)?
+        ASSOCIATIVITY : 8;
+
+    // keep sampling past candidates if every shard we hit was empty,
+    // but not forever: other threads may have removed everything
+    uint32_t emptySamples = 0;
+    for (uint32_t i = 0;
+         (i < candidates || victim == INVALID_CANDIDATE)
+             && emptySamples < MAX_EMPTY_SAMPLES
+             && numObjects() > 0;
+         i++) {
+        // the low bits of an LCG have short periods; pick the shard
+        // from the high bits so it isn't correlated with the index
+        auto& shard = shards[(ts.rand.next() >> 40) % NUM_SHARDS];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (shard.tags.empty()) {
+            ++emptySamples;
+            continue;
+        }
+
+        auto& tag = shard.tags[ts.rand.next() % shard.tags.size()];
+        rank_t rank = getHitDensity(ts, tag);
+
+        if (rank < victimRank) {
+            victim = tag.id;
+            victimRank = rank;
+        }
+    }
+
+    for (uint32_t i = 0; i < ADMISSIONS; i++) {
+        auto id = ts.recentlyAdmitted[i];
+        if (id == INVALID_CANDIDATE) { continue; }
+
+        auto& shard = getShard(id);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto itr = shard.indices.find(id);
+        // a recently admitted may have already been evicted
+        if (itr == shard.indices.end()) { continue; }
+
+        rank_t rank = getHitDensity(ts, shard.tags[itr->second]);
+
+        if (rank < victimRank) {
+            victim = id;
+            victimRank = rank;
+        }
+    }
+
+    if (victim == INVALID_CANDIDATE) { return victim; }
+
+    ts.ewmaVictimHitDensity = EWMA_DECAY * ts.ewmaVictimHitDensity + (1 - EWMA_DECAY) * victimRank;
+
+    return victim;
+}
+
+void ConcurrentLHD::update(candidate_t id, const parser::Request& req) {
+    auto& ts = local();
+    refreshModel(ts);
+    auto now = tick(ts);
+
+    auto& shard = getShard(id);
+    bool admitLowDensity = false;
+    bool insert;
+    bool explore = (ts.rand.next() % EXPLORE_INVERSE_PROBABILITY) == 0;
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto itr = shard.indices.find(id);
+        insert = (itr == shard.indices.end());
+
+        Tag* tag;
+        if (insert) {
+            shard.tags.push_back(Tag{});
+            tag = &shard.tags.back();
+            shard.indices[id] = shard.tags.size() - 1;
+
+            tag->lastLastHitAge = MAX_AGE;
+            tag->lastHitAge = 0;
+            tag->id = id;
+        } else {
+            tag = &shard.tags[itr->second];
+            assert(tag->id == id);
+            // as in LHD, writes restart the age but aren't hits
+            if (req.type == parser::GET) {
+                auto age = getAge(ts, *tag);
+                recordEvent(ts, *tag, age, true);
+
+                tag->lastLastHitAge = tag->lastHitAge;
+                tag->lastHitAge = age;
+            }
+
+            if (tag->explorer) { explorerBudget.fetch_add(tag->size, std::memory_order_relaxed); }
+        }
+
+        tag->timestamp = now;
+        tag->app = req.appId % APP_CLASSES;
+        tag->size = req.size();
+
+        // as in LHD, a few objects are kept regardless of density
+        // while the model is young, within a small space budget
+        if (explore
+            && explorerBudget.load(std::memory_order_relaxed) > 0
+            && numReconfigurations.load(std::memory_order_relaxed) < 50) {
+            tag->explorer = true;
+            explorerBudget.fetch_sub(tag->size, std::memory_order_relaxed);
+        } else {
+            tag->explorer = false;
+        }
+
+        admitLowDensity = insert && !explore && getHitDensity(ts, *tag) < ts.ewmaVictimHitDensity;
+    }
+
+    if (insert) { objects.fetch_add(1, std::memory_order_relaxed); }
+
+    // If this candidate looks like something that should be
+    // evicted, track it.
+    if (admitLowDensity) {
+        ts.recentlyAdmitted[ts.recentlyAdmittedHead++ % ADMISSIONS] = id;
+    }
+}
+
+void ConcurrentLHD::replaced(candidate_t id) {
+    auto& ts = local();
+    refreshModel(ts);
+
+    auto& shard = getShard(id);
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto itr = shard.indices.find(id);
+        // another thread got here first
+        if (itr == shard.indices.end()) { return; }
+        auto index = itr->second;
+
+        // Record stats before removing item
+        auto& tag = shard.tags[index];
+        assert(tag.id == id);
+        recordEvent(ts, tag, getAge(ts, tag), false);
+
+        if (tag.explorer) { explorerBudget.fetch_add(tag.size, std::memory_order_relaxed); }
+
+        // Remove tag for replaced item and update index
+        shard.indices.erase(itr);
+        shard.tags[index] = shard.tags.back();
+        shard.tags.pop_back();
+
+        if (index < shard.tags.size()) {
+            shard.indices[shard.tags[index].id] = index;
+        }
+    }
+
+    objects.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// the buffered events were aged under ts.model, which the caller
+// hasn't replaced yet. if reconfigure() has since changed the age
+// coarsening, their ages are rescaled the same way it rescaled the
+// histograms.
+void ConcurrentLHD::flushEvents(ThreadState& ts) {
+    if (ts.events.empty()) { return; }
+
+    std::lock_guard<std::mutex> guard(histogramLock);
+    int32_t delta = histogramCoarseningShift - ts.model->ageCoarseningShift;
+    if (delta != 0) { rescaledEvents += ts.events.size(); }
+
+    for (auto event : ts.events) {
+        uint32_t index = event >> 1;
+        age_t age = index % MAX_AGE;
+        if (delta > 0) {
+            index -= age - (age >> delta);
+        } else if (delta < 0 && age < MAX_AGE - 1) {
+            index += std::min(age << (-delta), MAX_AGE - 1) - age;
+        }
+
+        if (event & 1) {
+            hits[index] += 1;
+        } else {
+            evictions[index] += 1;
+        }
+    }
+    ts.events.clear();
+}
+
+// runs on the thread whose clock crossed nextReconfiguration. other
+// threads keep running against the old model and fold their buffered
+// events into the histograms when they see the new one.
+void ConcurrentLHD::reconfigure(ThreadState& ts) {
+    std::unique_lock<std::mutex> guard(reconfigureLock, std::try_to_lock);
+    if (!guard.owns_lock()) { return; }
+    if (ts.now < nextReconfiguration.load(std::memory_order_relaxed)) { return; }
+    nextReconfiguration.store(ts.now + ACCS_PER_RECONFIGURATION, std::memory_order_relaxed);
+
+    flushEvents(ts);
+
+    auto* next = new Model();
+    next->ageCoarseningShift = std::atomic_load(&model)->ageCoarseningShift;
+    next->hitDensities.resize(NUM_CLASSES * MAX_AGE);
+
+    rank_t totalHits = 0;
+    rank_t totalEvictions = 0;
+    {
+        std::lock_guard<std::mutex> histogramGuard(histogramLock);
+        for (uint64_t i = 0; i < hits.size(); i++) {
+            hits[i] *= EWMA_DECAY;
+            evictions[i] *= EWMA_DECAY;
+            totalHits += hits[i];
+            totalEvictions += evictions[i];
+        }
+
+        adaptAgeCoarsening(*next);
+        modelHitDensity(*next);
+    }
+
+    std::atomic_store(&model, std::shared_ptr<const Model>(next));
+    modelGeneration.fetch_add(1, std::memory_order_release);
+    int reconfigurations = ++numReconfigurations;
+
+    printf("ConcurrentLHD | reconfiguration %d | hits %g, evictions %g, hitRate %g | objects %lu\n",
+           reconfigurations,
+           totalHits, totalEvictions,
+           totalHits / (totalHits + totalEvictions),
+           numObjects());
+}
+
+// same computation as LHD::modelHitDensity()
+void ConcurrentLHD::modelHitDensity(Model& next) {
+    for (uint32_t c = 0; c < NUM_CLASSES; c++) {
+        rank_t* classHits = &hits[c * MAX_AGE];
+        rank_t* classEvictions = &evictions[c * MAX_AGE];
+        rank_t* densities = &next.hitDensities[c * MAX_AGE];
+
+        rank_t totalEvents = classHits[MAX_AGE-1] + classEvictions[MAX_AGE-1];
+        rank_t totalHits = classHits[MAX_AGE-1];
+        rank_t lifetimeUnconditioned = totalEvents;
+
+        for (age_t a = MAX_AGE - 2; a < MAX_AGE; a--) {
+            totalHits += classHits[a];
+            totalEvents += classHits[a] + classEvictions[a];
+            lifetimeUnconditioned += totalEvents;
+
+            if (totalEvents > 1e-5) {
+                densities[a] = totalHits / lifetimeUnconditioned;
+            } else {
+                densities[a] = 0.;
+            }
+        }
+    }
+}
+
+// same schedule as LHD::adaptAgeCoarsening(): retune twice, early in
+// the trace, and rescale the histograms to the new coarsening
+void ConcurrentLHD::adaptAgeCoarsening(Model& next) {
+    ewmaNumObjects *= EWMA_DECAY;
+    ewmaNumObjectsMass *= EWMA_DECAY;
+
+    ewmaNumObjects += numObjects();
+    ewmaNumObjectsMass += 1.;
+
+    rank_t numObjects = ewmaNumObjects / ewmaNumObjectsMass;
+
+    rank_t optimalAgeCoarsening = 1. * numObjects / (AGE_COARSENING_ERROR_TOLERANCE * MAX_AGE);
+
+    int reconfigurations = numReconfigurations.load();
+    if (reconfigurations != 5 && reconfigurations != 25) { return; }
+
+    uint32_t optimalAgeCoarseningLog2 = 1;
+    while ((1 << optimalAgeCoarseningLog2) < optimalAgeCoarsening) {
+        optimalAgeCoarseningLog2 += 1;
+    }
+
+    int32_t delta = optimalAgeCoarseningLog2 - next.ageCoarseningShift;
+    next.ageCoarseningShift = optimalAgeCoarseningLog2;
+    histogramCoarseningShift = optimalAgeCoarseningLog2;
+
+    // increase weight to delay another shift for a while
+    ewmaNumObjects *= 8;
+    ewmaNumObjectsMass *= 8;
+
+    for (uint32_t c = 0; c < NUM_CLASSES; c++) {
+        rank_t* classHits = &hits[c * MAX_AGE];
+        rank_t* classEvictions = &evictions[c * MAX_AGE];
+
+        if (delta < 0) {
+            // stretch
+            for (age_t a = MAX_AGE >> (-delta); a < MAX_AGE - 1; a++) {
+                classHits[MAX_AGE - 1] += classHits[a];
+                classEvictions[MAX_AGE - 1] += classEvictions[a];
+            }
+            for (age_t a = MAX_AGE - 2; a < MAX_AGE; a--) {
+                classHits[a] = classHits[a >> (-delta)] / (1 << (-delta));
+                classEvictions[a] = classEvictions[a >> (-delta)] / (1 << (-delta));
+            }
+        } else if (delta > 0) {
+            // compress
+            for (age_t a = 0; a < MAX_AGE >> delta; a++) {
+                classHits[a] = classHits[a << delta];
+                classEvictions[a] = classEvictions[a << delta];
+                for (int i = 1; i < (1 << delta); i++) {
+                    classHits[a] += classHits[(a << delta) + i];
+                    classEvictions[a] += classEvictions[(a << delta) + i];
+                }
+            }
+            for (age_t a = (MAX_AGE >> delta); a < MAX_AGE - 1; a++) {
+                classHits[a] = 0;
+                classEvictions[a] = 0;
+            }
+        }
+    }
+
+    printf("ConcurrentLHD at %lu | ageCoarseningShift now %lu | num objects %g | optimal age coarsening %g\n",
+           clock.load(), next.ageCoarseningShift,
+           numObjects, optimalAgeCoarsening);
+}
+
+void ConcurrentLHD::dumpStats(cache::Cache* cache) {
+    uint64_t overflows = 0;
+    uint64_t registered;
+    {
+        std::lock_guard<std::mutex> guard(threadsLock);
+        registered = threads.size();
+        for (auto& ts : threads) { overflows += ts->overflows; }
+    }
+    uint64_t rescaled;
+    {
+        std::lock_guard<std::mutex> guard(histogramLock);
+        rescaled = rescaledEvents;
+    }
+    printf("ConcurrentLHD | %lu threads, %d reconfigurations, %lu objects, %lu overflows, %lu rescaled events\n",
+           registered, numReconfigurations.load(), numObjects(), overflows, rescaled);
+}
+
+} // namespace repl
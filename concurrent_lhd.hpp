@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <limits>
+#include <unordered_map>
+#include "repl.hpp"
+#include "rand.hpp"
+#include "lhd.hpp"
+
+namespace repl {
+
+// LHD for caches that call update(), replaced() and rank() from many
+// threads at once. The policy is the same as LHD (with the default
+// table shape), but state is split by who writes it:
+//
+// - each thread has its own RNG, recently-admitted ring, victim
+//   density EWMA and a buffer of hit/eviction events. events are
+//   folded into the shared histograms in batches (and before
+//   reconfiguration), so the histograms are not written per access.
+//
+// - tags live in NUM_SHARDS independently locked shards; sampling
+//   locks one shard per candidate, so it tolerates concurrent
+//   inserts and removals. this is a striped-lock design, not a
+//   lock-free one: update(), replaced() and rank() each hold one
+//   shard's mutex at a time, and threads only contend when they
+//   touch the same shard.
+//
+// - the hit density model is immutable once built. reconfigure() runs
+//   on whichever thread crosses the reconfiguration time and
+//   publishes a new model; other threads pick it up on their next
+//   call. buffered events were aged under the model their thread
+//   held, so they are rescaled if the age coarsening has changed
+//   since (see flushEvents()).
+//
+// Because threads race, rank() may return an object that another
+// thread evicts before the caller does. replaced() therefore ignores
+// ids it doesn't know, and rank() returns INVALID_CANDIDATE if it
+// finds nothing to evict.
+class ConcurrentLHD : public virtual Policy {
+  public:
+
+    // capacity is in bytes and sizes the explorer budget, as in LHD
+    ConcurrentLHD(const LHDParams& params, uint64_t capacity);
+    ~ConcurrentLHD() {}
+
+    // called whenever and object is referenced
+    void update(candidate_t id, const parser::Request& req);
+
+    // called when an object is evicted; ignores unknown ids
+    void replaced(candidate_t id);
+
+    // called to find a victim upon a cache miss
+    candidate_t rank(const parser::Request& req);
+    using Policy::rank;
+
+    void dumpStats(cache::Cache* cache);
+
+    bool contains(candidate_t id);
+
+    uint64_t numObjects() const {
+        return objects.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // TYPES ///////////////////////////////
+    typedef uint64_t timestamp_t;
+    typedef uint64_t age_t;
+    typedef float rank_t;
+
+    struct Tag {
+        age_t timestamp;
+        age_t lastHitAge;
+        age_t lastLastHitAge;
+        uint32_t app;
+
+        candidate_t id;
+        rank_t size;
+        bool explorer;
+    };
+
+    // immutable once published
+    struct Model {
+        timestamp_t ageCoarseningShift;
+        // indexed by classId * MAX_AGE + age
+        std::vector<rank_t> hitDensities;
+    };
+
+    struct Shard {
+        std::mutex lock;
+        std::vector<Tag> tags;
+        std::unordered_map<candidate_t, uint64_t> indices;
+    };
+
+    // only ever touched by its own thread, except for the event
+    // buffer, which reconfigure() can't see until the owner flushes
+    struct ThreadState {
+        misc::Rand rand;
+
+        // timestamps are handed out in chunks of TIMESTAMP_CHUNK
+        timestamp_t now = 0;
+        timestamp_t chunkEnd = 0;
+
+        // (classId * MAX_AGE + age) << 1 | hit, aged under model
+        std::vector<uint32_t> events;
+        uint64_t overflows = 0;
+
+        std::shared_ptr<const Model> model;
+        uint64_t modelGeneration = -1;
+
+        std::vector<candidate_t> recentlyAdmitted;
+        uint32_t recentlyAdmittedHead = 0;
+        rank_t ewmaVictimHitDensity = 0;
+
+        ThreadState(uint64_t seed, uint32_t admissions)
+            : rand(seed)
+            , recentlyAdmitted(admissions, INVALID_CANDIDATE) {}
+    };
+
+    // CONSTANTS ///////////////////////////
+
+    // see lhd.hpp
+    const uint32_t ASSOCIATIVITY;
+    const uint32_t ADMISSIONS;
+    const rank_t AGE_COARSENING_ERROR_TOLERANCE;
+    const timestamp_t ACCS_PER_RECONFIGURATION;
+    const rank_t EWMA_DECAY;
+
+    static constexpr uint32_t HIT_AGE_CLASSES = 16;
+    static constexpr uint32_t APP_CLASSES = 16;
+    static constexpr uint32_t NUM_CLASSES = HIT_AGE_CLASSES * APP_CLASSES;
+    static constexpr age_t MAX_AGE = 20000;
+
+    static constexpr rank_t EXPLORER_BUDGET_FRACTION = 0.01;
+    static constexpr uint32_t EXPLORE_INVERSE_PROBABILITY = 32;
+
+    // enough shards that two threads rarely want the same one
+    static constexpr uint32_t NUM_SHARDS = 256;
+    // rank() gives up after this many samples land in empty shards
+    static constexpr uint32_t MAX_EMPTY_SAMPLES = 16 * NUM_SHARDS;
+    // a thread reserves this many timestamps at once, so ages are
+    // only exact up to TIMESTAMP_CHUNK * threads requests, far below
+    // the age coarsening
+    static constexpr timestamp_t TIMESTAMP_CHUNK = 64;
+    // events buffered per thread before they are folded into the
+    // shared histograms
+    static constexpr size_t EVENT_BUFFER_SIZE = 1 << 14;
+
+    // FIELDS //////////////////////////////
+    const uint64_t instance;
+
+    std::vector<Shard> shards;
+    std::atomic<uint64_t> objects;
+
+    std::atomic<timestamp_t> clock;
+    std::atomic<timestamp_t> nextReconfiguration;
+    std::atomic<int> numReconfigurations;
+    std::atomic<int64_t> explorerBudget;
+
+    // the published model; modelGeneration changes whenever it does,
+    // so threads only touch the shared_ptr when they must
+    std::shared_ptr<const Model> model;
+    std::atomic<uint64_t> modelGeneration;
+
+    // guards hits, evictions and the EWMA state below
+    std::mutex histogramLock;
+    std::vector<rank_t> hits;
+    std::vector<rank_t> evictions;
+    // the age coarsening hits and evictions are binned by, which
+    // reconfigure() changes before it publishes the model with it
+    timestamp_t histogramCoarseningShift;
+    // events flushed after the coarsening they were aged under changed
+    uint64_t rescaledEvents = 0;
+    rank_t ewmaNumObjects = 0;
+    rank_t ewmaNumObjectsMass = 0.;
+
+    // serializes reconfigure()
+    std::mutex reconfigureLock;
+
+    std::mutex threadsLock;
+    std::vector<std::unique_ptr<ThreadState>> threads;
+
+    // METHODS /////////////////////////////
+
+    ThreadState& local();
+
+    inline Shard& getShard(candidate_t id) {
+        return shards[std::hash<candidate_t>()(id) % NUM_SHARDS];
+    }
+
+    // advance this thread's clock by one request, reserving another
+    // chunk of timestamps when it runs out
+    inline timestamp_t tick(ThreadState& ts) {
+        if (ts.now == ts.chunkEnd) {
+            ts.now = clock.fetch_add(TIMESTAMP_CHUNK, std::memory_order_relaxed);
+            ts.chunkEnd = ts.now + TIMESTAMP_CHUNK;
+            if (ts.now >= nextReconfiguration.load(std::memory_order_relaxed)) {
+                reconfigure(ts);
+            }
+        }
+        return ts.now++;
+    }
+
+    inline void refreshModel(ThreadState& ts) {
+        auto generation = modelGeneration.load(std::memory_order_acquire);
+        if (generation != ts.modelGeneration) {
+            flushEvents(ts);
+            ts.model = std::atomic_load(&model);
+            ts.modelGeneration = generation;
+        }
+    }
+
+    inline uint32_t hitAgeClass(age_t age) const {
+        if (age == 0) { return HIT_AGE_CLASSES - 1; }
+        uint32_t log = 0;
+        while (age < MAX_AGE && log < HIT_AGE_CLASSES - 1) {
+            age <<= 1;
+            log += 1;
+        }
+        return log;
+    }
+
+    inline uint32_t getClassId(const Tag& tag) const {
+        uint32_t hitAgeId = hitAgeClass(tag.lastHitAge + tag.lastLastHitAge);
+        return tag.app * HIT_AGE_CLASSES + hitAgeId;
+    }
+
+    // other threads may have stamped the tag with a later timestamp
+    // than this thread's clock
+    inline age_t getAge(ThreadState& ts, const Tag& tag) {
+        if (ts.now <= tag.timestamp) { return 0; }
+        timestamp_t age = (ts.now - tag.timestamp) >> ts.model->ageCoarseningShift;
+
+        if (age >= MAX_AGE) {
+            ++ts.overflows;
+            return MAX_AGE - 1;
+        } else {
+            return (age_t) age;
+        }
+    }
+
+    inline rank_t getHitDensity(ThreadState& ts, const Tag& tag) {
+        auto age = getAge(ts, tag);
+        if (age == MAX_AGE-1) { return std::numeric_limits<rank_t>::lowest(); }
+        rank_t density = ts.model->hitDensities[getClassId(tag) * MAX_AGE + age] / tag.size;
+        if (tag.explorer) { density += 1.; }
+        return density;
+    }
+
+    inline void recordEvent(ThreadState& ts, const Tag& tag, age_t age, bool hit) {
+        ts.events.push_back((getClassId(tag) * MAX_AGE + age) << 1 | hit);
+        if (ts.events.size() >= EVENT_BUFFER_SIZE) { flushEvents(ts); }
+    }
+
+    void flushEvents(ThreadState& ts);
+    void reconfigure(ThreadState& ts);
+    void adaptAgeCoarsening(Model& next);
+    void modelHitDensity(Model& next);
+};
+
+} // namespace repl
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <unordered_map>
+
+#include "parser.hpp"
+
+namespace cache {
+
+struct CostParams {
+  // cost of a miss for apps without an entry in appCosts
+  double defaultCost = 1;
+  // per-app costs, overriding defaultCost
+  std::unordered_map<int32_t, double> appCosts;
+  // added per byte of the object, for backends whose miss penalty
+  // grows with size (e.g., transfer time)
+  double costPerByte = 0;
+};
+
+// What a miss costs the backend, in arbitrary units (say, microseconds
+// of backend time). A trace with a cost column sets Request::cost;
+// other requests are priced by their app's cost plus costPerByte per
+// byte.
+class CostModel {
+public:
+  CostModel(const CostParams& _params) : params(_params) {}
+
+  double cost(const parser::Request& req) const {
+    if (req.cost > 0) { return req.cost; }
+    auto itr = params.appCosts.find(req.appId);
+    double base = (itr != params.appCosts.end()) ? itr->second : params.defaultCost;
+    return base + params.costPerByte * req.size();
+  }
+
+private:
+  const CostParams params;
+};
+
+}
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+#include "parser.hpp"
+#include "candidate.hpp"
+
+namespace cache {
+
+// Hierarchical timer wheel (Varghese and Lauck, 1987) over integer
+// ticks. Level l has SLOTS slots of SLOTS^l ticks each; a timer goes in
+// the lowest level whose span covers its delay, in the slot its expiry
+// tick maps to. advance() fires level-0 slots one tick at a time, and
+// each time a level wraps around, the next level's current slot is
+// cascaded into the levels below. Timers beyond the top level's span
+// wait in its furthest slot and are rescheduled as it comes around.
+// Scheduling and firing are O(1), and an empty wheel skips ahead.
+//
+// Timers can't be cancelled: the owner checks that a fired item is
+// still current.
+template <typename T>
+class TimerWheel {
+public:
+  static constexpr uint32_t LEVELS = 4;
+  static constexpr uint32_t BITS = 8;
+  static constexpr uint64_t SLOTS = 1ull << BITS;
+
+  TimerWheel() : wheel(LEVELS * SLOTS) {}
+
+  uint64_t now() const { return current; }
+  uint64_t size() const { return timers; }
+
+  void schedule(const T& item, uint64_t expiry) {
+    ++timers;
+    // overdue timers fire at the next tick
+    insert(Timer{item, expiry}, current + 1);
+  }
+
+  // calls fire(item, expiry) for every timer due at or before tick
+  template <typename Visitor>
+  void advance(uint64_t tick, Visitor fire) {
+    while (current < tick) {
+      if (timers == 0) {
+        current = tick;
+        break;
+      }
+      ++current;
+
+      // cascade each level whose lower levels just wrapped around
+      for (uint32_t level = 1; level < LEVELS; level++) {
+        if ((current & ((1ull << (BITS * level)) - 1)) != 0) { break; }
+        auto& slot = wheel[level * SLOTS + index(current, level)];
+        std::vector<Timer> cascaded;
+        cascaded.swap(slot);
+        for (auto& timer : cascaded) { insert(timer, current); }
+      }
+
+      auto& slot = wheel[index(current, 0)];
+      while (!slot.empty()) {
+        // fire() may schedule more timers into this slot
+        Timer timer = slot.back();
+        slot.pop_back();
+        --timers;
+        fire(timer.item, timer.expiry);
+      }
+    }
+  }
+
+private:
+  struct Timer {
+    T item;
+    uint64_t expiry;
+  };
+
+  static inline uint64_t index(uint64_t tick, uint32_t level) {
+    return (tick >> (BITS * level)) & (SLOTS - 1);
+  }
+
+  void insert(const Timer& timer, uint64_t earliest) {
+    uint64_t expiry = std::max(timer.expiry, earliest);
+    uint64_t delay = expiry - current;
+
+    uint32_t level = 0;
+    while (level < LEVELS - 1 && delay >= (SLOTS << (BITS * level))) { ++level; }
+
+    if (level == LEVELS - 1 && delay >= (SLOTS << (BITS * level))) {
+      // out of range; park it where the top level wraps next
+      expiry = current + (SLOTS << (BITS * level)) - 1;
+    }
+    wheel[level * SLOTS + index(expiry, level)].push_back(timer);
+  }
+
+  std::vector<std::vector<Timer>> wheel;
+  uint64_t current = 0;
+  uint64_t timers = 0;
+};
+
+struct ExpiryParams {
+  // TTL in seconds for requests whose trace has none; 0 never expires
+  int32_t defaultTTL = 0;
+  // per-app TTLs, overriding defaultTTL
+  std::unordered_map<int32_t, int32_t> appTTLs;
+};
+
+// Object expiry by TTL, on trace time (Request::time, in seconds). A
+// request's TTL is Request::ttl if the trace has one, else its app's
+// configured TTL, else the default. Writes and fills after a miss
+// restart it; hits don't (see Cache::access()). The wheel
+// ticks once per second, at the first whole second at or after an
+// object's expiry. Cache::access() advances it to the current request's
+// time, so expired objects are reclaimed lazily, on the first access
+// after their tick. An object hit after it expired but before its tick
+// is caught by expired().
+class Expiry {
+public:
+  Expiry(const ExpiryParams& _params) : params(_params) {}
+
+  int32_t ttl(const parser::Request& req) const {
+    if (req.ttl > 0) { return req.ttl; }
+    auto itr = params.appTTLs.find(req.appId);
+    return (itr != params.appTTLs.end()) ? itr->second : params.defaultTTL;
+  }
+
+  // (re)starts id's TTL at req's time; without one, id never expires
+  void schedule(repl::candidate_t id, const parser::Request& req) {
+    int32_t seconds = ttl(req);
+    if (seconds <= 0) {
+      expiries.erase(id);
+      return;
+    }
+    double at = (double)req.time + seconds;
+    expiries[id] = at;
+    wheel.schedule(id, tickAt(at));
+  }
+
+  bool expired(repl::candidate_t id, float time) const {
+    auto itr = expiries.find(id);
+    return itr != expiries.end() && time >= itr->second;
+  }
+
+  // calls reclaim(id) for every object that expired by time. Timers of
+  // objects that were evicted, or whose TTL was restarted, are skipped.
+  template <typename Visitor>
+  void advance(float time, Visitor reclaim) {
+    wheel.advance((uint64_t)std::max(0.f, std::floor(time)),
+                  [&](repl::candidate_t id, uint64_t expiry) {
+        auto itr = expiries.find(id);
+        if (itr == expiries.end() || tickAt(itr->second) != expiry) { return; }
+        expiries.erase(itr);
+        reclaim(id);
+      });
+  }
+
+  // an object left the cache some other way
+  void forget(repl::candidate_t id) { expiries.erase(id); }
+
+  uint64_t pending() const { return wheel.size(); }
+
+private:
+  static inline uint64_t tickAt(double at) {
+    return (uint64_t)std::max(0., std::ceil(at));
+  }
+
+  const ExpiryParams params;
+  TimerWheel<repl::candidate_t> wheel;
+  // expiry time of every object with a TTL
+  std::unordered_map<repl::candidate_t, double> expiries;
+};
+
+}
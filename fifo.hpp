@@ -0,0 +1,399 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "repl.hpp"
+#include "cache.hpp"
+#include "index_map.hpp"
+
+namespace repl {
+
+// FIFO queue of objects in a ring buffer, for policies that only ever
+// insert at the back (CLOCK, SIEVE, S3-FIFO). erase() leaves a hole
+// that front() skips; when the ring fills, it is rebuilt without holes
+// (and doubled if more than half full), so erasing from the middle is
+// O(1) amortized. Slots are found by id through an IndexMap.
+//
+// Positions are counted from the first push and never wrap; pos &
+// mask is the slot. cursor is a position owned by the policy (SIEVE's
+// hand) that is kept pointing at the same object across rebuilds.
+template <typename DataT>
+class FifoQueue {
+public:
+  typedef DataT Data;
+  static constexpr uint32_t NOT_FOUND = IndexMap::NOT_FOUND;
+
+  struct Slot {
+    candidate_t id;
+    Data data;
+  };
+
+  FifoQueue() : ring(16, Slot{INVALID_CANDIDATE, Data()}), mask(15) {}
+
+  uint64_t size() const { return live; }
+  bool empty() const { return live == 0; }
+
+  // slot of id, or NOT_FOUND
+  uint32_t find(candidate_t id) const { return indices.find(id); }
+
+  Slot& operator[](uint32_t slot) { return ring[slot]; }
+  Slot& at(uint64_t pos) { return ring[pos & mask]; }
+
+  void push_back(candidate_t id, const Data& data) {
+    if (tail - head == ring.size()) { rebuild(); }
+    uint32_t slot = tail & mask;
+    ring[slot] = Slot{id, data};
+    indices.insert(id, slot);
+    ++tail;
+    ++live;
+  }
+
+  // oldest object's slot; the queue must not be empty
+  uint32_t front() {
+    assert(live > 0);
+    while (ring[head & mask].id == INVALID_CANDIDATE) { ++head; }
+    return head & mask;
+  }
+
+  void pop_front() { erase(ring[front()].id); }
+
+  void erase(candidate_t id) {
+    uint32_t slot = indices.find(id);
+    assert(slot != NOT_FOUND);
+    indices.erase(id);
+    ring[slot].id = INVALID_CANDIDATE;
+    --live;
+  }
+
+  // position of a slot, to compare the age of two objects
+  uint64_t position(uint32_t slot) const {
+    return head + ((slot - head) & mask);
+  }
+
+  uint64_t begin() const { return head; }
+  uint64_t end() const { return tail; }
+
+  uint64_t cursor = 0;
+
+  size_t bytes() const { return ring.capacity() * sizeof(Slot) + indices.bytes(); }
+
+private:
+  void rebuild() {
+    uint64_t newSize = (2 * live > ring.size()) ? 2 * ring.size() : ring.size();
+    std::vector<Slot> old(newSize, Slot{INVALID_CANDIDATE, Data()});
+    old.swap(ring);
+    uint64_t oldMask = mask;
+    mask = ring.size() - 1;
+
+    uint64_t newTail = 0;
+    uint64_t newCursor = 0;
+    for (uint64_t pos = head; pos != tail; pos++) {
+      if (pos == cursor) { newCursor = newTail; }
+      auto& slot = old[pos & oldMask];
+      if (slot.id == INVALID_CANDIDATE) { continue; }
+      ring[newTail] = slot;
+      indices.assign(slot.id, newTail);
+      ++newTail;
+    }
+    if (cursor == tail) { newCursor = newTail; }
+
+    head = 0;
+    tail = newTail;
+    cursor = newCursor;
+  }
+
+  std::vector<Slot> ring;
+  uint64_t mask;
+  uint64_t head = 0;
+  uint64_t tail = 0;
+  uint64_t live = 0;
+  IndexMap indices;
+};
+
+// CLOCK, as FIFO with reinsertion: a hit sets the object's reference
+// bit, and eviction moves referenced objects from the front to the
+// back (clearing the bit) until it finds an unreferenced one.
+class CLOCK : public Policy {
+public:
+  using Policy::rank;
+
+  void update(candidate_t id, const parser::Request& req) {
+    auto slot = queue.find(id);
+    if (slot != queue.NOT_FOUND) {
+      queue[slot].data = true;
+    } else {
+      queue.push_back(id, false);
+    }
+  }
+
+  void replaced(candidate_t id) { queue.erase(id); }
+
+  candidate_t rank(const parser::Request& req) {
+    while (true) {
+      auto& front = queue[queue.front()];
+      if (!front.data) { return front.id; }
+      auto id = front.id;
+      queue.pop_front();
+      queue.push_back(id, false);
+      ++reinsertions;
+    }
+  }
+
+  // unreferenced before referenced, then oldest
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    candidate_t victim = INVALID_CANDIDATE;
+    std::pair<bool, uint64_t> victimRank;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      auto slot = queue.find(candidates[i]);
+      assert(slot != queue.NOT_FOUND);
+      auto rank = std::make_pair(queue[slot].data, queue.position(slot));
+      if (victim == INVALID_CANDIDATE || rank < victimRank) {
+        victim = candidates[i];
+        victimRank = rank;
+      }
+    }
+    return victim;
+  }
+
+  void dumpStats(cache::Cache* cache) {
+    std::cout << "CLOCK: " << reinsertions << " reinsertions" << std::endl
+              << "  > Metadata: " << queue.bytes() << " bytes ("
+              << (1. * queue.bytes() / std::max<uint64_t>(queue.size(), 1))
+              << " per object)" << std::endl;
+  }
+
+private:
+  // data is the reference bit
+  FifoQueue<bool> queue;
+
+  // stats
+  uint64_t reinsertions = 0;
+};
+
+// SIEVE (Zhang et al., NSDI'24): like CLOCK, but objects stay where
+// they were inserted. A hand moves from old to new objects, clearing
+// visited bits, and evicts the first unvisited object in place; it
+// returns to the oldest object after passing the newest.
+class SIEVE : public Policy {
+public:
+  using Policy::rank;
+
+  void update(candidate_t id, const parser::Request& req) {
+    auto slot = queue.find(id);
+    if (slot != queue.NOT_FOUND) {
+      queue[slot].data = true;
+    } else {
+      queue.push_back(id, false);
+    }
+  }
+
+  void replaced(candidate_t id) { queue.erase(id); }
+
+  candidate_t rank(const parser::Request& req) {
+    assert(!queue.empty());
+    auto& hand = queue.cursor;
+    while (true) {
+      if (hand < queue.begin() || hand >= queue.end()) { hand = queue.begin(); }
+      auto& slot = queue.at(hand);
+      if (slot.id != INVALID_CANDIDATE) {
+        if (!slot.data) { return slot.id; }
+        slot.data = false;
+      }
+      ++hand;
+      ++handMoves;
+    }
+  }
+
+  // unvisited before visited, then oldest
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    candidate_t victim = INVALID_CANDIDATE;
+    std::pair<bool, uint64_t> victimRank;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      auto slot = queue.find(candidates[i]);
+      assert(slot != queue.NOT_FOUND);
+      auto rank = std::make_pair(queue[slot].data, queue.position(slot));
+      if (victim == INVALID_CANDIDATE || rank < victimRank) {
+        victim = candidates[i];
+        victimRank = rank;
+      }
+    }
+    return victim;
+  }
+
+  void dumpStats(cache::Cache* cache) {
+    std::cout << "SIEVE: " << handMoves << " hand moves" << std::endl
+              << "  > Metadata: " << queue.bytes() << " bytes ("
+              << (1. * queue.bytes() / std::max<uint64_t>(queue.size(), 1))
+              << " per object)" << std::endl;
+  }
+
+private:
+  // data is the visited bit
+  FifoQueue<bool> queue;
+
+  // stats
+  uint64_t handMoves = 0;
+};
+
+// S3-FIFO (Yang et al., SOSP'23). New objects enter a small FIFO
+// holding SMALL_FRACTION of the capacity; those hit while there move
+// to the main FIFO on eviction, and the rest are dropped but remembered
+// in a ghost FIFO of ids. A missed object found in the ghost goes
+// straight to main. Main is CLOCK with a 2-bit frequency counter.
+class S3FIFO : public Policy {
+public:
+  using Policy::rank;
+  static constexpr double SMALL_FRACTION = 0.1;
+  static constexpr uint8_t MAX_FREQ = 3;
+
+  S3FIFO(cache::Cache* cache)
+    : smallCapacity(SMALL_FRACTION * cache->availableCapacity) {}
+
+  void update(candidate_t id, const parser::Request& req) {
+    uint32_t size = req.size();
+
+    auto slot = small.find(id);
+    if (slot != small.NOT_FOUND) {
+      hit(small[slot].data, size, smallBytes);
+      return;
+    }
+
+    slot = main.find(id);
+    if (slot != main.NOT_FOUND) {
+      hit(main[slot].data, size, mainBytes);
+      return;
+    }
+
+    if (ghost.find(id) != ghost.NOT_FOUND) {
+      ghost.erase(id);
+      main.push_back(id, Item{size, 0});
+      mainBytes += size;
+      ++ghostHits;
+    } else {
+      small.push_back(id, Item{size, 0});
+      smallBytes += size;
+    }
+  }
+
+  void replaced(candidate_t id) {
+    if (erase(id)) {
+      // the ghost remembers as many objects as main holds
+      ghost.push_back(id, Empty());
+      while (ghost.size() > std::max<uint64_t>(main.size(), 1)) { ghost.pop_front(); }
+    }
+  }
+
+  // only evictions from small are remembered in the ghost
+  void removed(candidate_t id) { erase(id); }
+
+  candidate_t rank(const parser::Request& req) {
+    while (true) {
+      if (!small.empty() && (smallBytes >= smallCapacity || main.empty())) {
+        auto& front = small[small.front()];
+        if (front.data.freq == 0) { return front.id; }
+
+        auto id = front.id;
+        auto item = front.data;
+        small.pop_front();
+        smallBytes -= item.size;
+        main.push_back(id, Item{item.size, 0});
+        mainBytes += item.size;
+        ++promotions;
+      } else {
+        auto& front = main[main.front()];
+        if (front.data.freq == 0) { return front.id; }
+
+        auto id = front.id;
+        auto item = front.data;
+        main.pop_front();
+        main.push_back(id, Item{item.size, (uint8_t)(item.freq - 1)});
+        ++reinsertions;
+      }
+    }
+  }
+
+  // small before main, then least frequent, then oldest
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    candidate_t victim = INVALID_CANDIDATE;
+    std::tuple<bool, uint8_t, uint64_t> victimRank;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      std::tuple<bool, uint8_t, uint64_t> rank;
+      auto slot = small.find(candidates[i]);
+      if (slot != small.NOT_FOUND) {
+        rank = std::make_tuple(false, small[slot].data.freq, small.position(slot));
+      } else {
+        slot = main.find(candidates[i]);
+        assert(slot != main.NOT_FOUND);
+        rank = std::make_tuple(true, main[slot].data.freq, main.position(slot));
+      }
+      if (victim == INVALID_CANDIDATE || rank < victimRank) {
+        victim = candidates[i];
+        victimRank = rank;
+      }
+    }
+    return victim;
+  }
+
+  void dumpStats(cache::Cache* cache) {
+    uint64_t bytes = small.bytes() + main.bytes() + ghost.bytes();
+    uint64_t objects = small.size() + main.size();
+    std::cout << "S3-FIFO: small " << misc::bytes(smallBytes) << " (" << small.size()
+              << " objects), main " << misc::bytes(mainBytes) << " (" << main.size()
+              << " objects), ghost " << ghost.size() << " ids" << std::endl
+              << "  > Promotions: " << promotions << ", ghost hits: " << ghostHits
+              << ", reinsertions: " << reinsertions << std::endl
+              << "  > Metadata: " << bytes << " bytes ("
+              << (1. * bytes / std::max<uint64_t>(objects, 1))
+              << " per object, including ghost)" << std::endl;
+  }
+
+private:
+  struct Item {
+    uint32_t size;
+    uint8_t freq;
+  };
+  struct Empty {};
+
+  inline void hit(Item& item, uint32_t size, uint64_t& queueBytes) {
+    queueBytes += size;
+    queueBytes -= item.size;
+    item.size = size;
+    item.freq = std::min<uint8_t>(item.freq + 1, MAX_FREQ);
+  }
+
+  // drops id from whichever queue holds it; true if that was small
+  bool erase(candidate_t id) {
+    auto slot = small.find(id);
+    if (slot != small.NOT_FOUND) {
+      smallBytes -= small[slot].data.size;
+      small.erase(id);
+      return true;
+    }
+
+    slot = main.find(id);
+    assert(slot != main.NOT_FOUND);
+    mainBytes -= main[slot].data.size;
+    main.erase(id);
+    return false;
+  }
+
+  const uint64_t smallCapacity;
+  FifoQueue<Item> small;
+  FifoQueue<Item> main;
+  FifoQueue<Empty> ghost;
+  uint64_t smallBytes = 0;
+  uint64_t mainBytes = 0;
+
+  // stats
+  uint64_t promotions = 0;
+  uint64_t ghostHits = 0;
+  uint64_t reinsertions = 0;
+};
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+namespace misc {
+
+  // Log-linear histogram of latencies (or any non-negative integer),
+  // like HdrHistogram: values are bucketed by power of two, and each
+  // power of two is split into SUB_BUCKETS equal parts, so every
+  // bucket is within 1/SUB_BUCKETS of the values it holds.
+  class Histogram {
+  public:
+    static constexpr uint32_t SUB_BUCKET_BITS = 3;
+    static constexpr uint32_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+    Histogram() : counts(64 * SUB_BUCKETS, 0) {}
+
+    inline void record(uint64_t value) {
+      ++counts[bucket(value)];
+      ++total;
+      sum += value;
+      if (value > maxValue) { maxValue = value; }
+    }
+
+    void merge(const Histogram& that) {
+      for (uint32_t i = 0; i < counts.size(); i++) { counts[i] += that.counts[i]; }
+      total += that.total;
+      sum += that.sum;
+      if (that.maxValue > maxValue) { maxValue = that.maxValue; }
+    }
+
+    void clear() {
+      std::fill(counts.begin(), counts.end(), 0);
+      total = sum = maxValue = 0;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? 1. * sum / total : 0.; }
+
+    // upper bound of the bucket holding the q-th quantile, q in [0,1]
+    uint64_t percentile(double q) const {
+      if (total == 0) { return 0; }
+      uint64_t rank = (uint64_t)(q * total);
+      if (rank >= total) { rank = total - 1; }
+      uint64_t seen = 0;
+      for (uint32_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen > rank) { return std::min(upperBound(i), maxValue); }
+      }
+      return maxValue;
+    }
+
+  private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t maxValue = 0;
+
+    // values below SUB_BUCKETS get a bucket each; above, the top
+    // SUB_BUCKET_BITS + 1 bits pick the bucket
+    static inline uint32_t bucket(uint64_t value) {
+      if (value < SUB_BUCKETS) { return value; }
+      uint32_t log = 63 - __builtin_clzll(value);
+      uint32_t sub = (value >> (log - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+      return (log - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    static inline uint64_t upperBound(uint32_t bucket) {
+      if (bucket < SUB_BUCKETS) { return bucket; }
+      uint32_t log = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+      uint64_t sub = bucket % SUB_BUCKETS;
+      return ((SUB_BUCKETS + sub + 1) << (log - SUB_BUCKET_BITS)) - 1;
+    }
+  };
+
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include "candidate.hpp"
+
+namespace repl {
+
+// Map from candidate_t to a 32-bit index, for policies that keep their
+// per-object state in a pool indexed by position (see PooledList in
+// lru.hpp). Entries live in one flat array instead of a node each:
+// open addressing with linear probing, and erase() shifts later
+// entries back rather than leaving tombstones, so probes stay short
+// under churn. Grows by doubling at MAX_LOAD.
+class IndexMap {
+public:
+  static constexpr uint32_t NOT_FOUND = -1;
+  static constexpr double MAX_LOAD = 0.75;
+
+  IndexMap() { resize(4); }
+
+  uint32_t find(candidate_t key) const {
+    // INVALID_CANDIDATE marks empty slots
+    if (key == INVALID_CANDIDATE) { return NOT_FOUND; }
+    for (uint64_t i = home(key); ; i = (i + 1) & mask) {
+      if (slots[i].key == key) { return slots[i].value; }
+      if (empty(i)) { return NOT_FOUND; }
+    }
+  }
+
+  // key must not be in the map
+  void insert(candidate_t key, uint32_t value) {
+    if (count + 1 > MAX_LOAD * slots.size()) { resize(logSize + 1); }
+    uint64_t i = home(key);
+    while (!empty(i)) {
+      assert(slots[i].key != key);
+      i = (i + 1) & mask;
+    }
+    slots[i] = Slot{key, value};
+    ++count;
+  }
+
+  // key must be in the map
+  void assign(candidate_t key, uint32_t value) {
+    uint64_t i = home(key);
+    while (slots[i].key != key) {
+      assert(!empty(i));
+      i = (i + 1) & mask;
+    }
+    slots[i].value = value;
+  }
+
+  // key must be in the map
+  void erase(candidate_t key) {
+    uint64_t i = home(key);
+    while (slots[i].key != key) {
+      assert(!empty(i));
+      i = (i + 1) & mask;
+    }
+
+    // backward shift: move up any later entry whose home is not in
+    // (i, j], so every entry stays reachable from its home
+    uint64_t j = i;
+    while (true) {
+      j = (j + 1) & mask;
+      if (empty(j)) { break; }
+      uint64_t k = home(slots[j].key);
+      bool stays = (i <= j) ? (i < k && k <= j) : (i < k || k <= j);
+      if (stays) { continue; }
+      slots[i] = slots[j];
+      i = j;
+    }
+    slots[i].key = INVALID_CANDIDATE;
+    --count;
+  }
+
+  size_t size() const { return count; }
+
+  size_t bytes() const { return slots.size() * sizeof(Slot); }
+
+private:
+  struct Slot {
+    candidate_t key;
+    uint32_t value;
+  };
+
+  std::vector<Slot> slots;
+  uint64_t mask;
+  uint32_t logSize;
+  size_t count = 0;
+
+  inline bool empty(uint64_t i) const { return slots[i].key == INVALID_CANDIDATE; }
+
+  // std::hash<candidate_t> is the id, which is often sequential or
+  // aligned; Fibonacci hashing spreads it, taking the top bits
+  inline uint64_t home(candidate_t key) const {
+    uint64_t h = ((uint64_t)key.id ^ ((uint64_t)key.appId << 48)) * 0x9E3779B97F4A7C15ull;
+    return h >> (64 - logSize);
+  }
+
+  void resize(uint32_t newLogSize) {
+    std::vector<Slot> old(1ull << newLogSize, Slot{INVALID_CANDIDATE, 0});
+    old.swap(slots);
+    logSize = newLogSize;
+    mask = slots.size() - 1;
+    count = 0;
+
+    for (auto& slot : old) {
+      if (slot.key != INVALID_CANDIDATE) { insert(slot.key, slot.value); }
+    }
+  }
+};
+
+}
@@ -0,0 +1,128 @@
+// Benchmark for the LHD-managed key-value store (kvstore.hpp).
+//
+// Replays skewed synthetic GETs with demand fill (a missed GET is
+// followed by a SET of the value) against a kv::Store, and the same
+// requests against the idealized simulator (cache.hpp), for LHD and
+// LRU. Prints one CSV line per run: per-operation cost, hit ratio and
+// how much of the capacity holds keys and values.
+//
+// Usage: ./bin/kvbench [capacity MB] [requests] [objects]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "kvstore.hpp"
+#include "cache.hpp"
+#include "lru.hpp"
+
+using namespace std;
+
+// the store's per-item overhead, which the simulator's sizes include
+const int64_t ITEM_HEADER_SIZE = sizeof(kv::ItemHeader);
+
+struct Workload {
+  vector<uint32_t> keys;
+  vector<uint32_t> valueSizes;
+
+  Workload(uint64_t requests, uint64_t objects) {
+    misc::Rand rand(42);
+    vector<uint32_t> sizes(objects);
+    for (auto& size : sizes) {
+      // log-uniform between 64B and 16KB
+      double u = (rand.next() >> 11) * (1. / (1ull << 53));
+      size = (uint32_t)(64 * pow(256., u));
+    }
+    for (uint64_t i = 0; i < requests; i++) {
+      // cubing a uniform variate gives a heavy head, like a zipf
+      double u = (rand.next() >> 11) * (1. / (1ull << 53));
+      uint32_t key = (uint32_t)(objects * u * u * u);
+      keys.push_back(key);
+      valueSizes.push_back(sizes[key]);
+    }
+  }
+};
+
+static string keyName(uint32_t key) {
+  return "key:" + to_string(key);
+}
+
+static void runStore(const char* policy, uint64_t capacity, const Workload& workload) {
+  kv::Store store(capacity, policy);
+  string value(1 << 20, 'x');
+  vector<string> names;
+  for (auto key : workload.keys) { names.push_back(keyName(key)); }
+
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < workload.keys.size(); i++) {
+    kv::ValueView view;
+    if (!store.get(names[i], view)) {
+      store.set(names[i].data(), names[i].size(), value.data(), workload.valueSizes[i]);
+    }
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  uint64_t ops = store.gets + store.sets;
+
+  printf("store, %s, %g, %g, %g\n",
+         policy, 1e9 * seconds / ops, 1. * store.hits / store.gets,
+         1. * store.keyValueBytes / capacity);
+  store.dumpStats();
+}
+
+static void runSimulator(const char* name, cache::Cache& cache, repl::Policy* policy,
+                         const Workload& workload) {
+  cache.repl = policy;
+  cache.warmupAccesses = 0;
+
+  uint64_t keyValueBytes = 0;
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < workload.keys.size(); i++) {
+    int32_t keySize = keyName(workload.keys[i]).size();
+    // same item size as the store (header + key + value), so capacity
+    // means the same thing in both
+    parser::Request req{0., 0, parser::GET, keySize,
+                        workload.valueSizes[i] + ITEM_HEADER_SIZE - parser::MEMCACHED_OVERHEAD,
+                        workload.keys[i], false};
+    cache.access(req);
+  }
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  for (auto& item : cache.sizeMap) { keyValueBytes += item.second - ITEM_HEADER_SIZE; }
+
+  printf("simulator, %s, %g, %g, %g\n",
+         name, 1e9 * seconds / cache.accesses, 1. * cache.hits / cache.accesses,
+         1. * keyValueBytes / cache.availableCapacity);
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t capacity = (argc > 1 ? atoll(argv[1]) : 64) * 1024 * 1024;
+  uint64_t requests = argc > 2 ? atoll(argv[2]) : 4 * 1000 * 1000;
+  uint64_t objects = argc > 3 ? atoll(argv[3]) : 200 * 1000;
+
+  Workload workload(requests, objects);
+
+  printf("# model, policy, ns/op, hit ratio, key+value bytes / capacity\n");
+
+  for (const char* policy : { "LHD", "LRU" }) {
+    runStore(policy, capacity, workload);
+  }
+
+  {
+    cache::Cache cache;
+    cache.availableCapacity = capacity;
+    repl::DefaultLHD lhd(repl::LHDParams(), &cache);
+    runSimulator("LHD", cache, &lhd, workload);
+  }
+
+  {
+    cache::Cache cache;
+    cache.availableCapacity = capacity;
+    repl::LRU lru;
+    runSimulator("LRU", cache, &lru, workload);
+  }
+
+  return 0;
+}
@@ -0,0 +1,249 @@
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#include "kvstore.hpp"
+#include "lru.hpp"
+#include "bytes.hpp"
+
+namespace kv {
+
+SlabAllocator::SlabAllocator(uint64_t capacity)
+  : numPages(capacity / PAGE_SIZE)
+  , freePages(capacity / PAGE_SIZE)
+  , usedChunkBytes(0) {
+  assert(numPages > 0);
+  // zeroed, so chunks of fresh pages read as free (see Store)
+  arena = (char*)calloc(numPages, PAGE_SIZE);
+  assert(arena);
+
+  double size = MIN_CHUNK_SIZE;
+  while (true) {
+    // keep chunks 8-byte aligned
+    uint32_t chunkSize = ((uint32_t)size + 7) & ~7u;
+    if (chunkSize >= PAGE_SIZE / 2) { break; }
+    classes.push_back(SlabClass());
+    classes.back().chunkSize = chunkSize;
+    classes.back().chunksPerPage = PAGE_SIZE / chunkSize;
+    size = chunkSize * GROWTH_FACTOR;
+  }
+
+  // largest items get a page each
+  classes.push_back(SlabClass());
+  classes.back().chunkSize = PAGE_SIZE;
+  classes.back().chunksPerPage = 1;
+}
+
+SlabAllocator::~SlabAllocator() {
+  ::free(arena);
+}
+
+uint32_t SlabAllocator::classFor(uint32_t bytes) const {
+  // few classes; a linear scan is as fast as a binary search here
+  for (uint32_t cls = 0; cls < classes.size(); cls++) {
+    if (bytes <= classes[cls].chunkSize) { return cls; }
+  }
+  return -1;
+}
+
+char* SlabAllocator::allocate(uint32_t cls) {
+  auto& sc = classes[cls];
+
+  if (sc.freeChunks.empty()) {
+    if (freePages == 0) { return nullptr; }
+
+    char* page = arena + (numPages - freePages) * (uint64_t)PAGE_SIZE;
+    --freePages;
+    sc.pages.push_back(page);
+
+    // push in reverse so chunks are handed out in address order
+    for (uint32_t i = sc.chunksPerPage; i > 0; i--) {
+      sc.freeChunks.push_back(page + (i - 1) * sc.chunkSize);
+    }
+  }
+
+  char* chunk = sc.freeChunks.back();
+  sc.freeChunks.pop_back();
+  ++sc.usedChunks;
+  usedChunkBytes += sc.chunkSize;
+  return chunk;
+}
+
+void SlabAllocator::free(uint32_t cls, char* chunk) {
+  auto& sc = classes[cls];
+  sc.freeChunks.push_back(chunk);
+  --sc.usedChunks;
+  usedChunkBytes -= sc.chunkSize;
+}
+
+char* SlabAllocator::randomChunk(uint32_t cls, uint64_t random) const {
+  auto& sc = classes[cls];
+  if (sc.pages.empty()) { return nullptr; }
+
+  uint64_t chunk = random % (sc.pages.size() * sc.chunksPerPage);
+  return sc.pages[chunk / sc.chunksPerPage] + (chunk % sc.chunksPerPage) * sc.chunkSize;
+}
+
+void SlabAllocator::dumpStats() const {
+  std::cout << "Slabs: " << (numPages - freePages) << " / " << numPages
+            << " pages assigned, " << misc::bytes(usedChunkBytes) << " in chunks" << std::endl;
+  for (uint32_t cls = 0; cls < classes.size(); cls++) {
+    auto& sc = classes[cls];
+    if (sc.pages.empty()) { continue; }
+    std::cout << "  > Class " << cls << " (" << sc.chunkSize << "B): "
+              << sc.pages.size() << " pages, "
+              << sc.usedChunks << " / " << (sc.pages.size() * sc.chunksPerPage) << " chunks used"
+              << std::endl;
+  }
+}
+
+Store::Store(uint64_t capacity, const std::string& policyName, const repl::LHDParams& params)
+  : slabs(capacity)
+  , policy(nullptr)
+  , rand(capacity) {
+  accounting.availableCapacity = slabs.capacity();
+
+  if (policyName == "LRU") {
+    policy = new repl::LRU();
+  } else if (policyName == "LHD") {
+    policy = new repl::DefaultLHD(params, &accounting);
+  } else {
+    std::cerr << "No valid policy: " << policyName << std::endl;
+    exit(-2);
+  }
+  accounting.repl = policy;
+}
+
+Store::~Store() {
+  delete policy;
+}
+
+bool Store::get(const char* key, uint32_t keySize, ValueView& value) {
+  ++gets;
+
+  auto itr = index.find(Key{key, keySize});
+  if (itr == index.end()) { return false; }
+  ++hits;
+
+  char* chunk = itr->second;
+  policy->update(candidate(chunk), request(chunk, parser::GET));
+
+  value.data = valueOf(chunk);
+  value.size = header(chunk)->valueSize;
+  return true;
+}
+
+bool Store::set(const char* key, uint32_t keySize, const char* value, uint32_t valueSize) {
+  ++sets;
+
+  uint32_t itemSize = sizeof(ItemHeader) + keySize + valueSize;
+  uint32_t cls = slabs.classFor(itemSize);
+  if (cls == (uint32_t)-1) {
+    ++failedSets;
+    return false;
+  }
+
+  auto itr = index.find(Key{key, keySize});
+  if (itr != index.end()) {
+    char* chunk = itr->second;
+    if (header(chunk)->slabClass == cls + 1) {
+      // overwrite in place; the policy sees an access
+      keyValueBytes += valueSize;
+      keyValueBytes -= header(chunk)->valueSize;
+      header(chunk)->valueSize = valueSize;
+      memcpy(valueOf(chunk), value, valueSize);
+      policy->update(candidate(chunk), request(chunk, parser::SET));
+      return true;
+    }
+    remove(chunk, false);
+  }
+
+  parser::Request req{0., 0, parser::SET, (int32_t)keySize, valueSize, 0, false};
+  char* chunk = slabs.allocate(cls);
+  if (!chunk) { chunk = evictFor(cls, req); }
+  if (!chunk) {
+    ++failedSets;
+    return false;
+  }
+
+  auto* h = header(chunk);
+  h->keySize = keySize;
+  h->valueSize = valueSize;
+  h->slabClass = cls + 1;
+  memcpy(keyOf(chunk), key, keySize);
+  memcpy(valueOf(chunk), value, valueSize);
+
+  index[Key{keyOf(chunk), keySize}] = chunk;
+  keyValueBytes += keySize + valueSize;
+  accounting.consumedCapacity += slabs.chunkSize(cls);
+
+  policy->update(candidate(chunk), request(chunk, parser::SET));
+  return true;
+}
+
+bool Store::del(const char* key, uint32_t keySize) {
+  ++deletes;
+
+  auto itr = index.find(Key{key, keySize});
+  if (itr == index.end()) { return false; }
+
+  remove(itr->second, false);
+  return true;
+}
+
+// evict items of class cls until one of its chunks is free
+char* Store::evictFor(uint32_t cls, const parser::Request& req) {
+  for (uint32_t i = 0; i < MAX_EVICTIONS_PER_SET; i++) {
+    samples.clear();
+    for (uint32_t s = 0; s < EVICTION_SAMPLES; s++) {
+      char* chunk = slabs.randomChunk(cls, rand.next() >> 16);
+      if (!chunk) { return nullptr; }
+      if (header(chunk)->slabClass != 0) { samples.push_back(candidate(chunk)); }
+    }
+    if (samples.empty()) { continue; }
+
+    auto victim = policy->rankAmong(req, samples.data(), samples.size());
+    remove((char*)victim.id, true);
+    ++evictions;
+
+    char* chunk = slabs.allocate(cls);
+    if (chunk) { return chunk; }
+  }
+  return nullptr;
+}
+
+void Store::remove(char* chunk, bool evicted) {
+  auto* h = header(chunk);
+  assert(h->slabClass != 0);
+  uint32_t cls = h->slabClass - 1;
+
+  if (evicted) {
+    policy->replaced(candidate(chunk));
+  } else {
+    policy->removed(candidate(chunk));
+  }
+  index.erase(Key{keyOf(chunk), h->keySize});
+  keyValueBytes -= h->keySize + h->valueSize;
+  accounting.consumedCapacity -= slabs.chunkSize(cls);
+
+  h->slabClass = 0;
+  slabs.free(cls, chunk);
+}
+
+void Store::dumpStats() const {
+  using std::endl;
+  std::cout
+    << "Store: " << numItems() << " items, "
+    << misc::bytes(keyValueBytes) << " of keys and values in "
+    << misc::bytes(slabs.capacity()) << " arena" << endl
+    << "  > Gets: " << gets << ", hits " << hits << " (" << (100. * hits / gets) << "%)" << endl
+    << "  > Sets: " << sets << ", failed " << failedSets << endl
+    << "  > Deletes: " << deletes << endl
+    << "  > Evictions: " << evictions << endl
+    << "  > Memory efficiency: " << (100. * keyValueBytes / slabs.capacity())
+    << "% of arena holds keys and values ("
+    << (100. * slabs.usedBytes() / slabs.capacity()) << "% in allocated chunks)" << endl;
+  slabs.dumpStats();
+}
+
+}
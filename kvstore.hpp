@@ -0,0 +1,188 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstring>
+
+#include "cache.hpp"
+#include "repl.hpp"
+#include "rand.hpp"
+#include "lhd.hpp"
+
+namespace kv {
+
+// Read-only view of a value stored in the arena. Valid until the key
+// is next set or deleted, or evicted by another set.
+struct ValueView {
+  const char* data;
+  uint32_t size;
+};
+
+// memcached-style slab allocator over one arena. The arena is cut into
+// PAGE_SIZE pages that are handed to slab classes on demand; each class
+// cuts its pages into equal chunks, with chunk sizes growing by
+// GROWTH_FACTOR from MIN_CHUNK_SIZE up to one page. Pages never move
+// between classes once assigned.
+class SlabAllocator {
+public:
+  static constexpr uint32_t PAGE_SIZE = 1024 * 1024;
+  static constexpr uint32_t MIN_CHUNK_SIZE = 96;
+  static constexpr double GROWTH_FACTOR = 1.25;
+
+  SlabAllocator(uint64_t capacity);
+  ~SlabAllocator();
+
+  uint32_t numClasses() const { return classes.size(); }
+  uint32_t chunkSize(uint32_t cls) const { return classes[cls].chunkSize; }
+
+  // smallest class whose chunks fit bytes; -1 if bytes > PAGE_SIZE
+  uint32_t classFor(uint32_t bytes) const;
+
+  // a free chunk of class cls, taking a new page if needed; nullptr if
+  // the class is full and there are no free pages
+  char* allocate(uint32_t cls);
+  void free(uint32_t cls, char* chunk);
+
+  // a uniformly random chunk of class cls (allocated or not); nullptr
+  // if the class has no pages
+  char* randomChunk(uint32_t cls, uint64_t random) const;
+
+  uint64_t capacity() const { return numPages * (uint64_t)PAGE_SIZE; }
+  uint64_t assignedBytes() const { return (numPages - freePages) * (uint64_t)PAGE_SIZE; }
+  uint64_t usedBytes() const { return usedChunkBytes; }
+
+  void dumpStats() const;
+
+private:
+  struct SlabClass {
+    uint32_t chunkSize;
+    uint32_t chunksPerPage;
+    std::vector<char*> pages;
+    std::vector<char*> freeChunks;
+    uint64_t usedChunks = 0;
+  };
+
+  char* arena;
+  uint64_t numPages;
+  uint64_t freePages;
+  uint64_t usedChunkBytes;
+  std::vector<SlabClass> classes;
+};
+
+// Precedes the key and value in every item's chunk.
+struct ItemHeader {
+  uint32_t keySize;
+  uint32_t valueSize;
+  // slab class + 1; 0 marks a free chunk
+  uint32_t slabClass;
+};
+
+// In-process key-value store whose evictions are chosen by a
+// replacement policy from repl::Policy::create's repertoire (LHD or
+// LRU). Capacity is enforced on the arena, so it includes item headers
+// and slab fragmentation that the simulator (cache.hpp) ignores.
+//
+// Items are named to the policy by their chunk address, which is
+// unique while the item is alive. An eviction for a set must free a
+// chunk of the set's slab class, so the store samples
+// EVICTION_SAMPLES allocated chunks of that class and lets the policy
+// pick one (Policy::rankAmong).
+//
+// Not thread-safe.
+class Store {
+public:
+  static constexpr uint32_t EVICTION_SAMPLES = 32;
+  // give up on a set after evicting this many items without freeing a
+  // chunk of the right class (can only happen when the class is tiny)
+  static constexpr uint32_t MAX_EVICTIONS_PER_SET = 1024;
+
+  // policy is "LHD" or "LRU"
+  Store(uint64_t capacity, const std::string& policy,
+        const repl::LHDParams& params = repl::LHDParams());
+  ~Store();
+
+  bool get(const char* key, uint32_t keySize, ValueView& value);
+  bool set(const char* key, uint32_t keySize, const char* value, uint32_t valueSize);
+  bool del(const char* key, uint32_t keySize);
+
+  bool get(const std::string& key, ValueView& value) {
+    return get(key.data(), key.size(), value);
+  }
+  bool set(const std::string& key, const std::string& value) {
+    return set(key.data(), key.size(), value.data(), value.size());
+  }
+  bool del(const std::string& key) {
+    return del(key.data(), key.size());
+  }
+
+  uint64_t numItems() const { return index.size(); }
+
+  // unlike get, not an access: no stats, and the policy isn't told
+  bool contains(const char* key, uint32_t keySize) const {
+    return index.find(Key{key, keySize}) != index.end();
+  }
+
+  // stats
+  uint64_t gets = 0;
+  uint64_t hits = 0;
+  uint64_t sets = 0;
+  uint64_t failedSets = 0;
+  uint64_t deletes = 0;
+  uint64_t evictions = 0;
+  uint64_t keyValueBytes = 0;
+
+  void dumpStats() const;
+
+private:
+  struct Key {
+    const char* data;
+    uint32_t size;
+
+    bool operator==(const Key& that) const {
+      return size == that.size && memcmp(data, that.data, size) == 0;
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      // FNV-1a
+      uint64_t hash = 14695981039346656037ull;
+      for (uint32_t i = 0; i < key.size; i++) {
+        hash = (hash ^ (uint8_t)key.data[i]) * 1099511628211ull;
+      }
+      return hash;
+    }
+  };
+
+  static ItemHeader* header(char* chunk) { return (ItemHeader*)chunk; }
+  static char* keyOf(char* chunk) { return chunk + sizeof(ItemHeader); }
+  static char* valueOf(char* chunk) { return keyOf(chunk) + header(chunk)->keySize; }
+
+  static repl::candidate_t candidate(char* chunk) {
+    return repl::candidate_t{0, (int64_t)chunk};
+  }
+
+  static parser::Request request(char* chunk, int32_t type) {
+    auto* h = header(chunk);
+    return parser::Request{0., 0, type, (int32_t)h->keySize, h->valueSize,
+                           (int64_t)chunk, false};
+  }
+
+  char* evictFor(uint32_t cls, const parser::Request& req);
+  // evicted: chosen by the policy, rather than deleted or replaced
+  void remove(char* chunk, bool evicted);
+
+  SlabAllocator slabs;
+  // keys point into their chunks
+  std::unordered_map<Key, char*, KeyHash> index;
+
+  // accounting seen by the policy (capacity, bytes in use)
+  cache::Cache accounting;
+  repl::Policy* policy;
+
+  misc::Rand rand;
+  std::vector<repl::candidate_t> samples;
+};
+
+}
@@ -1,22 +1,52 @@
 #include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <libconfig.h++>
 #include "cache.hpp"
+#include "runner.hpp"
+#include "config.hpp"
 #include "lhd.hpp"
 #include "rand.hpp"
+#include "timing.hpp"
 
 namespace repl {
 
-// invoked by 
-//	repl::Policy* repl::Policy::create(cache::Cache* cache, 
-//		const libconfig::Setting &settings)
-//	in repl.cpp 
-//	_associativity is from cache={assoc} in example.cfg 
-//	_admissions is from cache={admissionSamples} in example.cfg 
-LHD::LHD(int _associativity, int _admissions, cache::Cache* _cache)
-    : ASSOCIATIVITY(_associativity)
-    , ADMISSIONS(_admissions)
+// invoked by createLHD() below
+//	params.associativity is from cache={assoc} in example.cfg 
+//	params.admissions is from cache={admissionSamples} in example.cfg 
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+LHD<H, A, M, S>::LHD(const LHDParams& params, cache::Cache* _cache)
+    : ASSOCIATIVITY(params.associativity)
+    , ADMISSIONS(params.admissions)
+    , AGE_COARSENING_ERROR_TOLERANCE(params.ageCoarseningErrorTolerance)
+    , ACCS_PER_RECONFIGURATION(params.accsPerReconfiguration)
+    , EWMA_DECAY(params.ewmaDecay)
+    , MAX_OVERFLOW_RATE(params.maxOverflowRate)
+    , ADAPTIVE_RECONFIGURATION(params.adaptiveReconfiguration)
+    , MIN_ACCS_PER_RECONFIGURATION(params.minAccsPerReconfiguration > 0 ?
+                                   params.minAccsPerReconfiguration :
+                                   std::max<uint64_t>(params.accsPerReconfiguration / 8, 1))
+    , MAX_ACCS_PER_RECONFIGURATION(params.maxAccsPerReconfiguration > 0 ?
+                                   params.maxAccsPerReconfiguration :
+                                   8 * params.accsPerReconfiguration)
+    , STALENESS_THRESHOLD(params.stalenessThreshold)
+    , SIZE_CLASS_BASE_LOG2(31 - __builtin_clz(std::max<uint32_t>(params.sizeClassBase, 1)))
+    , SIZE_CLASS_STEP(std::max<uint32_t>(params.sizeClassStep, 1))
+    , COST_AWARE(params.costAware)
+    , QUANTIZE(params.quantize)
+    , REPORT_QUANTIZATION(params.quantize && params.reportQuantization)
+    , FLOAT_DENSITIES(!params.quantize || params.reportQuantization)
+    , MAX_BATCH_VICTIMS(params.maxBatchVictims)
+    , ADAPTIVE_ASSOCIATIVITY(params.adaptiveAssociativity)
+    , MAX_ASSOCIATIVITY(params.maxAssociativity > 0 ?
+                        params.maxAssociativity : 4 * params.associativity)
+    , ADAPTIVE_QUANTILE(params.adaptiveQuantile > 0 ?
+                        params.adaptiveQuantile : 1. / params.associativity)
     , cache(_cache)
-    , recentlyAdmitted(ADMISSIONS, INVALID_CANDIDATE) {
-    nextReconfiguration = ACCS_PER_RECONFIGURATION;
+    , tags(ADMISSIONS) {
+    nextReconfiguration = ADAPTIVE_RECONFIGURATION ?
+        std::max<timestamp_t>(MIN_ACCS_PER_RECONFIGURATION / RECONFIGURATION_CHECKS, 1) :
+        ACCS_PER_RECONFIGURATION;
     explorerBudget = _cache->availableCapacity * EXPLORER_BUDGET_FRACTION;
  
 	// lhd.hpp:    
@@ -30,20 +60,26 @@ LHD::LHD(int _associativity, int _admissions, cache::Cache* _cache)
 	//	Note: MAX_AGE is a coarsened age 
         cl.hits.resize(MAX_AGE, 0);
         cl.evictions.resize(MAX_AGE, 0);
-        cl.hitDensities.resize(MAX_AGE, 0);
+        if (FLOAT_DENSITIES) { cl.hitDensities.resize(MAX_AGE, 0); }
+        if (QUANTIZE) { cl.quantizedHitDensities.resize(MAX_AGE, 0); }
+        if (COST_AWARE) { cl.hitCosts.resize(MAX_AGE, 0); }
+        cl.freshHitAges.resize(AGE_BUCKETS, 0);
+        cl.freshEvictionAges.resize(AGE_BUCKETS, 0);
+        cl.modelHitAges.resize(AGE_BUCKETS, 0);
+        cl.modelEvictionAges.resize(AGE_BUCKETS, 0);
     }
 
     // Initialize policy to ~GDSF by default.
     for (uint32_t c = 0; c < NUM_CLASSES; c++) {
         for (age_t a = 0; a < MAX_AGE; a++) {
-            classes[c].hitDensities[a] =
-                1. * (c + 1) / (a + 1);
+            setClassDensity(classes[c], a, 1. * (c + 1) / (a + 1));
         }
     }
 }
 
 // return struct candidate_t of the eviction victim 
-candidate_t LHD::rank(const parser::Request& req) {
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+candidate_t LHD<H, A, M, S>::rank(const parser::Request& req) {
     uint64_t victim = -1;
 	// lhd.hpp
 	//	namespace repl {
@@ -64,6 +100,25 @@ candidate_t LHD::rank(const parser::Request& req) {
         (numReconfigurations > 50)?
         ASSOCIATIVITY : 8;
 
+    if (ADAPTIVE_ASSOCIATIVITY && numReconfigurations > 50) {
+        victim = rankAdaptive(candidates);
+        rankedCandidates += candidates + ADMISSIONS;
+        recordSampleSize(candidates);
+        victimRank = getHitDensity(tags[victim]);
+        ewmaVictimHitDensity = EWMA_DECAY * ewmaVictimHitDensity + (1 - EWMA_DECAY) * victimRank;
+        return tags[victim].id;
+    }
+
+    rankedCandidates += candidates + ADMISSIONS;
+    recordSampleSize(candidates);
+
+    if (QUANTIZE) {
+        victim = rankQuantized(candidates);
+        victimRank = getHitDensity(tags[victim]);
+        ewmaVictimHitDensity = EWMA_DECAY * ewmaVictimHitDensity + (1 - EWMA_DECAY) * victimRank;
+        return tags[victim].id;
+    }
+
     for (uint32_t i = 0; i < candidates; i++) {
 	// lhd.hpp::namespace repl::class LHD 
 	//	std::vector<Tag> tags; 
@@ -91,24 +146,16 @@ candidate_t LHD::rank(const parser::Request& req) {
         }
     }
 
-    for (uint32_t i = 0; i < ADMISSIONS; i++) {
-	// lhd.hpp::namespace repl::class LHD::
-	//	std::unordered_map<candidate_t, uint64_t> indices;
-        auto itr = indices.find(recentlyAdmitted[i]);
-	// a recently admitted may have already been evicted and, therefore, not 
-	//	in indices 
-        if (itr == indices.end()) { continue; }
-
-        auto idx = itr->second;
-        auto& tag = tags[idx];
-        assert(tag.id == recentlyAdmitted[i]);
-        rank_t rank = getHitDensity(tag);
+	// a recently admitted may have already been evicted; forEachAdmitted()
+	//	skips those 
+    tags.forEachAdmitted([&](uint64_t idx) {
+        rank_t rank = getHitDensity(tags[idx]);
 
         if (rank < victimRank) {
             victim = idx;
             victimRank = rank;
         }
-    }
+    });
 
     assert(victim != (uint64_t)-1);
 
@@ -120,24 +167,233 @@ candidate_t LHD::rank(const parser::Request& req) {
     return tags[victim].id;
 }
 
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::rank(const parser::Request& req, uint64_t bytesNeeded,
+                        std::vector<candidate_t>& victims) {
+    // guess how many victims we need from the average object size
+    rank_t avgObjectSize = 1. * cache->consumedCapacity / std::max<uint64_t>(tags.size(), 1);
+    uint32_t numVictims = std::ceil(bytesNeeded / std::max<rank_t>(avgObjectSize, 1.));
+    numVictims = std::min(std::max(numVictims, 1u), MAX_BATCH_VICTIMS);
+
+    if (numVictims == 1) {
+        victims.push_back(rank(req));
+        return;
+    }
+
+    // same warmup hack as rank()
+    uint32_t candidates =
+        (numReconfigurations > 50)?
+        ASSOCIATIVITY : 8;
+    uint32_t samples = candidates + (numVictims - 1) * candidates / 2;
+
+    batchSample.clear();
+    for (uint32_t i = 0; i < samples; i++) {
+        auto idx = rand.next() % tags.size();
+        batchSample.push_back({getRank(tags[idx]), idx});
+    }
+
+    tags.forEachAdmitted([&](uint64_t idx) {
+        batchSample.push_back({getRank(tags[idx]), idx});
+    });
+
+    rankedCandidates += batchSample.size();
+    ++batchRankings;
+
+    // sampling is with replacement, so duplicates end up adjacent
+    std::sort(batchSample.begin(), batchSample.end());
+
+    uint64_t freed = 0;
+    uint32_t taken = 0;
+    uint64_t last = -1;
+    for (auto& sample : batchSample) {
+        if (sample.second == last) { continue; }
+        last = sample.second;
+
+        auto& tag = tags[sample.second];
+        victims.push_back(tag.id);
+
+        rank_t victimRank = QUANTIZE ? getHitDensity(tag) : sample.first;
+        ewmaVictimHitDensity = EWMA_DECAY * ewmaVictimHitDensity + (1 - EWMA_DECAY) * victimRank;
+
+        freed += tag.size;
+        if (++taken == numVictims || freed >= bytesNeeded) { break; }
+    }
+
+    batchVictims += taken;
+}
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+candidate_t LHD<H, A, M, S>::rankAmong(const parser::Request& req,
+                                    const candidate_t* candidates, uint32_t numCandidates) {
+    uint64_t victim = -1;
+    rank_t victimRank = std::numeric_limits<rank_t>::max();
+
+    for (uint32_t i = 0; i < numCandidates; i++) {
+        auto idx = tags.find(candidates[i]);
+        assert(idx != tags.NOT_FOUND);
+        rank_t rank = getRank(tags[idx]);
+
+        if (rank < victimRank) {
+            victim = idx;
+            victimRank = rank;
+        }
+    }
+    rankedCandidates += numCandidates;
+
+    assert(victim != (uint64_t)-1);
+
+    if (QUANTIZE) { victimRank = getHitDensity(tags[victim]); }
+    ewmaVictimHitDensity = EWMA_DECAY * ewmaVictimHitDensity + (1 - EWMA_DECAY) * victimRank;
+
+    return tags[victim].id;
+}
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+bool LHD<H, A, M, S>::admits(const parser::Request& req, candidate_t victim) {
+    // the tag update() would give it, at age 0
+    Tag tag{};
+    tag.lastLastHitAge = MAX_AGE;
+    tag.lastHitAge = 0;
+    tag.app = req.appId % APP_CLASSES;
+    tag.size = req.size();
+    tag.sizeClass = getSizeClass(req.size());
+    tag.explorer = false;
+    rank_t density = getHitDensity(tag, 0);
+
+    rank_t victimDensity = ewmaVictimHitDensity;
+    if (victim != INVALID_CANDIDATE) {
+        auto idx = tags.find(victim);
+        assert(idx != tags.NOT_FOUND);
+        victimDensity = getHitDensity(tags[idx]);
+    }
+    return density >= victimDensity;
+}
+
+// rank() with a variable sample size (see ADAPTIVE_ASSOCIATIVITY);
+// returns the index of the victim in tags and the number of
+// candidates sampled in candidates.
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+uint64_t LHD<H, A, M, S>::rankAdaptive(uint32_t& candidates) {
+    uint64_t victim = -1;
+    rank_t victimRank = std::numeric_limits<rank_t>::max();
+
+    // recently admitted objects first: they are likely victims and can
+    // end sampling early. they are not a random sample, so they don't
+    // feed the quantile estimate.
+    tags.forEachAdmitted([&](uint64_t idx) {
+        rank_t rank = getRank(tags[idx]);
+
+        if (rank < victimRank) {
+            victim = idx;
+            victimRank = rank;
+        }
+    });
+
+    uint32_t samples = 0;
+    while (samples < MAX_ASSOCIATIVITY) {
+        auto idx = rand.next() % tags.size();
+        rank_t rank = getRank(tags[idx]);
+        ++samples;
+        updateLowQuantile(rank);
+
+        if (rank < victimRank) {
+            victim = idx;
+            victimRank = rank;
+        }
+
+        if (samples >= MIN_ADAPTIVE_ASSOCIATIVITY
+            && lowQuantileValid
+            && victimRank <= lowQuantile) {
+            break;
+        }
+    }
+
+    assert(victim != (uint64_t)-1);
+    candidates = samples;
+    return victim;
+}
+
+// rank() with integer comparisons on quantized densities; returns
+// the index of the victim in tags. the sample (and hence the rand
+// sequence) is identical to the float model, so with
+// REPORT_QUANTIZATION we can check victim agreement directly.
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+uint64_t LHD<H, A, M, S>::rankQuantized(uint32_t candidates) {
+    uint64_t victim = -1;
+    qrank_t victimRank = std::numeric_limits<qrank_t>::max();
+    uint64_t floatVictim = -1;
+    rank_t floatVictimRank = std::numeric_limits<rank_t>::max();
+
+    for (uint32_t i = 0; i < candidates; i++) {
+        auto idx = rand.next() % tags.size();
+        auto& tag = tags[idx];
+        auto age = getAge(tag);
+        qrank_t rank = getQuantizedHitDensity(tag, age);
+
+        if (rank < victimRank) {
+            victim = idx;
+            victimRank = rank;
+        }
+
+        if (REPORT_QUANTIZATION) {
+            rank_t floatRank = getHitDensity(tag, age);
+            if (floatRank < floatVictimRank) {
+                floatVictim = idx;
+                floatVictimRank = floatRank;
+            }
+        }
+    }
+
+    tags.forEachAdmitted([&](uint64_t idx) {
+        auto& tag = tags[idx];
+        auto age = getAge(tag);
+        qrank_t rank = getQuantizedHitDensity(tag, age);
+
+        if (rank < victimRank) {
+            victim = idx;
+            victimRank = rank;
+        }
+
+        if (REPORT_QUANTIZATION) {
+            rank_t floatRank = getHitDensity(tag, age);
+            if (floatRank < floatVictimRank) {
+                floatVictim = idx;
+                floatVictimRank = floatRank;
+            }
+        }
+    });
+
+    assert(victim != (uint64_t)-1);
+
+    if (REPORT_QUANTIZATION) {
+        ++quantizedRankings;
+        if (victim == floatVictim) { ++quantizedAgreements; }
+    }
+
+    return victim;
+}
+
 // called by namespace cache::class Cache::access() 
-void LHD::update(candidate_t id, const parser::Request& req) {
-    auto itr = indices.find(id);
-    bool insert = (itr == indices.end());
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::update(candidate_t id, const parser::Request& req) {
+    auto idx = tags.find(id);
+    bool insert = (idx == tags.NOT_FOUND);
         
     Tag* tag;
     if (insert) {
-	// namespace cache{class Cache{std::vector<Tag> tags;}}
-        tags.push_back(Tag{});
-	// back(): returns reference to the last element 
-        tag = &tags.back();
-        indices[id] = tags.size() - 1;
+	// sampler.hpp: appends a Tag with tag.id = id 
+        tag = &tags.insert(id);
         
         tag->lastLastHitAge = MAX_AGE;
         tag->lastHitAge = 0;
-        tag->id = id;
+    } else if (req.type != parser::GET) {
+        // a write (SET, ADD or INCREMENT) to a cached object restarts
+        // its age with the new size, but it is not a hit
+        tag = &tags[idx];
+        assert(tag->id == id);
+        if (tag->explorer) { explorerBudget += tag->size; }
     } else {
-        tag = &tags[itr->second];
+        tag = &tags[idx];
         assert(tag->id == id);
 	// lhd.hpp
 	//	inline age_t getAge(Tag tag) {...} 
@@ -147,6 +403,10 @@ void LHD::update(candidate_t id, const parser::Request& req) {
 	//	inline Class& getClass(const Tag& tag) {...} 
         auto& cl = getClass(*tag);
         cl.hits[age] += 1;
+        cl.freshHits += 1;
+        cl.freshHitAges[ageBucket(age)] += 1;
+        // the hit saves this request's miss cost
+        if (COST_AWARE) { cl.hitCosts[age] += cache->missCost(req); }
 
         if (tag->explorer) { explorerBudget += tag->size; }
         
@@ -157,6 +417,8 @@ void LHD::update(candidate_t id, const parser::Request& req) {
     tag->timestamp = timestamp;
     tag->app = req.appId % APP_CLASSES;
     tag->size = req.size();
+    tag->sizeClass = getSizeClass(req.size());
+    if (QUANTIZE) { tag->logSize = quantizeLog(tag->size); }
 
     // with some probability, some candidates will never be evicted
     // ... but limit how many resources we spend on doing this
@@ -171,30 +433,103 @@ void LHD::update(candidate_t id, const parser::Request& req) {
     // If this candidate looks like something that should be
     // evicted, track it.
     if (insert && !explore && getHitDensity(*tag) < ewmaVictimHitDensity) {
-        recentlyAdmitted[recentlyAdmittedHead++ % ADMISSIONS] = id;
+        tags.admit(id);
     }
     
     ++timestamp;
 
     if (--nextReconfiguration == 0) {
-        reconfigure();
-        nextReconfiguration = ACCS_PER_RECONFIGURATION;
-        ++numReconfigurations;
+        if (!ADAPTIVE_RECONFIGURATION) {
+            reconfigure();
+            nextReconfiguration = ACCS_PER_RECONFIGURATION;
+        } else {
+            if (reconfigurationDue()) { reconfigure(); }
+            nextReconfiguration =
+                std::max<timestamp_t>(MIN_ACCS_PER_RECONFIGURATION / RECONFIGURATION_CHECKS, 1);
+        }
+    }
+}
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+bool LHD<H, A, M, S>::reconfigurationDue() {
+    timestamp_t interval = timestamp - lastReconfiguration;
+    if (interval < MIN_ACCS_PER_RECONFIGURATION) { return false; }
+    // the initial model isn't built from data
+    if (numReconfigurations == 0 || interval >= MAX_ACCS_PER_RECONFIGURATION) { return true; }
+
+    rank_t stale = staleness();
+    if (stale <= STALENESS_THRESHOLD) {
+        staleChecks = 0;
+        return false;
     }
+    // one stale check may be noise, or a blip that passes
+    if (++staleChecks < STALE_CHECKS) { return false; }
+    cumulativeStaleness += stale;
+    ++staleReconfigurations;
+    return true;
+}
+
+// how far the events since the last reconfiguration have drifted
+// from the model, as the larger of two divergences: the hits and
+// evictions per class against those of the interval the model was
+// last built from, and the same per class and age bucket (see
+// ageBucket()) against the model's histograms. the second catches
+// shifts in when objects hit or are evicted that leave the totals
+// alone. each is a 2 x n table; its chi-squared statistic of
+// homogeneity less its degrees of freedom (what sampling noise alone
+// would give), over the number of events, estimates the squared
+// effect size (phi^2). it is about 0 while the workload holds still.
+// against the model, it grows with the share of the fresh events, ie
+// with how far a reconfiguration would move the model, so a model
+// that trails a slow drift (as any decayed average does) is rebuilt
+// every so often rather than at every check.
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+typename LHD<H, A, M, S>::rank_t LHD<H, A, M, S>::staleness() const {
+    // chi-squared of a 2 x n table in one pass: it is
+    // sum (a B - b A)^2 / (A B (a + b)) over the columns (a, b), whose
+    // sums are A and B
+    struct Homogeneity {
+        double a = 0, b = 0;
+        double aa = 0, ab = 0, bb = 0;
+        int32_t cells = 0;
+
+        void add(double cellA, double cellB) {
+            double total = cellA + cellB;
+            if (total == 0) { return; }
+            a += cellA;
+            b += cellB;
+            aa += cellA * cellA / total;
+            ab += cellA * cellB / total;
+            bb += cellB * cellB / total;
+            ++cells;
+        }
+
+        double effectSize() const {
+            if (a == 0 || b == 0) { return 0; }
+            double chiSquared = b / a * aa - 2 * ab + a / b * bb;
+            return std::max(chiSquared - (cells - 1), 0.) / (a + b);
+        }
+    };
+
+    Homogeneity totals;
+    Homogeneity ages;
+    for (auto& cl : classes) {
+        totals.add(cl.freshHits, cl.lastHits);
+        totals.add(cl.freshEvictions, cl.lastEvictions);
+        for (uint32_t b = 0; b < AGE_BUCKETS; b++) {
+            ages.add(cl.freshHitAges[b], cl.modelHitAges[b]);
+            ages.add(cl.freshEvictionAges[b], cl.modelEvictionAges[b]);
+        }
+    }
+    return std::max(totals.effectSize(), ages.effectSize());
 }
 
 // invoked by cache.hpp
 //	cache::struct Cache{void access(const parser::Request& req) {...}} 
-void LHD::replaced(candidate_t id) {
-	// lhd.hpp 
-	// namespace repl { class LHD { 
-		// stores the index of each candidate_t struct 
-		//	in std::vector<Tag> tags
-		// std::unordered_map<candidate_t, uint64_t> indices;
-	// }	}
-    auto itr = indices.find(id);
-    assert(itr != indices.end());
-    auto index = itr->second;
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::replaced(candidate_t id) {
+    auto index = tags.find(id);
+    assert(index != tags.NOT_FOUND);
 
     // Record stats before removing item
     auto& tag = tags[index];
@@ -202,20 +537,31 @@ void LHD::replaced(candidate_t id) {
     auto age = getAge(tag);
     auto& cl = getClass(tag);
     cl.evictions[age] += 1;
+    cl.freshEvictions += 1;
+    cl.freshEvictionAges[ageBucket(age)] += 1;
 
     if (tag.explorer) { explorerBudget += tag.size; }
 
-    // Remove tag for replaced item and update index
-    indices.erase(itr);
-    tags[index] = tags.back();
-    tags.pop_back();
+    // Remove tag for replaced item; the last tag takes its place
+    tags.remove(index);
+}
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::reconfigure() {
+    misc::OpTimer timer(misc::OP_RECONFIGURE);
+    auto start = std::chrono::steady_clock::now();
 
-    if (index < tags.size()) {
-        indices[tags[index].id] = index;
+    // decides whether to rescale ages before the histograms are decayed,
+    // so that updateClass() does both
+    int32_t ageShiftDelta = adaptAgeCoarsening();
+
+    // with adaptive scheduling, decay as much per access as a fixed
+    // interval would
+    rank_t decay = EWMA_DECAY;
+    if (ADAPTIVE_RECONFIGURATION) {
+        decay = std::pow(EWMA_DECAY, 1. * (timestamp - lastReconfiguration) / ACCS_PER_RECONFIGURATION);
     }
-}
 
-void LHD::reconfigure() {
 	// typedef float rank_t;
     rank_t totalHits = 0;
     rank_t totalEvictions = 0;
@@ -224,15 +570,26 @@ void LHD::reconfigure() {
 	// sum up decayed hits[] and evictions[] counts 
 	// 	cl.totalHits <- sum(cl.hits[]) 
 	// 	cl.totalEvictions <- sum(cl.evictions[]) 
-        updateClass(cl); 
+        updateClass(cl, ageShiftDelta, decay); 
         totalHits += cl.totalHits;
         totalEvictions += cl.totalEvictions;
     }
-
-    adaptAgeCoarsening();
         
     modelHitDensity();
 
+    // the next interval is compared with this one (see staleness())
+    for (auto& cl : classes) {
+        cl.lastHits = cl.freshHits;
+        cl.lastEvictions = cl.freshEvictions;
+        cl.freshHits = 0;
+        cl.freshEvictions = 0;
+        std::fill(cl.freshHitAges.begin(), cl.freshHitAges.end(), 0);
+        std::fill(cl.freshEvictionAges.begin(), cl.freshEvictionAges.end(), 0);
+    }
+    lastReconfiguration = timestamp;
+    staleChecks = 0;
+    ++numReconfigurations;
+
     // Just printfs ...
     for (uint32_t c = 0; c < classes.size(); c++) {
         auto& cl = classes[c];
@@ -247,34 +604,49 @@ void LHD::reconfigure() {
            totalHits, totalEvictions,
            totalHits / (totalHits + totalEvictions),
            overflows,
-           1. * overflows / ACCS_PER_RECONFIGURATION);
+           1. * overflows / std::max<uint64_t>(agesComputed, 1));
 
+    totalOverflows += overflows;
+    totalAgesComputed += agesComputed;
     overflows = 0;
-}
-
-void LHD::updateClass(Class& cl) {
-    cl.totalHits = 0;
-    cl.totalEvictions = 0;
+    agesComputed = 0;
+    oldAges = 0;
 
-    for (age_t age = 0; age < MAX_AGE; age++) {
-        cl.hits[age] *= EWMA_DECAY;
-        cl.evictions[age] *= EWMA_DECAY;
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    reconfigurationSeconds += seconds;
+    maxReconfigurationSeconds = std::max(maxReconfigurationSeconds, seconds);
+}
 
-        cl.totalHits += cl.hits[age];
-        cl.totalEvictions += cl.evictions[age];
-    }
+// one pass over each of the class's histograms, whether or not the
+// age coarsening changed (see rescaleAndDecay())
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::updateClass(Class& cl, int32_t ageShiftDelta, rank_t decay) {
+    cl.totalHits = rescaleAndDecay(cl.hits, ageShiftDelta, decay);
+    cl.totalEvictions = rescaleAndDecay(cl.evictions, ageShiftDelta, decay);
+    if (COST_AWARE) { rescaleAndDecay(cl.hitCosts, ageShiftDelta, decay); }
 }
 
 // invoked by reconfigure() 
-void LHD::modelHitDensity() {
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::modelHitDensity() {
 	// ./lhd.hpp:    
 	//	std::vector<Class> classes;
 	//	number of elements = NUM_CLASSES = HIT_AGE_CLASSES*APP_CLASSES 
     for (uint32_t c = 0; c < classes.size(); c++) {
         rank_t totalEvents = classes[c].hits[MAX_AGE-1] + classes[c].evictions[MAX_AGE-1];
-        rank_t totalHits = classes[c].hits[MAX_AGE-1];
+        // with COST_AWARE, "hits" below are cost-weighted
+        auto& hits = COST_AWARE ? classes[c].hitCosts : classes[c].hits;
+        rank_t totalHits = hits[MAX_AGE-1];
         rank_t lifetimeUnconditioned = totalEvents;
 
+        // the model's events by age bucket, for staleness()
+        auto& hitAges = classes[c].modelHitAges;
+        auto& evictionAges = classes[c].modelEvictionAges;
+        std::fill(hitAges.begin(), hitAges.end(), 0);
+        std::fill(evictionAges.begin(), evictionAges.end(), 0);
+        hitAges[AGE_BUCKETS-1] = classes[c].hits[MAX_AGE-1];
+        evictionAges[AGE_BUCKETS-1] = classes[c].evictions[MAX_AGE-1];
+
         // we use a small trick here to compute expectation in O(N) by
         // accumulating all values at later ages in
         // lifetimeUnconditioned.
@@ -284,33 +656,103 @@ void LHD::modelHitDensity() {
 	//	decremented, it becomes MAX(uint64_t) due to overflow and breaks 
 	//	the loop condition        
         for (age_t a = MAX_AGE - 2; a < MAX_AGE; a--) {
-            totalHits += classes[c].hits[a];
+            totalHits += hits[a];
             
             totalEvents += classes[c].hits[a] + classes[c].evictions[a];
+            hitAges[ageBucket(a)] += classes[c].hits[a];
+            evictionAges[ageBucket(a)] += classes[c].evictions[a];
 
             lifetimeUnconditioned += totalEvents;
 
             if (totalEvents > 1e-5) {
-                classes[c].hitDensities[a] = totalHits / lifetimeUnconditioned;
+                setClassDensity(classes[c], a, totalHits / lifetimeUnconditioned);
             } else {
-                classes[c].hitDensities[a] = 0.;
+                setClassDensity(classes[c], a, 0.);
+            }
+        }
+    }
+}
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::dumpStats(cache::Cache* cache) {
+    printf("LHD sampling | ranked %lu candidates, %g per evicted object, %g per evicted KB\n",
+           rankedCandidates,
+           1. * rankedCandidates / cache->evictions,
+           1024. * rankedCandidates / cache->cumulativeEvictedSpace);
+    printf("LHD reconfiguration | %d reconfigurations, %g accesses apart, %g s total, %g ms mean, %g ms max",
+           numReconfigurations,
+           1. * lastReconfiguration / std::max(numReconfigurations, 1),
+           reconfigurationSeconds,
+           1e3 * reconfigurationSeconds / std::max(numReconfigurations, 1),
+           1e3 * maxReconfigurationSeconds);
+    if (ADAPTIVE_RECONFIGURATION) {
+        printf(" | adaptive (%lu-%lu accesses), %lu triggered by staleness (mean %g)",
+               MIN_ACCS_PER_RECONFIGURATION, MAX_ACCS_PER_RECONFIGURATION,
+               staleReconfigurations,
+               cumulativeStaleness / std::max<uint64_t>(staleReconfigurations, 1));
+    }
+    printf("\n");
+    printf("LHD age coarsening | shift %lu, %lu adjustments after the first | overflow rate %g (%lu of %lu ages)\n",
+           ageCoarseningShift, coarseningShifts,
+           1. * (totalOverflows + overflows) / std::max<uint64_t>(totalAgesComputed + agesComputed, 1),
+           totalOverflows + overflows, totalAgesComputed + agesComputed);
+    uint64_t rankings = 0;
+    for (auto count : sampleSizes) { rankings += count; }
+    printf("LHD sample sizes | %lu rankings, %g sampled per ranking |",
+           rankings, 1. * sampledCandidates / std::max<uint64_t>(rankings, 1));
+    for (uint32_t b = 0; b < sampleSizes.size(); b++) {
+        if (sampleSizes[b] == 0) { continue; }
+        printf(" <=%u: %lu (%g%%)", 1u << b, sampleSizes[b], 100. * sampleSizes[b] / rankings);
+    }
+    printf("\n");
+    if (batchRankings > 0) {
+        printf("LHD batch eviction | %lu batch rounds, %g victims per round\n",
+               batchRankings, 1. * batchVictims / batchRankings);
+    }
+    if (SIZE_CLASSES > 1) {
+        // decayed hits and evictions of each size class, summed over
+        // apps and hit ages
+        printf("LHD size classes | %u classes, density tables %lu bytes |",
+               NUM_CLASSES, densityTableBytes());
+        for (uint32_t s = 0; s < SIZE_CLASSES; s++) {
+            rank_t hits = 0;
+            rank_t evictions = 0;
+            for (uint32_t c = 0; c < NUM_CLASSES; c++) {
+                if (c / HIT_AGE_CLASSES % SIZE_CLASSES != s) { continue; }
+                hits += classes[c].totalHits;
+                evictions += classes[c].totalEvictions;
             }
+            printf(" %s%uB: hit rate %g (%g events)",
+                   s == 0 ? "<" : ">=",
+                   s == 0 ? 1u << SIZE_CLASS_BASE_LOG2 : 1u << (SIZE_CLASS_BASE_LOG2 + (s - 1) * SIZE_CLASS_STEP),
+                   hits / std::max<rank_t>(hits + evictions, 1), hits + evictions);
         }
+        printf("\n");
+    }
+    if (QUANTIZE) {
+        printf("LHD quantization | density tables %lu bytes (float only: %lu bytes)\n",
+               densityTableBytes(), NUM_CLASSES * MAX_AGE * sizeof(rank_t));
+    }
+    if (REPORT_QUANTIZATION) {
+        printf("LHD quantization | victims agreed with float model %lu / %lu (%g%%)\n",
+               quantizedAgreements, quantizedRankings,
+               100. * quantizedAgreements / quantizedRankings);
     }
 }
 
-void LHD::dumpClassRanks(Class& cl) {
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+void LHD<H, A, M, S>::dumpClassRanks(Class& cl) {
     if (!DUMP_RANKS) { return; }
     
     // float objectAvgSize = cl.sizeAccumulator / cl.totalHits; // + cl.totalEvictions);
-    float objectAvgSize = 1. * cache->consumedCapacity / cache->getNumObjects();
+    float objectAvgSize = 1. * cache->consumedCapacity / tags.size();
     rank_t left;
 
     left = cl.totalHits + cl.totalEvictions;
     std::cout << "Ranks for avg object (" << objectAvgSize << "): ";
     for (age_t a = 0; a < MAX_AGE; a++) {
       std::stringstream rankStr;
-      rank_t density = cl.hitDensities[a] / objectAvgSize;
+      rank_t density = classDensity(cl, a) / objectAvgSize;
       rankStr << density << ", ";
       std::cout << rankStr.str();
 
@@ -350,78 +792,237 @@ void LHD::dumpClassRanks(Class& cl) {
     std::cout << std::endl;
 }
 
-// this happens very rarely!
-//
 // it is simple enough to set the age coarsening if you know roughly
 // how big your objects are. to make LHD run on different traces
 // without needing to configure this, we set the age coarsening
-// automatically near the beginning of the trace.
-void LHD::adaptAgeCoarsening() {
+// automatically: once shortly after the trace starts, from the
+// average number of objects, and then a step at a time as the
+// workload drifts (see MAX_OVERFLOW_RATE). returns the change in
+// ageCoarseningShift, which updateClass() applies to the histograms.
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+int32_t LHD<H, A, M, S>::adaptAgeCoarsening() {
     ewmaNumObjects *= EWMA_DECAY;
     ewmaNumObjectsMass *= EWMA_DECAY;
 
-    ewmaNumObjects += cache->getNumObjects();
+    ewmaNumObjects += tags.size();
     ewmaNumObjectsMass += 1.;
 
     rank_t numObjects = ewmaNumObjects / ewmaNumObjectsMass;
 
     rank_t optimalAgeCoarsening = 1. * numObjects / (AGE_COARSENING_ERROR_TOLERANCE * MAX_AGE);
 
-    // Simplify. Just do this once shortly after the trace starts and
-    // again after 25 iterations. It only matters that we are within
-    // the right order of magnitude to avoid tons of overflows.
-    if (numReconfigurations == 5 || numReconfigurations == 25) {
-        uint32_t optimalAgeCoarseningLog2 = 1;
+    uint32_t optimalAgeCoarseningLog2 = 1;
+    while ((1 << optimalAgeCoarseningLog2) < optimalAgeCoarsening) {
+        optimalAgeCoarseningLog2 += 1;
+    }
 
-        while ((1 << optimalAgeCoarseningLog2) < optimalAgeCoarsening) {
-            optimalAgeCoarseningLog2 += 1;
-        }
+    rank_t overflowRate = 1. * overflows / std::max<uint64_t>(agesComputed, 1);
+    int32_t delta = 0;
+
+    if (numReconfigurations == 5) {
+        // jump straight to the estimate; it only matters that we are
+        // within the right order of magnitude to avoid tons of
+        // overflows
+        delta = optimalAgeCoarseningLog2 - ageCoarseningShift;
 
-        int32_t delta = optimalAgeCoarseningLog2 - ageCoarseningShift;
-        ageCoarseningShift = optimalAgeCoarseningLog2;
-        
         // increase weight to delay another shift for a while
         ewmaNumObjects *= 8;
         ewmaNumObjectsMass *= 8;
-        
-        // compress or stretch distributions to approximate new scaling
-        // regime
-        if (delta < 0) {
-            // stretch
-            for (auto& cl : classes) {
-                for (age_t a = MAX_AGE >> (-delta); a < MAX_AGE - 1; a++) {
-                    cl.hits[MAX_AGE - 1] += cl.hits[a];
-                    cl.evictions[MAX_AGE - 1] += cl.evictions[a];
-                }
-                for (age_t a = MAX_AGE - 2; a < MAX_AGE; a--) {
-                    cl.hits[a] = cl.hits[a >> (-delta)] / (1 << (-delta));
-                    cl.evictions[a] = cl.evictions[a >> (-delta)] / (1 << (-delta));
-                }
-            }
-        } else if (delta > 0) {
-            // compress
-            for (auto& cl : classes) {
-                for (age_t a = 0; a < MAX_AGE >> delta; a++) {
-                    cl.hits[a] = cl.hits[a << delta];
-                    cl.evictions[a] = cl.evictions[a << delta];
-                    for (int i = 1; i < (1 << delta); i++) {
-                        cl.hits[a] += cl.hits[(a << delta) + i];
-                        cl.evictions[a] += cl.evictions[(a << delta) + i];
-                    }
-                }
-                for (age_t a = (MAX_AGE >> delta); a < MAX_AGE - 1; a++) {
-                    cl.hits[a] = 0;
-                    cl.evictions[a] = 0;
-                }
-            }
+    } else if (numReconfigurations > 5) {
+        int32_t vote = 0;
+        if (optimalAgeCoarseningLog2 > ageCoarseningShift) {
+            vote = 1;
+        } else if (optimalAgeCoarseningLog2 < ageCoarseningShift
+                   && 2. * oldAges / std::max<uint64_t>(agesComputed, 1) <= MAX_OVERFLOW_RATE) {
+            // finer ages double, so the old half would overflow
+            vote = -1;
+        }
+
+        if (vote == 0 || vote * coarseningVotes < 0) {
+            coarseningVotes = vote;
+        } else {
+            coarseningVotes += vote;
+        }
+
+        if (overflowRate > MAX_OVERFLOW_RATE) {
+            // old objects are losing ranking resolution; don't wait
+            delta = 1;
+        } else if (coarseningVotes >= COARSENING_HYSTERESIS) {
+            delta = 1;
+        } else if (coarseningVotes <= -COARSENING_HYSTERESIS && ageCoarseningShift > 0) {
+            delta = -1;
+        }
+        if (delta != 0) {
+            coarseningVotes = 0;
+            ++coarseningShifts;
         }
     }
-    
-    printf("LHD at %lu | ageCoarseningShift now %lu | num objects %g | optimal age coarsening %g | current age coarsening %g\n",
+
+    ageCoarseningShift += delta;
+
+    printf("LHD at %lu | ageCoarseningShift now %lu | num objects %g | optimal age coarsening %g | current age coarsening %g | overflow rate %g\n",
            timestamp, ageCoarseningShift,
            numObjects,
            optimalAgeCoarsening,
-           1. * (1 << ageCoarseningShift));
+           1. * (1 << ageCoarseningShift),
+           overflowRate);
+
+    return delta;
+}
+
+// decays a histogram over ages and returns its new total. if the age
+// coarsening changed, it also compresses (delta > 0) or stretches
+// (delta < 0) the histogram by 2^|delta| to approximate the new
+// scaling regime, in the same in-place pass: compressing walks up, so
+// each age reads only later ages, and stretching walks down, so each
+// age reads only earlier ones. the last age collects overflows and is
+// only decayed, except that stretching moves ages that no longer fit
+// into it.
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S>
+typename LHD<H, A, M, S>::rank_t
+LHD<H, A, M, S>::rescaleAndDecay(std::vector<rank_t>& histogram, int32_t delta, rank_t decay) {
+    rank_t total = 0;
+
+    if (delta > 0) {
+        // compress
+        for (age_t a = 0; a < MAX_AGE - 1; a++) {
+            rank_t sum = 0;
+            if (a < (MAX_AGE >> delta)) {
+                for (age_t i = a << delta; i < std::min((a + 1) << delta, MAX_AGE - 1); i++) {
+                    sum += histogram[i];
+                }
+            }
+            histogram[a] = decay * sum;
+            total += histogram[a];
+        }
+    } else if (delta < 0) {
+        // stretch
+        rank_t overflow = 0;
+        for (age_t a = MAX_AGE - 2; a < MAX_AGE; a--) {
+            if (a >= (MAX_AGE >> (-delta))) { overflow += histogram[a]; }
+            histogram[a] = decay * histogram[a >> (-delta)] / (1 << (-delta));
+            total += histogram[a];
+        }
+        histogram[MAX_AGE - 1] += overflow;
+    } else {
+        for (age_t a = 0; a < MAX_AGE - 1; a++) {
+            histogram[a] *= decay;
+            total += histogram[a];
+        }
+    }
+
+    histogram[MAX_AGE - 1] *= decay;
+    return total + histogram[MAX_AGE - 1];
+}
+
+LHDParams LHDParams::read(const libconfig::Setting &settings) {
+    misc::ConfigReader cfg(settings);
+    LHDParams params;
+
+    params.associativity = cfg.read<int>("cache.assoc");
+    params.admissions = cfg.read<int>("cache.admissionSamples");
+    params.quantize = cfg.read<bool>("repl.quantizeDensities", params.quantize);
+    params.reportQuantization = cfg.read<bool>("repl.reportQuantization", params.reportQuantization);
+    params.maxBatchVictims = cfg.read<int>("repl.maxBatchVictims", params.maxBatchVictims);
+    params.adaptiveAssociativity =
+        cfg.read<bool>("repl.adaptiveAssociativity", params.adaptiveAssociativity);
+    params.maxAssociativity = cfg.read<int>("repl.maxAssociativity", params.maxAssociativity);
+    params.adaptiveQuantile = cfg.read<float>("repl.adaptiveQuantile", params.adaptiveQuantile);
+    params.ageCoarseningErrorTolerance =
+        cfg.read<float>("repl.ageCoarseningErrorTolerance", params.ageCoarseningErrorTolerance);
+    params.accsPerReconfiguration =
+        cfg.read<int>("repl.accsPerInterval", params.accsPerReconfiguration);
+    params.ewmaDecay = cfg.read<float>("repl.ewmaDecay", params.ewmaDecay);
+    params.costAware = cfg.read<bool>("repl.costAware", params.costAware);
+    params.maxOverflowRate = cfg.read<float>("repl.maxOverflowRate", params.maxOverflowRate);
+    params.adaptiveReconfiguration =
+        cfg.read<bool>("repl.adaptiveReconfiguration", params.adaptiveReconfiguration);
+    params.minAccsPerReconfiguration =
+        cfg.read<int>("repl.minAccsPerInterval", params.minAccsPerReconfiguration);
+    params.maxAccsPerReconfiguration =
+        cfg.read<int>("repl.maxAccsPerInterval", params.maxAccsPerReconfiguration);
+    params.stalenessThreshold = cfg.read<float>("repl.stalenessThreshold", params.stalenessThreshold);
+    params.sizeClassBase = cfg.read<int>("repl.sizeClassBase", params.sizeClassBase);
+    params.sizeClassStep = cfg.read<int>("repl.sizeClassStep", params.sizeClassStep);
+
+    assert(params.accsPerReconfiguration > 0);
+    assert(params.maxBatchVictims > 0);
+    assert(params.ewmaDecay > 0 && params.ewmaDecay < 1);
+    return params;
+}
+
+template class LHD<16, 16, 20000>;
+template class LHD<16,  1, 20000>;
+template class LHD<16, 64, 20000>;
+template class LHD< 8, 16, 20000>;
+template class LHD<32, 16, 20000>;
+template class LHD<16, 16,  4096>;
+template class LHD<16,  1,  4096, 8>;
+
+namespace {
+
+// the table shapes compiled into the simulator (keep in sync with the
+// instantiations above and in lhd.hpp). add a line to each (and
+// rebuild) to support another combination.
+struct LHDShape {
+    uint32_t hitAgeClasses;
+    uint32_t appClasses;
+    uint64_t maxAge;
+    uint32_t sizeClasses;
+    cache::Runner* (*create)(const LHDParams& params, cache::Cache* cache);
+};
+
+template <uint32_t H, uint32_t A, uint64_t M, uint32_t S = 1>
+cache::Runner* createShape(const LHDParams& params, cache::Cache* cache) {
+    return cache::makeRunner(cache, new LHD<H, A, M, S>(params, cache));
+}
+
+const LHDShape SHAPES[] = {
+    { 16, 16, 20000, 1, createShape<16, 16, 20000> }, // default
+    { 16,  1, 20000, 1, createShape<16,  1, 20000> }, // single-app traces
+    { 16, 64, 20000, 1, createShape<16, 64, 20000> },
+    {  8, 16, 20000, 1, createShape< 8, 16, 20000> },
+    { 32, 16, 20000, 1, createShape<32, 16, 20000> },
+    { 16, 16,  4096, 1, createShape<16, 16,  4096> }, // compact tables
+    // size classes; 128 classes x 4096 ages keeps each table at 2MB,
+    // within a last-level cache
+    { 16,  1,  4096, 8, createShape<16,  1,  4096, 8> },
+};
+
+}
+
+cache::Runner* createLHD(cache::Cache* cache, const libconfig::Setting &settings) {
+    misc::ConfigReader cfg(settings);
+    LHDParams params = LHDParams::read(settings);
+
+    uint32_t hitAgeClasses = cfg.read<int>("repl.hitAgeClasses", 16);
+    uint32_t appClasses = cfg.read<int>("repl.appClasses", 16);
+    uint64_t maxAge = cfg.read<int>("repl.maxAge", 20000);
+    uint32_t sizeClasses = cfg.read<int>("repl.sizeClasses", 1);
+
+    for (auto& shape : SHAPES) {
+        if (shape.hitAgeClasses == hitAgeClasses
+            && shape.appClasses == appClasses
+            && shape.maxAge == maxAge
+            && shape.sizeClasses == sizeClasses) {
+            std::cout << "LHD shape: " << hitAgeClasses << " hit age classes, "
+                      << appClasses << " app classes, max age " << maxAge
+                      << ", " << sizeClasses << " size classes" << std::endl;
+            return shape.create(params, cache);
+        }
+    }
+
+    std::cerr << "No LHD instantiation for hitAgeClasses = " << hitAgeClasses
+              << ", appClasses = " << appClasses
+              << ", maxAge = " << maxAge
+              << ", sizeClasses = " << sizeClasses << "; available:" << std::endl;
+    for (auto& shape : SHAPES) {
+        std::cerr << "  " << shape.hitAgeClasses << ", "
+                  << shape.appClasses << ", " << shape.maxAge
+                  << ", " << shape.sizeClasses << std::endl;
+    }
+    exit(-2);
+    return nullptr;
 }
 
 } // namespace repl
@@ -2,21 +2,63 @@
 
 #include <vector>
 #include <limits>
+#include <cmath>
 #include "repl.hpp"
 #include "rand.hpp"
+#include "sampler.hpp"
 
 namespace cache {
 
 class Cache;
+class Runner;
 
 }
 
+namespace libconfig {
+  class Setting;
+}
+
 namespace repl {
 
+// run-time tuning knobs, read from the repl and cache groups of the
+// config file (see LHDParams::read()). the table-shape parameters are
+// template parameters of LHD instead, see below.
+struct LHDParams {
+    int associativity = 32;
+    int admissions = 8;
+    bool quantize = false;
+    bool reportQuantization = false;
+    int maxBatchVictims = 8;
+    bool adaptiveAssociativity = false;
+    int maxAssociativity = 0; // 0: 4 * associativity
+    float adaptiveQuantile = 0; // 0: 1 / associativity
+    float ageCoarseningErrorTolerance = 0.01;
+    uint64_t accsPerReconfiguration = (1 << 20);
+    float ewmaDecay = 0.9;
+    bool costAware = false;
+    float maxOverflowRate = 0.001;
+    bool adaptiveReconfiguration = false;
+    uint64_t minAccsPerReconfiguration = 0; // 0: accsPerReconfiguration / 8
+    uint64_t maxAccsPerReconfiguration = 0; // 0: 8 * accsPerReconfiguration
+    float stalenessThreshold = 0.05;
+    // with SIZE_CLASSES > 1: objects under sizeClassBase bytes are size
+    // class 0, and each class after spans 2^sizeClassStep times more
+    uint32_t sizeClassBase = 64;
+    uint32_t sizeClassStep = 2;
+
+    static LHDParams read(const libconfig::Setting &settings);
+};
+
+// HIT_AGE_CLASSES, APP_CLASSES, MAX_AGE and SIZE_CLASSES size the
+// class tables and bound the loops in the hot path, so they are
+// compile-time constants; lhd.cpp instantiates a fixed set of shapes,
+// and createLHD() picks one from the config file.
+template <uint32_t HIT_AGE_CLASSES_, uint32_t APP_CLASSES_, uint64_t MAX_AGE_,
+          uint32_t SIZE_CLASSES_ = 1>
 class LHD : public virtual Policy {
   public:
 
-    LHD(int _associativity, int _admissions, cache::Cache *cache);
+    LHD(const LHDParams& params, cache::Cache *cache);
     ~LHD() {}
 
     // called whenever and object is referenced
@@ -28,13 +70,30 @@ class LHD : public virtual Policy {
     // called to find a victim upon a cache miss
     candidate_t rank(const parser::Request& req);
 
-    void dumpStats(cache::Cache* cache) { }
+    // called to find victims freeing bytesNeeded upon a cache miss;
+    // returns the lowest-density candidates of one wider sample
+    void rank(const parser::Request& req, uint64_t bytesNeeded,
+              std::vector<candidate_t>& victims);
+
+    // called to find a victim among caller-sampled candidates
+    candidate_t rankAmong(const parser::Request& req,
+                          const candidate_t* candidates, uint32_t numCandidates);
+
+    // compares the hit density a new object would start with against
+    // victim's, or the recent victims' average if there is no victim
+    bool admits(const parser::Request& req, candidate_t victim);
+
+    void dumpStats(cache::Cache* cache);
 
   private:
     // TYPES ///////////////////////////////
     typedef uint64_t timestamp_t;
     typedef uint64_t age_t;
     typedef float rank_t;
+    // quantized ranks are log2(density / size) in fixed point, so
+    // comparing two candidates is an integer subtract and compare
+    typedef int32_t qrank_t;
+    typedef uint16_t qdensity_t;
 
     // info we track about each object
     struct Tag {
@@ -48,9 +107,11 @@ class LHD : public virtual Policy {
 	//	tag->app = req.appId % APP_CLASSES;
 	// } 
         uint32_t app;
+        uint32_t sizeClass; // see getSizeClass()
         
         candidate_t id;
         rank_t size; // stored redundantly with cache
+        qrank_t logSize; // quantized log2(size), see quantizeLog()
         bool explorer;
     };
 
@@ -58,10 +119,31 @@ class LHD : public virtual Policy {
     struct Class {
         std::vector<rank_t> hits;
         std::vector<rank_t> evictions;
+        // hits weighted by the miss cost each saved; only used (and
+        // only filled) when COST_AWARE is set
+        std::vector<rank_t> hitCosts;
         rank_t totalHits = 0;
         rank_t totalEvictions = 0;
 
+        // events since the last reconfiguration, and in the interval
+        // before it (see staleness())
+        rank_t freshHits = 0;
+        rank_t freshEvictions = 0;
+        rank_t lastHits = 0;
+        rank_t lastEvictions = 0;
+        // the same by log2 age bucket (see ageBucket()): the events
+        // since the last reconfiguration, and the model's histograms as
+        // of it
+        std::vector<rank_t> freshHitAges;
+        std::vector<rank_t> freshEvictionAges;
+        std::vector<rank_t> modelHitAges;
+        std::vector<rank_t> modelEvictionAges;
+
+        // float densities, kept only if FLOAT_DENSITIES
         std::vector<rank_t> hitDensities;
+        // densities quantized to log-scale fixed point; only used (and
+        // only filled) when QUANTIZE is set
+        std::vector<qdensity_t> quantizedHitDensities;
     };
 
     // CONSTANTS ///////////////////////////
@@ -69,14 +151,15 @@ class LHD : public virtual Policy {
     // how to sample candidates; can significantly impact hit
     // ratio. want a value at least 32; diminishing returns after
     // that.
-    const uint32_t ASSOCIATIVITY = 32;
+    const uint32_t ASSOCIATIVITY;
 
-    // since our cache simulator doesn't bypass objects, we always
-    // consider the last ADMISSIONS objects as eviction candidates
-    // (this is important to avoid very large objects polluting the
-    // cache.) alternatively, you could do bypassing and randomly
+    // unless an admission stage bypasses them (cache.admission =
+    // "lhd", see admits()), the cache simulator inserts every missed
+    // object, so we always consider the last ADMISSIONS objects as
+    // eviction candidates (this is important to avoid very large
+    // objects polluting the cache.) alternatively, you could randomly
     // admit objects as "explorers" (see below).
-    const uint32_t ADMISSIONS = 8;
+    const uint32_t ADMISSIONS;
 
     // escape local minima by having some small fraction of cache
     // space allocated to objects that aren't evicted. 1% seems to be
@@ -90,35 +173,123 @@ class LHD : public virtual Policy {
 
     // these parameters determine how aggressively to classify objects.
     // diminishing returns after a few classes; 16 is safe.
-    static constexpr uint32_t HIT_AGE_CLASSES = 16;
-    static constexpr uint32_t APP_CLASSES = 16;
-    static constexpr uint32_t NUM_CLASSES = HIT_AGE_CLASSES * APP_CLASSES;
+    static constexpr uint32_t HIT_AGE_CLASSES = HIT_AGE_CLASSES_;
+    static constexpr uint32_t APP_CLASSES = APP_CLASSES_;
+    // objects of very different sizes can have different hit-age
+    // curves, which a density divided by size alone doesn't capture.
+    // SIZE_CLASSES > 1 splits every app's classes by log2 size bucket
+    // (see getSizeClass()); the tables grow by the same factor, so the
+    // shapes that use it have a smaller MAX_AGE or fewer app classes.
+    static constexpr uint32_t SIZE_CLASSES = SIZE_CLASSES_;
+    static constexpr uint32_t NUM_CLASSES = HIT_AGE_CLASSES * APP_CLASSES * SIZE_CLASSES;
     
     // these parameters are tuned for simulation performance, and hit
     // ratio is insensitive to them at reasonable values (like these)
-    static constexpr rank_t AGE_COARSENING_ERROR_TOLERANCE = 0.01;
-    static constexpr age_t MAX_AGE = 20000;
-    static constexpr timestamp_t ACCS_PER_RECONFIGURATION = (1 << 20);
-    static constexpr rank_t EWMA_DECAY = 0.9;
+    const rank_t AGE_COARSENING_ERROR_TOLERANCE;
+    static constexpr age_t MAX_AGE = MAX_AGE_;
+    // staleness() compares age distributions in log2 buckets of
+    // coarsened age: age 0, then [2^(i-1), 2^i) for bucket i
+    static constexpr uint32_t AGE_BUCKETS = 65 - __builtin_clzll(MAX_AGE - 1);
+    const timestamp_t ACCS_PER_RECONFIGURATION;
+    const rank_t EWMA_DECAY;
+
+    // after the first adaptation (see adaptAgeCoarsening()), the age
+    // coarsening moves one power of two at a time: coarser as soon as
+    // more than MAX_OVERFLOW_RATE of computed ages overflow, otherwise
+    // toward the object-count estimate once it has pointed the same way
+    // for COARSENING_HYSTERESIS reconfigurations in a row. it only gets
+    // finer if that wouldn't overflow more than half as often.
+    const rank_t MAX_OVERFLOW_RATE;
+    static constexpr int32_t COARSENING_HYSTERESIS = 3;
+
+    // reconfigure when the model looks stale rather than every
+    // ACCS_PER_RECONFIGURATION accesses: every RECONFIGURATION_CHECKS-th
+    // of MIN_ACCS_PER_RECONFIGURATION, compare the hits and evictions
+    // since the last reconfiguration with those of the interval before
+    // it, and their ages with the model's (see staleness()). reconfigure
+    // once either differs by more than STALENESS_THRESHOLD at
+    // STALE_CHECKS checks in a row, or unconditionally after
+    // MAX_ACCS_PER_RECONFIGURATION. the EWMA decay is scaled to the
+    // interval, so that history fades at the same rate per access as
+    // with the fixed schedule.
+    const bool ADAPTIVE_RECONFIGURATION;
+    const timestamp_t MIN_ACCS_PER_RECONFIGURATION;
+    const timestamp_t MAX_ACCS_PER_RECONFIGURATION;
+    const rank_t STALENESS_THRESHOLD;
+    const uint32_t SIZE_CLASS_BASE_LOG2;
+    const uint32_t SIZE_CLASS_STEP;
+    static constexpr uint32_t RECONFIGURATION_CHECKS = 4;
+    static constexpr uint32_t STALE_CHECKS = 2;
+
+    // weight hits by the miss cost they save (Cache::missCost()), so
+    // that densities are expected cost saved per byte-time rather than
+    // hits. lifetimes still count every hit and eviction as one event.
+    const bool COST_AWARE;
 
     // verbose debugging output?
     static constexpr bool DUMP_RANKS = false;
 
+    // rank with 16-bit log-scale densities instead of floats. the
+    // fixed point has DENSITY_LOG_SCALE steps per power of two (ie,
+    // ~0.3% relative error) and covers densities down to
+    // 2^-DENSITY_LOG_OFFSET; quantized density 0 is reserved for
+    // density 0.
+    const bool QUANTIZE;
+    static constexpr rank_t DENSITY_LOG_SCALE = 256;
+    static constexpr rank_t DENSITY_LOG_OFFSET = 192;
+
+    // also rank each sample with floats and count how often the
+    // quantized model picks the same victim (slow; for validation)
+    const bool REPORT_QUANTIZATION;
+    // whether classes keep float densities. with QUANTIZE, they don't
+    // (unless REPORT_QUANTIZATION needs them to compare), so the model
+    // is half the size; the few float uses (victim and admission
+    // densities) decode the quantized table.
+    const bool FLOAT_DENSITIES;
+
+    // most victims returned by one batch ranking round. each victim
+    // beyond the first widens the sample by half the usual number of
+    // candidates, so batches sample less per evicted object.
+    const uint32_t MAX_BATCH_VICTIMS;
+
+    // size the sample per rank() instead of always taking
+    // ASSOCIATIVITY candidates: stop as soon as the best candidate so
+    // far is at or below a running estimate of the
+    // ADAPTIVE_QUANTILE-quantile of sampled densities, but sample at
+    // least MIN_ADAPTIVE_ASSOCIATIVITY and at most MAX_ASSOCIATIVITY.
+    // when many objects are clearly dead this stops after a few
+    // samples; when densities are hard to separate it samples more
+    // than ASSOCIATIVITY. off by default: it ranks fewer candidates
+    // but has not raised the hit ratio on any trace we have tried.
+    const bool ADAPTIVE_ASSOCIATIVITY;
+    const uint32_t MAX_ASSOCIATIVITY;
+    const rank_t ADAPTIVE_QUANTILE;
+    static constexpr uint32_t MIN_ADAPTIVE_ASSOCIATIVITY = 8;
+    // quantile estimator step, in log2 units of density
+    static constexpr rank_t LOW_QUANTILE_STEP = 1. / 16;
+
     // FIELDS //////////////////////////////
     cache::Cache *cache;
 
-    // object metadata; indices maps object id -> metadata
-	// tags stores all cached objects 
-    std::vector<Tag> tags;
+    // object metadata, and the recently admitted objects (see
+    // ADMISSIONS above)
+    Sampler<Tag> tags;
     std::vector<Class> classes;
-	// stores the index of each candidate_t struct in std::vector<Tag> tags 
-    std::unordered_map<candidate_t, uint64_t> indices;
 
     // time is measured in # of requests
     timestamp_t timestamp = 0;
     
     timestamp_t nextReconfiguration = 0;
     int numReconfigurations = 0;
+    timestamp_t lastReconfiguration = 0;
+    // time spent in reconfigure(), and the staleness that triggered
+    // the adaptive reconfigurations
+    double reconfigurationSeconds = 0;
+    double maxReconfigurationSeconds = 0;
+    rank_t cumulativeStaleness = 0;
+    uint64_t staleReconfigurations = 0;
+    // checks in a row that found the model stale
+    uint32_t staleChecks = 0;
     
     // how much to shift down age values; initial value doesn't really
     // matter, but must be positive. tuned in adaptAgeCoarsening() at
@@ -129,18 +300,26 @@ class LHD : public virtual Policy {
 
     // how many objects had age > max age (this should almost never
     // happen -- if you observe non-neglible overflows, something has
-    // gone wrong with the age coarsening!!!)
+    // gone wrong with the age coarsening!!!), out of agesComputed
+    // calls to getAge() since the last reconfiguration
     uint64_t overflows = 0;
+    uint64_t agesComputed = 0;
+    // ages in the upper half of the range, which would overflow with
+    // half the age coarsening
+    uint64_t oldAges = 0;
+    uint64_t totalOverflows = 0;
+    uint64_t totalAgesComputed = 0;
+    // reconfigurations in a row that wanted a coarser (> 0) or finer
+    // (< 0) age coarsening
+    int32_t coarseningVotes = 0;
+    uint64_t coarseningShifts = 0;
 
     misc::Rand rand;
 
-    // see ADMISSIONS above
-    std::vector<candidate_t> recentlyAdmitted;
-    int recentlyAdmittedHead = 0;
 	// used in LHD::rank() to identify newly admitted objects that should be 
 	//	considered for upcoming evictions. In LHD::update(), the struct 
 	//	candidate_t objects of 
-	//	these objects are stored in recentlyAdmitted[]. 
+	//	these objects are passed to tags.admit(). 
 	//	We do not want them to stay in the cache for too long because 
 	//	their low densities (i.e., below ewmaVictimHitDensity) 
     rank_t ewmaVictimHitDensity = 0;
@@ -152,6 +331,26 @@ class LHD : public virtual Policy {
 	//			* EXPLORER_BUDGET_FRACTION;
 	//
     int64_t explorerBudget = 0;
+
+    // see REPORT_QUANTIZATION above
+    uint64_t quantizedRankings = 0;
+    uint64_t quantizedAgreements = 0;
+
+    // sampling cost: candidates whose density was computed in rank()
+    uint64_t rankedCandidates = 0;
+    uint64_t batchRankings = 0;
+    uint64_t batchVictims = 0;
+    // scratch space for batch ranking: (density, index in tags)
+    std::vector<std::pair<rank_t, uint64_t>> batchSample;
+
+    // see ADAPTIVE_ASSOCIATIVITY above; lowQuantile is in the same
+    // units as getRank()
+    rank_t lowQuantile = 0;
+    bool lowQuantileValid = false;
+    // number of rank() calls by samples taken, in power-of-two buckets
+    // (bucket i counts sample sizes in (2^(i-1), 2^i])
+    std::vector<uint64_t> sampleSizes;
+    uint64_t sampledCandidates = 0;
     
     // METHODS /////////////////////////////
 
@@ -166,10 +365,20 @@ class LHD : public virtual Policy {
         return log;
     }
 
+    // 0 below 2^SIZE_CLASS_BASE_LOG2 bytes, then one class per
+    // SIZE_CLASS_STEP powers of two, the last open-ended
+    inline uint32_t getSizeClass(uint32_t size) const {
+        if (SIZE_CLASSES == 1) { return 0; }
+        uint32_t log = 31 - __builtin_clz(std::max<uint32_t>(size, 1));
+        if (log < SIZE_CLASS_BASE_LOG2) { return 0; }
+        return std::min<uint32_t>((log - SIZE_CLASS_BASE_LOG2) / SIZE_CLASS_STEP + 1,
+                                  SIZE_CLASSES - 1);
+    }
+
     inline uint32_t getClassId(const Tag& tag) const {
         uint32_t hitAgeId = hitAgeClass(tag.lastHitAge + tag.lastLastHitAge);
 	// Note: tag.app <- req.appId % APP_CLASSES 
-        return tag.app * HIT_AGE_CLASSES + hitAgeId;
+        return (tag.app * SIZE_CLASSES + tag.sizeClass) * HIT_AGE_CLASSES + hitAgeId;
     }
     
 /**
@@ -193,6 +402,8 @@ namespace cache {
 	// return the coarsened age 
     inline age_t getAge(Tag tag) {
         timestamp_t age = (timestamp - (timestamp_t)tag.timestamp) >> ageCoarseningShift;
+        ++agesComputed;
+        if (age >= MAX_AGE / 2) { ++oldAges; }
 
         if (age >= MAX_AGE) {
             ++overflows;
@@ -202,22 +413,129 @@ namespace cache {
         }
     }
 
+    static inline uint32_t ageBucket(age_t age) {
+        return age == 0 ? 0 : 64 - __builtin_clzll(age);
+    }
+
     inline rank_t getHitDensity(const Tag& tag) {
 	// age_t getAge(Tag tag) returns the coarsened age 
-        auto age = getAge(tag);
+        return getHitDensity(tag, getAge(tag));
+    }
+
+    inline rank_t getHitDensity(const Tag& tag, age_t age) {
         if (age == MAX_AGE-1) { return std::numeric_limits<rank_t>::lowest(); }
 	// Class& getClass(const Tag& tag) {} 
         auto& cl = getClass(tag);
-        rank_t density = cl.hitDensities[age] / tag.size;
+        rank_t density = classDensity(cl, age) / tag.size;
         if (tag.explorer) { density += 1.; }
         return density;
     }
+
+    inline rank_t classDensity(const Class& cl, age_t age) const {
+        return FLOAT_DENSITIES ? cl.hitDensities[age]
+            : dequantizeDensity(cl.quantizedHitDensities[age]);
+    }
+
+    // bytes of every class's density tables
+    uint64_t densityTableBytes() const {
+        return NUM_CLASSES * MAX_AGE * ((FLOAT_DENSITIES ? sizeof(rank_t) : 0)
+                                        + (QUANTIZE ? sizeof(qdensity_t) : 0));
+    }
+
+    inline void setClassDensity(Class& cl, age_t age, rank_t density) {
+        if (FLOAT_DENSITIES) { cl.hitDensities[age] = density; }
+        if (QUANTIZE) { cl.quantizedHitDensities[age] = quantizeDensity(density); }
+    }
+
+    // same order as getHitDensity(), up to quantization error:
+    // log(density / size) = log(density) - log(size)
+    inline qrank_t getQuantizedHitDensity(const Tag& tag, age_t age) {
+        if (age == MAX_AGE-1) { return std::numeric_limits<qrank_t>::lowest(); }
+        if (tag.explorer) { return std::numeric_limits<qrank_t>::max(); }
+        auto& cl = getClass(tag);
+        return (qrank_t)cl.quantizedHitDensities[age] - tag.logSize;
+    }
+
+    // the density used for ranking, in whichever model is configured
+    inline rank_t getRank(const Tag& tag) {
+        auto age = getAge(tag);
+        return QUANTIZE ? (rank_t)getQuantizedHitDensity(tag, age) : getHitDensity(tag, age);
+    }
+
+    // frugal streaming quantile estimate, stepping in log space: the
+    // quantized ranks are already logarithmic, float densities are
+    // stepped multiplicatively
+    inline void updateLowQuantile(rank_t rank) {
+        if (!lowQuantileValid) {
+            if (QUANTIZE || rank > 0) {
+                lowQuantile = rank;
+                lowQuantileValid = true;
+            }
+            return;
+        }
+        bool below = rank <= lowQuantile;
+        rank_t step = below ? -(1 - ADAPTIVE_QUANTILE) : ADAPTIVE_QUANTILE;
+        if (QUANTIZE) {
+            lowQuantile += step * LOW_QUANTILE_STEP * DENSITY_LOG_SCALE;
+        } else {
+            lowQuantile *= std::exp2(step * LOW_QUANTILE_STEP);
+            lowQuantile = std::max(lowQuantile, std::numeric_limits<rank_t>::min());
+        }
+    }
+
+    inline void recordSampleSize(uint32_t samples) {
+        sampledCandidates += samples;
+        uint32_t bucket = 0;
+        while ((1u << bucket) < samples) { ++bucket; }
+        if (bucket >= sampleSizes.size()) { sampleSizes.resize(bucket + 1, 0); }
+        ++sampleSizes[bucket];
+    }
+
+    static inline qrank_t quantizeLog(rank_t value) {
+        return (qrank_t)(std::log2(value) * DENSITY_LOG_SCALE);
+    }
+
+    static inline qdensity_t quantizeDensity(rank_t density) {
+        if (density <= 0) { return 0; }
+        rank_t code = (std::log2(density) + DENSITY_LOG_OFFSET) * DENSITY_LOG_SCALE;
+        if (code < 1) { return 1; }
+        if (code > std::numeric_limits<qdensity_t>::max()) {
+            return std::numeric_limits<qdensity_t>::max();
+        }
+        return (qdensity_t)code;
+    }
+
+    static inline rank_t dequantizeDensity(qdensity_t code) {
+        if (code == 0) { return 0; }
+        return std::exp2(code / DENSITY_LOG_SCALE - DENSITY_LOG_OFFSET);
+    }
         
+    uint64_t rankQuantized(uint32_t candidates);
+    uint64_t rankAdaptive(uint32_t& candidates);
+    bool reconfigurationDue();
+    rank_t staleness() const;
     void reconfigure();
-    void adaptAgeCoarsening();
-    void updateClass(Class& cl);
+    int32_t adaptAgeCoarsening();
+    static rank_t rescaleAndDecay(std::vector<rank_t>& histogram, int32_t delta, rank_t decay);
+    void updateClass(Class& cl, int32_t ageShiftDelta, rank_t decay);
     void modelHitDensity();
     void dumpClassRanks(Class& cl);
 };
 
+// the shapes compiled into lhd.cpp; see SHAPES there
+extern template class LHD<16, 16, 20000>;
+extern template class LHD<16,  1, 20000>;
+extern template class LHD<16, 64, 20000>;
+extern template class LHD< 8, 16, 20000>;
+extern template class LHD<32, 16, 20000>;
+extern template class LHD<16, 16,  4096>;
+extern template class LHD<16,  1,  4096, 8>;
+
+typedef LHD<16, 16, 20000> DefaultLHD;
+
+// creates the LHD instantiation matching repl.hitAgeClasses,
+// repl.appClasses, repl.maxAge and repl.sizeClasses, and returns its
+// runner. exits if no instantiation matches.
+cache::Runner* createLHD(cache::Cache* cache, const libconfig::Setting &settings);
+
 } // namespace repl
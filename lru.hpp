@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <iostream>
 #include <unordered_map>
+#include <vector>
 #include "repl.hpp"
+#include "index_map.hpp"
 
 namespace repl {
 
@@ -77,6 +81,72 @@ namespace repl {
     Entry *_head, *_tail;
   };
 
+  // Doubly linked list whose entries live in one contiguous pool and
+  // link to each other by index. Released entries go on a free list and
+  // are reused before the pool grows. Entry 0 is the sentinel: its
+  // next is the front and its prev the back.
+  template <typename DataT>
+  struct PooledList {
+    typedef DataT Data;
+    typedef uint32_t index_t;
+
+    struct Entry {
+      Data data;
+      index_t prev;
+      index_t next;
+    };
+
+    static constexpr index_t SENTINEL = 0;
+
+    PooledList() : pool(1, Entry{ Data(), SENTINEL, SENTINEL }) {}
+
+    index_t allocate(const Data& data) {
+      index_t idx;
+      if (freeHead != SENTINEL) {
+	idx = freeHead;
+	freeHead = pool[idx].next;
+	pool[idx].data = data;
+      } else {
+	idx = pool.size();
+	assert(idx != (index_t)-1);
+	pool.push_back(Entry{ data, SENTINEL, SENTINEL });
+      }
+      return idx;
+    }
+
+    // idx must not be linked
+    void release(index_t idx) {
+      pool[idx].next = freeHead;
+      freeHead = idx;
+    }
+
+    void remove(index_t idx) {
+      auto& entry = pool[idx];
+      pool[entry.prev].next = entry.next;
+      pool[entry.next].prev = entry.prev;
+    }
+
+    void insert_front(index_t idx) {
+      auto& entry = pool[idx];
+      entry.prev = SENTINEL;
+      entry.next = pool[SENTINEL].next;
+      pool[entry.next].prev = idx;
+      pool[SENTINEL].next = idx;
+    }
+
+    Data& operator[](index_t idx) { return pool[idx].data; }
+
+    index_t front() const { return pool[SENTINEL].next; }
+    index_t back() const { return pool[SENTINEL].prev; }
+
+    bool empty() const { return front() == SENTINEL; }
+
+    size_t bytes() const { return pool.capacity() * sizeof(Entry); }
+
+    std::vector<Entry> pool;
+    index_t freeHead = SENTINEL;
+  };
+
   template <typename Data>
   struct Tags 
     : public std::unordered_map<candidate_t, typename List<Data>::Entry*> {
@@ -108,17 +178,87 @@ namespace repl {
     }
   };
 
+  // LRU over a PooledList and an IndexMap: no allocation per object
+  // once the pool has grown, and entries are contiguous. Evicts in the
+  // same order as LinkedLRU.
   class LRU : public Policy {
   public:
+    using Policy::rank;
+
+    void update(candidate_t id, const parser::Request& req) {
+      auto idx = indices.find(id);
+      if (idx != IndexMap::NOT_FOUND) {
+	assert(list[idx].id == id);
+	list.remove(idx);
+      } else {
+	idx = list.allocate(Item{ id, 0 });
+	indices.insert(id, idx);
+      }
+
+      list[idx].lastAccess = timestamp++;
+      list.insert_front(idx);
+    }
+
+    void replaced(candidate_t id) {
+      auto idx = indices.find(id);
+      assert(idx != IndexMap::NOT_FOUND);
+      indices.erase(id);
+      list.remove(idx);
+      list.release(idx);
+    }
+
+    candidate_t rank(const parser::Request& req) {
+      return list[list.back()].id;
+    }
+
+    // least recently used among the candidates
+    candidate_t rankAmong(const parser::Request& req,
+                          const candidate_t* candidates, uint32_t numCandidates) {
+      uint32_t victim = IndexMap::NOT_FOUND;
+      for (uint32_t i = 0; i < numCandidates; i++) {
+	auto idx = indices.find(candidates[i]);
+	assert(idx != IndexMap::NOT_FOUND);
+	if (victim == IndexMap::NOT_FOUND || list[idx].lastAccess < list[victim].lastAccess) {
+	  victim = idx;
+	}
+      }
+      return list[victim].id;
+    }
+
+    void dumpStats(cache::Cache* cache) {
+      std::cout << "LRU metadata: " << (list.bytes() + indices.bytes()) << " bytes ("
+		<< (1. * (list.bytes() + indices.bytes()) / std::max<size_t>(indices.size(), 1))
+		<< " per object)" << std::endl;
+    }
+
+  private:
+    struct Item {
+      candidate_t id;
+      // time of last access, in # of updates; only used by rankAmong()
+      uint64_t lastAccess;
+    };
+
+    PooledList<Item> list;
+    IndexMap indices;
+    uint64_t timestamp = 0;
+  };
+
+  // The original LRU: a node-based list with an entry allocated per
+  // object. Kept to compare against LRU (repl.type = "LinkedLRU").
+  class LinkedLRU : public Policy {
+  public:
+    using Policy::rank;
+
     void update(candidate_t id, const parser::Request& req) {
       auto* entry = tags.lookup(id);
       if (entry) {
-	assert(entry->data == id);
+	assert(entry->data.id == id);
 	entry->remove();
       } else {
-	entry = tags.allocate(id, id);
+	entry = tags.allocate(id, Item{ id, 0 });
       }
 
+      entry->data.lastAccess = timestamp++;
       list.insert_front(entry);
     }
 
@@ -129,13 +269,34 @@ namespace repl {
     }
 
     candidate_t rank(const parser::Request& req) {
-      return list.back();
+      return list.back().id;
+    }
+
+    // least recently used among the candidates
+    candidate_t rankAmong(const parser::Request& req,
+                          const candidate_t* candidates, uint32_t numCandidates) {
+      Entry* victim = nullptr;
+      for (uint32_t i = 0; i < numCandidates; i++) {
+	auto* entry = tags.lookup(candidates[i]);
+	assert(entry);
+	if (!victim || entry->data.lastAccess < victim->data.lastAccess) {
+	  victim = entry;
+	}
+      }
+      return victim->data.id;
     }
 
   private:
-    List<candidate_t> list;
-    Tags<candidate_t> tags;
-    typedef typename List<candidate_t>::Entry Entry;
+    struct Item {
+      candidate_t id;
+      // time of last access, in # of updates; only used by rankAmong()
+      uint64_t lastAccess;
+    };
+
+    List<Item> list;
+    Tags<Item> tags;
+    typedef typename List<Item>::Entry Entry;
+    uint64_t timestamp = 0;
   };
 
 } // namespace repl
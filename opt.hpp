@@ -0,0 +1,357 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "repl.hpp"
+#include "cache.hpp"
+#include "runner.hpp"
+#include "parser.hpp"
+#include "rand.hpp"
+#include "index_map.hpp"
+#include "sampler.hpp"
+
+namespace repl {
+
+// Next use of every request in a trace, in the order the simulator
+// replays it: entry i is the access number of the next request for the
+// same object as access i, or NEVER. Only GETs that pass the app
+// filter are accesses, as in Cache::access() and PolicyRunner::run().
+//
+// build() makes one pass over the trace. Each time it meets an object
+// again, it appends (previous access, this access) to the bucket file
+// of the previous access's CHUNK of the trace, then fills each chunk
+// in memory from its bucket and appends it to the output. Memory is
+// the last access of each distinct object plus one chunk, so traces
+// larger than RAM work. The file starts with a Header so that later
+// runs reuse it.
+//
+// The reader streams the file forward as the simulation proceeds.
+class NextUse {
+public:
+  typedef uint32_t access_t;
+  static constexpr access_t NEVER = -1;
+  static constexpr uint64_t CHUNK = 1ull << 24;
+  static constexpr uint64_t BUFFER = 1ull << 16;
+
+  struct Header {
+    uint64_t magic;
+    uint64_t totalAccesses;
+    int64_t filterApp;
+    uint64_t accesses;
+  };
+  static constexpr uint64_t MAGIC = 0x4e455854555345ull;
+
+  // opens path, building it first unless it was built for options
+  NextUse(const std::string& path, const std::string& trace,
+          const cache::RunOptions& options)
+    : buffer(BUFFER) {
+    if (!matches(path, options)) { build(path, trace, options); }
+
+    file.open(path, std::ifstream::in | std::ifstream::binary);
+    assert(file.good());
+    file.read((char*)&header, sizeof(header));
+    std::cout << "Next use: " << header.accesses << " accesses from " << path << std::endl;
+  }
+
+  // next use of access, which is no earlier than the last one asked for
+  access_t at(uint64_t access) {
+    assert(access >= bufferStart);
+    if (access >= header.accesses) { return NEVER; }
+
+    while (access >= bufferStart + bufferSize) {
+      bufferStart += bufferSize;
+      uint64_t entries = std::min<uint64_t>(BUFFER, header.accesses - bufferStart);
+      file.seekg(sizeof(Header) + bufferStart * sizeof(access_t));
+      file.read((char*)buffer.data(), entries * sizeof(access_t));
+      assert(file.good());
+      bufferSize = entries;
+    }
+    return buffer[access - bufferStart];
+  }
+
+private:
+  struct Pair {
+    access_t access;
+    access_t next;
+  };
+
+  static bool matches(const std::string& path, const cache::RunOptions& options) {
+    std::ifstream in(path, std::ifstream::in | std::ifstream::binary);
+    Header h;
+    if (!in.read((char*)&h, sizeof(h))) { return false; }
+    return h.magic == MAGIC
+      && h.totalAccesses == options.totalAccesses
+      && h.filterApp == options.filterApp;
+  }
+
+  static std::string bucketPath(const std::string& path, uint64_t bucket) {
+    return path + ".bucket" + std::to_string(bucket);
+  }
+
+  static void build(const std::string& path, const std::string& trace,
+                    const cache::RunOptions& options) {
+    std::cout << "Building next use index " << path << std::endl;
+
+    IndexMap lastAccess;
+    std::vector<std::ofstream> buckets;
+    uint64_t accesses = 0;
+
+    auto visit = [&](const parser::Request& req) {
+      if (options.filterApp != -1 && req.appId != options.filterApp) { return true; }
+      if (req.type != parser::GET) { return true; }
+
+      assert(accesses < NEVER);
+      auto id = candidate_t::make(req);
+      access_t last = lastAccess.find(id);
+      if (last == IndexMap::NOT_FOUND) {
+        lastAccess.insert(id, accesses);
+      } else {
+        uint64_t bucket = last / CHUNK;
+        while (buckets.size() <= bucket) {
+          buckets.emplace_back(bucketPath(path, buckets.size()),
+                               std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+          assert(buckets.back().good());
+        }
+        Pair pair{last, (access_t)accesses};
+        buckets[bucket].write((const char*)&pair, sizeof(pair));
+        lastAccess.assign(id, accesses);
+      }
+
+      ++accesses;
+      return accesses < options.totalAccesses - parser::FAST_FORWARD;
+    };
+
+    {
+      parser::CSVParser parser(trace.c_str());
+      parser.go(visit);
+    }
+    for (auto& bucket : buckets) { bucket.close(); }
+    std::cout << "  > " << accesses << " accesses, "
+              << lastAccess.size() << " objects" << std::endl;
+
+    std::ofstream out(path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+    assert(out.good());
+    Header h{MAGIC, options.totalAccesses, options.filterApp, accesses};
+    out.write((const char*)&h, sizeof(h));
+
+    std::vector<access_t> chunk;
+    for (uint64_t start = 0; start < accesses; start += CHUNK) {
+      uint64_t bucket = start / CHUNK;
+      chunk.assign(std::min<uint64_t>(CHUNK, accesses - start), (access_t)NEVER);
+
+      if (bucket < buckets.size()) {
+        std::ifstream in(bucketPath(path, bucket), std::ifstream::in | std::ifstream::binary);
+        Pair pair;
+        while (in.read((char*)&pair, sizeof(pair))) {
+          chunk[pair.access - start] = pair.next;
+        }
+        in.close();
+        std::remove(bucketPath(path, bucket).c_str());
+      }
+
+      out.write((const char*)chunk.data(), chunk.size() * sizeof(access_t));
+    }
+    assert(out.good());
+  }
+
+  std::ifstream file;
+  Header header;
+  std::vector<access_t> buffer;
+  uint64_t bufferStart = 0;
+  uint64_t bufferSize = 0;
+};
+
+// Belady's MIN: evicts the object whose next use is furthest away,
+// which maximizes hits when objects all have the same size. Objects
+// are kept in a max-heap on next use. A hit pushes the object again
+// instead of updating it in place; entries that no longer match their
+// object are dropped when they reach the top, and the heap is rebuilt
+// when they are more than half of it.
+//
+// This is an upper bound only for fixed-size objects, and it stores
+// every missed object (there is no bypass).
+class OPT : public Policy {
+public:
+  using Policy::rank;
+
+  OPT(cache::Cache* _cache, const std::string& _path)
+    : cache(_cache), path(_path), tags(0) {}
+
+  void prepare(const std::string& trace, const cache::RunOptions& options) {
+    nextUse.reset(new NextUse(path.empty() ? trace + ".nextuse" : path, trace, options));
+  }
+
+  void update(candidate_t id, const parser::Request& req) {
+    auto idx = tags.find(id);
+    Tag* tag = (idx == tags.NOT_FOUND) ? &tags.insert(id) : &tags[idx];
+    tag->next = nextUse->at(cache->accesses - 1);
+    heap.push(Entry{tag->next, id});
+
+    if (heap.size() > 2 * tags.size() + 1024) { rebuild(); }
+  }
+
+  void replaced(candidate_t id) {
+    auto idx = tags.find(id);
+    assert(idx != tags.NOT_FOUND);
+    tags.remove(idx);
+  }
+
+  candidate_t rank(const parser::Request& req) {
+    while (true) {
+      assert(!heap.empty());
+      auto& top = heap.top();
+      if (current(top)) { return top.id; }
+      heap.pop();
+      ++staleEntries;
+    }
+  }
+
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    candidate_t victim = candidates[0];
+    NextUse::access_t victimNext = 0;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      auto idx = tags.find(candidates[i]);
+      assert(idx != tags.NOT_FOUND);
+      if (tags[idx].next >= victimNext) {
+        victim = candidates[i];
+        victimNext = tags[idx].next;
+      }
+    }
+    return victim;
+  }
+
+  void dumpStats(cache::Cache* cache) {
+    std::cout << "OPT: " << staleEntries << " stale heap entries dropped, "
+              << rebuilds << " heap rebuilds" << std::endl;
+  }
+
+private:
+  struct Tag {
+    candidate_t id;
+    NextUse::access_t next;
+  };
+
+  struct Entry {
+    NextUse::access_t next;
+    candidate_t id;
+
+    bool operator<(const Entry& that) const { return next < that.next; }
+  };
+
+  inline bool current(const Entry& entry) const {
+    auto idx = tags.find(entry.id);
+    return idx != tags.NOT_FOUND && tags[idx].next == entry.next;
+  }
+
+  void rebuild() {
+    std::vector<Entry> entries;
+    entries.reserve(tags.size());
+    for (uint64_t i = 0; i < tags.size(); i++) {
+      entries.push_back(Entry{tags[i].next, tags[i].id});
+    }
+    heap = std::priority_queue<Entry>(std::less<Entry>(), std::move(entries));
+    ++rebuilds;
+  }
+
+  cache::Cache* cache;
+  const std::string path;
+  std::unique_ptr<NextUse> nextUse;
+  Sampler<Tag> tags;
+  std::priority_queue<Entry> heap;
+
+  // stats
+  uint64_t staleEntries = 0;
+  uint64_t rebuilds = 0;
+};
+
+// Size-aware approximation of OPT for variable object sizes: evicts
+// the object with the most byte-accesses until its next use, (next use
+// - now) x size, among ASSOCIATIVITY random samples. That key changes
+// as time passes, so it can't be kept in a heap. Objects never used
+// again go first.
+class OPTSize : public Policy {
+public:
+  using Policy::rank;
+
+  OPTSize(cache::Cache* _cache, const std::string& _path, uint32_t _associativity)
+    : ASSOCIATIVITY(_associativity), cache(_cache), path(_path), tags(0) {}
+
+  void prepare(const std::string& trace, const cache::RunOptions& options) {
+    nextUse.reset(new NextUse(path.empty() ? trace + ".nextuse" : path, trace, options));
+  }
+
+  void update(candidate_t id, const parser::Request& req) {
+    auto idx = tags.find(id);
+    Tag* tag = (idx == tags.NOT_FOUND) ? &tags.insert(id) : &tags[idx];
+    tag->next = nextUse->at(cache->accesses - 1);
+    tag->size = req.size();
+  }
+
+  void replaced(candidate_t id) {
+    auto idx = tags.find(id);
+    assert(idx != tags.NOT_FOUND);
+    tags.remove(idx);
+  }
+
+  candidate_t rank(const parser::Request& req) {
+    uint64_t victim = -1;
+    double victimRank = -1;
+    for (uint32_t i = 0; i < ASSOCIATIVITY; i++) {
+      uint64_t idx = tags.sample(rand);
+      double rank = getRank(tags[idx]);
+      if (rank > victimRank) {
+        victim = idx;
+        victimRank = rank;
+      }
+    }
+    return tags[victim].id;
+  }
+
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    candidate_t victim = candidates[0];
+    double victimRank = -1;
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      auto idx = tags.find(candidates[i]);
+      assert(idx != tags.NOT_FOUND);
+      double rank = getRank(tags[idx]);
+      if (rank > victimRank) {
+        victim = candidates[i];
+        victimRank = rank;
+      }
+    }
+    return victim;
+  }
+
+private:
+  struct Tag {
+    candidate_t id;
+    NextUse::access_t next;
+    uint32_t size;
+  };
+
+  inline double getRank(const Tag& tag) const {
+    if (tag.next == NextUse::NEVER) { return std::numeric_limits<double>::max(); }
+    // accesses has been counted for the current access
+    return (double)(tag.next - (cache->accesses - 1)) * tag.size;
+  }
+
+  const uint32_t ASSOCIATIVITY;
+  cache::Cache* cache;
+  const std::string path;
+  std::unique_ptr<NextUse> nextUse;
+  Sampler<Tag> tags;
+  misc::Rand rand;
+};
+
+}
@@ -43,6 +43,53 @@ struct Request {
   int64_t valueSize;
   int64_t id;
   int8_t  miss;
+  // seconds until the object expires, 0 for none (see expiry.hpp); set
+  // only by traces with a ttl column
+  int32_t ttl;
+  // cost of missing this request, 0 if the trace doesn't say (see
+  // cost.hpp)
+  float32_t cost;
+
+  inline int64_t size() const { return keySize + valueSize + MEMCACHED_OVERHEAD; }
+} __attribute__((packed));
+
+// on-disk layouts of the full trace formats; Request has fields of its
+// own, so it is not read directly
+struct FullRequest {
+  float32_t time;
+  int32_t appId;
+  int32_t type;
+  int32_t keySize;
+  int64_t valueSize;
+  int64_t id;
+  int8_t  miss;
+
+  inline int64_t size() const { return keySize + valueSize + MEMCACHED_OVERHEAD; }
+} __attribute__((packed));
+
+struct ExpiringRequest {
+  float32_t time;
+  int32_t appId;
+  int32_t type;
+  int32_t keySize;
+  int64_t valueSize;
+  int64_t id;
+  int8_t  miss;
+  int32_t ttl;
+
+  inline int64_t size() const { return keySize + valueSize + MEMCACHED_OVERHEAD; }
+} __attribute__((packed));
+
+struct CostedRequest {
+  float32_t time;
+  int32_t appId;
+  int32_t type;
+  int32_t keySize;
+  int64_t valueSize;
+  int64_t id;
+  int8_t  miss;
+  int32_t ttl;
+  float32_t cost;
 
   inline int64_t size() const { return keySize + valueSize + MEMCACHED_OVERHEAD; }
 } __attribute__((packed));
@@ -59,7 +106,18 @@ struct MediumRequest {
   inline int64_t size() const { return keySize + valueSize + MEMCACHED_OVERHEAD; }
 } __attribute__((packed));
 
-static constexpr Request NULL_REQUEST{0., 0, 0, 0, 0, 0, false};
+static constexpr Request NULL_REQUEST{0., 0, 0, 0, 0, 0, false, 0, 0.};
+
+template<typename RequestType>
+inline int32_t ttlOf(const RequestType& r) { return 0; }
+
+inline int32_t ttlOf(const ExpiringRequest& r) { return r.ttl; }
+inline int32_t ttlOf(const CostedRequest& r) { return r.ttl; }
+
+template<typename RequestType>
+inline float32_t costOf(const RequestType& r) { return 0.; }
+
+inline float32_t costOf(const CostedRequest& r) { return r.cost; }
 
 struct PartialRequest {
   int32_t appId;
@@ -92,20 +150,29 @@ public:
 		std::getline(file, header);
 	}
 
-	void go(bool (*visit)(const Request& req))
+	template<typename Visitor>
+	void go(Visitor visit)
 	{
 		if (header == "appId.size.id-=iqi!")
 		{
 			goPartial(visit);
 		}
-		/*else if (header == "Time.appId.type.keySize.valueSize.id.miss-=fiiiqi?!")
+		else if (header == "Time.appId.type.keySize.valueSize.id.miss-=fiiiqi?!")
 		{
 			goFull<MediumRequest>(visit);
 		}
 		else if (header == "Time.appId.type.keySize.valueSize.id.miss-=fiiiqq?!")
 		{
-			goFull<Request>(visit);
-		}*/
+			goFull<FullRequest>(visit);
+		}
+		else if (header == "Time.appId.type.keySize.valueSize.id.miss.ttl-=fiiiqq?i!")
+		{
+			goFull<ExpiringRequest>(visit);
+		}
+		else if (header == "Time.appId.type.keySize.valueSize.id.miss.ttl.cost-=fiiiqq?if!")
+		{
+			goFull<CostedRequest>(visit);
+		}
 		else
 		{
 			cerr << "Invalid header in trace: " << header << endl;
@@ -113,7 +180,8 @@ public:
 		}
 	}
 
-	void goPartial(bool (*visit)(const Request& req))
+	template<typename Visitor>
+	void goPartial(Visitor visit)
 	{
 		cout << "goPartial: Trace file contains " << (fileSize / sizeof(PartialRequest)) << " requests.\n";
 		while (file.good())
@@ -147,8 +215,8 @@ public:
 		}
 	}
 	
-	template<typename RequestType>
-	void goFull(bool (*visit)(const Request& req))
+	template<typename RequestType, typename Visitor>
+	void goFull(Visitor visit)
 	{
 		cout << "goFull: Trace file contains " << (fileSize / sizeof(RequestType)) << " requests (each " << sizeof(RequestType) << "B).\n";
 		RequestType r;
@@ -200,6 +268,8 @@ public:
 			
 			r.miss = (int8_t)std::stoi(line.substr(0, line.find(",")));
 			line.erase(0, line.find(",") + 1);
+
+			parseExtra(r, line);
 			
 			r.valueSize = std::max(r.valueSize, 1l);
 			if (r.size() > MAX_REQUEST_SIZE)
@@ -209,12 +279,27 @@ public:
 				assert(r.size() > 0);
 			}
 			
-			Request req { r.time, r.appId, r.type, r.keySize, r.valueSize, r.id, r.miss };
+			Request req { r.time, r.appId, r.type, r.keySize, r.valueSize, r.id, r.miss, ttlOf(r), costOf(r) };
 			
 			if (!visit(req)) { break; }
 		}
 	}
 
+private:
+	// columns after miss, in the formats that have them
+	template<typename RequestType>
+	static void parseExtra(RequestType& r, string& line) {}
+
+	static void parseExtra(ExpiringRequest& r, string& line) {
+		r.ttl = std::stoi(line.substr(0, line.find(",")));
+	}
+
+	static void parseExtra(CostedRequest& r, string& line) {
+		r.ttl = std::stoi(line.substr(0, line.find(",")));
+		line.erase(0, line.find(",") + 1);
+		r.cost = std::stof(line.substr(0, line.find(",")));
+	}
+
 
 };
 
@@ -250,13 +335,18 @@ public:
 		fileSize -= header.size();
   }
 
-  void go(bool (*visit)(const Request& req)) {
+  template<typename Visitor>
+  void go(Visitor visit) {
     if (header == "appId.size.id-=iqi!") {
       goPartial(visit);
     } else if (header == "Time.appId.type.keySize.valueSize.id.miss-=fiiiqi?!") {
       goFull<MediumRequest>(visit);
     } else if (header == "Time.appId.type.keySize.valueSize.id.miss-=fiiiqq?!") {
-      goFull<Request>(visit);
+      goFull<FullRequest>(visit);
+    } else if (header == "Time.appId.type.keySize.valueSize.id.miss.ttl-=fiiiqq?i!") {
+      goFull<ExpiringRequest>(visit);
+    } else if (header == "Time.appId.type.keySize.valueSize.id.miss.ttl.cost-=fiiiqq?if!") {
+      goFull<CostedRequest>(visit);
     } else {
       cerr << "Invalid header in trace: " << header << endl;
       assert(false);
@@ -265,7 +355,8 @@ public:
     if (bytesPerProgressTick != -1ull) { cout << endl; }
   }
 
-  void goPartial(bool (*visit)(const Request& req)) {
+  template<typename Visitor>
+  void goPartial(Visitor visit) {
     cout << "goPartial: Trace file contains " << (fileSize / sizeof(PartialRequest)) << " requests.\n";
     while (file.good()) {
       PartialRequest pr;
@@ -282,8 +373,8 @@ public:
     }
   }
 
-  template<typename RequestType>
-  void goFull(bool (*visit)(const Request& req)) {
+  template<typename RequestType, typename Visitor>
+  void goFull(Visitor visit) {
     cout << "goFull: Trace file contains " 
          << (fileSize / sizeof(RequestType)) << " requests (each " << sizeof(RequestType) << "B).\n";
     RequestType r;
@@ -302,7 +393,7 @@ public:
         r.valueSize = MAX_REQUEST_SIZE - r.keySize - MEMCACHED_OVERHEAD;
         assert(r.size() > 0);
       }
-      Request req { r.time, r.appId, r.type, r.keySize, r.valueSize, r.id, r.miss };
+      Request req { r.time, r.appId, r.type, r.keySize, r.valueSize, r.id, r.miss, ttlOf(r), costOf(r) };
       tick();
       if (!visit(req)) { break; }
     }
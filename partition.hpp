@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "repl.hpp"
+#include "cache.hpp"
+#include "fifo.hpp"
+
+namespace libconfig {
+  class Setting;
+}
+
+namespace repl {
+
+struct PartitionParams {
+  // accesses between rebalancing rounds
+  uint64_t rebalanceInterval = 20 * 1000;
+  // bytes of recently evicted objects each app's shadow queue
+  // remembers, as a fraction of the cache
+  double shadowFraction = 0.01;
+  // bytes moved between two apps per round, as a fraction of the cache
+  double stepFraction = 0.01;
+  // print every app's budget and hit ratio at each round
+  bool report = false;
+
+  static PartitionParams read(const libconfig::Setting &settings);
+};
+
+// Splits the cache into one partition per app (Request::appId), each
+// with its own instance of the configured policy and a byte budget.
+// An app that needs space beyond its budget evicts its own objects;
+// otherwise the app furthest over its budget gives up an object. The
+// budgets start as the apps' shares of the cache when it first fills.
+//
+// Each app's shadow queue remembers the ids of the objects it most
+// recently evicted, shadowFraction of the cache's worth. A hit in the
+// shadow queue is a hit the app would have gotten with that much more
+// space, so shadow hits per byte estimate the marginal hit rate of
+// more budget. Every rebalanceInterval accesses, apps are paired from
+// the highest estimate with the lowest, and each pair whose estimates
+// differ moves stepFraction of the cache from the low app to the high.
+//
+// Each partition's policy sees a cache::Cache of its own that tracks
+// its budget and bytes used, so policies that look at the cache (LHD)
+// work unchanged.
+class Partitioned : public Policy {
+public:
+  using Policy::rank;
+  typedef std::function<Policy*(cache::Cache*)> Factory;
+
+  Partitioned(cache::Cache* _cache, const PartitionParams& _params, Factory _factory)
+    : cache(_cache)
+    , params(_params)
+    , shadowBytes(_params.shadowFraction * _cache->availableCapacity)
+    , step(_params.stepFraction * _cache->availableCapacity)
+    , factory(_factory) {}
+
+  void update(candidate_t id, const parser::Request& req) {
+    auto& p = partition(req.appId);
+    uint32_t size = req.size();
+
+    auto itr = sizes.find(id);
+    if (itr != sizes.end()) {
+      ++p.hits;
+      ++p.windowHits;
+      p.view.consumedCapacity -= itr->second;
+      itr->second = size;
+    } else {
+      if (p.shadow.find(id) != p.shadow.NOT_FOUND) {
+        ++p.windowShadowHits;
+        p.shadowUsed -= p.shadow[p.shadow.find(id)].data;
+        p.shadow.erase(id);
+      }
+      sizes[id] = size;
+      ++p.objects;
+    }
+    p.view.consumedCapacity += size;
+    ++p.accesses;
+    ++p.windowAccesses;
+    p.policy->update(id, req);
+
+    if (++accesses % params.rebalanceInterval == 0) { rebalance(); }
+  }
+
+  void replaced(candidate_t id) {
+    auto& p = partition(id.appId);
+    uint32_t size = forget(p, id);
+
+    p.policy->replaced(id);
+    ++p.view.evictions;
+    p.view.cumulativeEvictedSpace += size;
+
+    p.shadow.push_back(id, size);
+    p.shadowUsed += size;
+    while (p.shadowUsed > shadowBytes) {
+      p.shadowUsed -= p.shadow[p.shadow.front()].data;
+      p.shadow.pop_front();
+    }
+  }
+
+  // expired or deleted objects would not have hit with more space, so
+  // they stay out of the shadow queue and the eviction counts
+  void removed(candidate_t id) {
+    auto& p = partition(id.appId);
+    forget(p, id);
+    p.policy->removed(id);
+  }
+
+  candidate_t rank(const parser::Request& req) {
+    auto& requester = partition(req.appId);
+
+    if (!initialized) {
+      // the cache just filled; start from the shares apps have taken
+      for (auto& p : partitions) { p->setBudget(p->view.consumedCapacity); }
+      initialized = true;
+    }
+
+    Partition* victim = nullptr;
+    if (requester.objects > 0
+        && requester.view.consumedCapacity + req.size() > requester.budget) {
+      victim = &requester;
+    } else {
+      int64_t mostOver = 0;
+      for (auto& p : partitions) {
+        if (p->objects == 0) { continue; }
+        int64_t over = (int64_t)p->view.consumedCapacity - (int64_t)p->budget;
+        if (!victim || over > mostOver) {
+          victim = p.get();
+          mostOver = over;
+        }
+      }
+    }
+    assert(victim != nullptr);
+    return victim->policy->rank(req);
+  }
+
+  void dumpStats(cache::Cache* _cache) {
+    std::cout << "Partitions: " << partitions.size() << ", " << rebalances
+              << " rebalancing rounds, " << misc::bytes(moved) << " moved" << std::endl;
+    for (auto& p : partitions) {
+      std::cout << "  > App " << p->appId << ": "
+                << misc::bytes(p->budget) << " budget, "
+                << misc::bytes(p->view.consumedCapacity) << " used, "
+                << p->objects << " objects, hit ratio "
+                << (100. * p->hits / std::max<uint64_t>(p->accesses, 1)) << "% ("
+                << p->accesses << " accesses)" << std::endl;
+    }
+    for (auto& p : partitions) { p->policy->dumpStats(&p->view); }
+  }
+
+private:
+  struct Partition {
+    int32_t appId;
+    cache::Cache view;
+    std::unique_ptr<Policy> policy;
+    uint64_t budget = 0;
+    uint64_t objects = 0;
+
+    FifoQueue<uint32_t> shadow;
+    uint64_t shadowUsed = 0;
+
+    // stats
+    uint64_t accesses = 0;
+    uint64_t hits = 0;
+    uint64_t windowAccesses = 0;
+    uint64_t windowHits = 0;
+    uint64_t windowShadowHits = 0;
+
+    void setBudget(uint64_t _budget) {
+      budget = _budget;
+      view.availableCapacity = std::max<uint64_t>(budget, 1);
+    }
+  };
+
+  // drops id from p's accounting and returns its size
+  uint32_t forget(Partition& p, candidate_t id) {
+    auto itr = sizes.find(id);
+    assert(itr != sizes.end());
+    uint32_t size = itr->second;
+    sizes.erase(itr);
+    p.view.consumedCapacity -= size;
+    --p.objects;
+    return size;
+  }
+
+  Partition& partition(int32_t appId) {
+    auto itr = appPartitions.find(appId);
+    if (itr != appPartitions.end()) { return *partitions[itr->second]; }
+
+    appPartitions[appId] = partitions.size();
+    partitions.emplace_back(new Partition());
+    auto& p = *partitions.back();
+    p.appId = appId;
+    // policies size themselves by the cache at creation (e.g., LHD's
+    // explorer budget); an equal share is the best guess
+    p.view.availableCapacity = cache->availableCapacity / partitions.size();
+    p.view.costs = cache->costs;
+    p.policy.reset(factory(&p.view));
+    // a new app gets budget only through rebalancing
+    p.setBudget(initialized ? 0 : p.view.availableCapacity);
+    return p;
+  }
+
+  void rebalance() {
+    ++rebalances;
+
+    if (params.report) {
+      for (auto& p : partitions) {
+        std::cout << "Partition " << accesses << ", app " << p->appId
+                  << ": budget " << p->budget
+                  << ", used " << p->view.consumedCapacity
+                  << ", hit ratio " << (100. * p->windowHits / std::max<uint64_t>(p->windowAccesses, 1))
+                  << "%, shadow hits " << p->windowShadowHits << std::endl;
+      }
+    }
+
+    if (initialized) {
+      std::vector<Partition*> order;
+      for (auto& p : partitions) { order.push_back(p.get()); }
+      std::sort(order.begin(), order.end(), [](Partition* a, Partition* b) {
+          return a->windowShadowHits > b->windowShadowHits;
+        });
+
+      // every shadow queue is the same size, so shadow hits compare
+      // marginal hit rates directly
+      for (uint64_t i = 0, j = order.size() - 1; i < j; i++, j--) {
+        auto* gainer = order[i];
+        auto* loser = order[j];
+        if (gainer->windowShadowHits <= loser->windowShadowHits) { break; }
+        uint64_t delta = std::min(step, loser->budget);
+        loser->setBudget(loser->budget - delta);
+        gainer->setBudget(gainer->budget + delta);
+        moved += delta;
+      }
+    }
+
+    for (auto& p : partitions) {
+      p->windowAccesses = 0;
+      p->windowHits = 0;
+      p->windowShadowHits = 0;
+    }
+  }
+
+  cache::Cache* cache;
+  const PartitionParams params;
+  const uint64_t shadowBytes;
+  const uint64_t step;
+  Factory factory;
+
+  std::vector<std::unique_ptr<Partition>> partitions;
+  std::unordered_map<int32_t, uint32_t> appPartitions;
+  std::unordered_map<candidate_t, uint32_t> sizes;
+  bool initialized = false;
+  uint64_t accesses = 0;
+
+  // stats
+  uint64_t rebalances = 0;
+  uint64_t moved = 0;
+};
+
+}
@@ -1,39 +1,123 @@
 #include "repl.hpp"
 #include "cache.hpp"
+#include "runner.hpp"
 #include "constants.hpp"
 
 #include "lhd.hpp"
+#include "concurrent_lhd.hpp"
 #include "lru.hpp"
+#include "sampled.hpp"
+#include "fifo.hpp"
+#include "opt.hpp"
+#include "partition.hpp"
 
 #include <libconfig.h++>
 #include "config.hpp"
 
-repl::Policy* repl::Policy::create(cache::Cache* cache, const libconfig::Setting &settings) {
-  misc::ConfigReader cfg(settings);
+namespace repl {
 
-  std::string type = cfg.read<const char*>("repl.type");
-  
-  std::cout << "Repl: " << type << std::endl;
+namespace {
+
+cache::Runner* createType(cache::Cache* cache, const libconfig::Setting &settings,
+                          const std::string& type) {
+  misc::ConfigReader cfg(settings);
 
   // non-ranking policies
   if (type == "LRU") {
-    return new LRU();
+    return cache::makeRunner(cache, new LRU());
+  } else if (type == "LinkedLRU") {
+    return cache::makeRunner(cache, new LinkedLRU());
+  } else if (type == "CLOCK") {
+    return cache::makeRunner(cache, new CLOCK());
+  } else if (type == "SIEVE") {
+    return cache::makeRunner(cache, new SIEVE());
+  } else if (type == "S3FIFO") {
+    return cache::makeRunner(cache, new S3FIFO(cache));
+  } else if (type == "OPT") {
+    return cache::makeRunner(cache, new OPT(cache, cfg.read<const char*>("repl.nextUseFile", "")));
   }
 
   // ranking policies
 	// ASSOCIATIVITY: number of eviction candidate 
   int assoc = cfg.read<int>("cache.assoc");
-  int admissionSamples = cfg.read<int>("cache.admissionSamples");
 
   std::cout << "Ranked associativity = " << assoc << std::endl;
 
   if (type == "LHD") {
-	// lhd.hpp 
-	// LHD(int _associativity, int _admissions, cache::Cache *cache);
-    return new LHD(assoc, admissionSamples, cache);
+	// lhd.cpp 
+	// picks the LHD<HIT_AGE_CLASSES, APP_CLASSES, MAX_AGE, SIZE_CLASSES> instantiation 
+	//	and reads the remaining tuning knobs into LHDParams 
+    return createLHD(cache, settings);
+  } else if (type == "ConcurrentLHD") {
+    return cache::makeRunner(cache, new ConcurrentLHD(LHDParams::read(settings), cache->availableCapacity));
+  }
+
+  // sampled.hpp: same sampler as LHD, ranked by a fixed formula
+  int admissions = cfg.read<int>("cache.admissionSamples", 8);
+
+  if (type == "GDSF") {
+    return cache::makeRunner(cache, new SampledPolicy<rankers::GDSF>(assoc, admissions));
+  } else if (type == "LFUDA") {
+    return cache::makeRunner(cache, new SampledPolicy<rankers::LFUDA>(assoc, admissions));
+  } else if (type == "Hyperbolic") {
+    return cache::makeRunner(cache, new SampledPolicy<rankers::Hyperbolic>(assoc, admissions));
+  } else if (type == "HyperbolicSize") {
+    return cache::makeRunner(cache, new SampledPolicy<rankers::HyperbolicSize>(assoc, admissions));
+  } else if (type == "OPTSize") {
+    return cache::makeRunner(cache, new OPTSize(cache, cfg.read<const char*>("repl.nextUseFile", ""), assoc));
   } else {
     std::cerr << "No valid policy" << std::endl;
     exit(-2);
     return nullptr;
   }
 }
+
+}
+
+PartitionParams PartitionParams::read(const libconfig::Setting &settings) {
+  misc::ConfigReader cfg(settings);
+  PartitionParams params;
+
+  params.rebalanceInterval = cfg.read<int>("cache.rebalanceInterval", params.rebalanceInterval);
+  params.shadowFraction = cfg.read<double>("cache.shadowFraction", params.shadowFraction);
+  params.stepFraction = cfg.read<double>("cache.rebalanceStep", params.stepFraction);
+  params.report = cfg.read<bool>("cache.reportPartitions", params.report);
+
+  assert(params.rebalanceInterval > 0);
+  assert(params.shadowFraction > 0 && params.stepFraction > 0);
+  return params;
+}
+
+}
+
+cache::Runner* repl::Policy::create(cache::Cache* cache, const libconfig::Setting &settings) {
+  misc::ConfigReader cfg(settings);
+
+  std::string type = cfg.read<const char*>("repl.type");
+  
+  std::cout << "Repl: " << type << std::endl;
+
+  // the next-use index counts GETs only
+  if (cache->replayWrites && (type == "OPT" || type == "OPTSize")) {
+    std::cerr << "Offline policies do not support cache.writes" << std::endl;
+    exit(-2);
+  }
+
+  if (!cfg.read<bool>("cache.partitioned", false)) {
+    return createType(cache, settings, type);
+  }
+
+  // partition.hpp: an instance of the policy per app
+  if (cache->slabs || type == "OPT" || type == "OPTSize") {
+    std::cerr << "cache.partitioned does not support cache.slabs or offline policies" << std::endl;
+    exit(-2);
+  }
+  std::cout << "Partitioned by app" << std::endl;
+
+  auto factory = [&settings, type](cache::Cache* view) {
+    // the runner is not used; the partitions are driven by Partitioned
+    std::unique_ptr<cache::Runner> runner(createType(view, settings, type));
+    return runner->policy();
+  };
+  return cache::makeRunner(cache, new Partitioned(cache, PartitionParams::read(settings), factory));
+}
@@ -1,11 +1,14 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include "candidate.hpp"
 
 namespace cache {
 
 class Cache;
+class Runner;
+struct RunOptions;
 
 }
 
@@ -24,11 +27,47 @@ public:
 
   virtual void update(candidate_t id, const parser::Request& req) = 0;
   virtual void replaced(candidate_t id) = 0;
+  // called when an object leaves the cache without rank() choosing
+  // it (it expired, was deleted or outgrew the cache). policies that
+  // learn from evictions (inflation, ghosts, shadow queues) override
+  // this to only forget the object.
+  virtual void removed(candidate_t id) { replaced(id); }
   virtual candidate_t rank(const parser::Request& req) = 0;
 
+  // like rank(), but may append several victims that together free
+  // at least bytesNeeded. policies that don't rank in batches return
+  // a single victim, and the cache asks again if that wasn't enough.
+  virtual void rank(const parser::Request& req, uint64_t bytesNeeded,
+                    std::vector<candidate_t>& victims) {
+    victims.push_back(rank(req));
+  }
+
+  // picks a victim among candidates sampled by the caller, for callers
+  // that must evict from part of the cache (e.g., one slab class).
+  // policies that can't compare arbitrary objects take the first.
+  virtual candidate_t rankAmong(const parser::Request& req,
+                                const candidate_t* candidates,
+                                uint32_t numCandidates) {
+    return candidates[0];
+  }
+
+  // whether a missed object is worth caching in place of victim (the
+  // first object ranked to make room for it, or INVALID_CANDIDATE if it
+  // fits), for density-based admission (admission.hpp). policies that
+  // can't compare the two admit everything.
+  virtual bool admits(const parser::Request& req, candidate_t victim) {
+    return true;
+  }
+
   virtual void dumpStats(cache::Cache* cache) {}
 
-  static Policy* create(cache::Cache* cache, const libconfig::Setting &settings);
+  // called once before the simulation with the trace it will replay,
+  // for offline policies that need a pass over the trace first (opt.hpp)
+  virtual void prepare(const std::string& trace, const cache::RunOptions& options) {}
+
+  // creates the configured policy, installs it as cache->repl and
+  // returns the simulation loop that drives it (runner.hpp)
+  static cache::Runner* create(cache::Cache* cache, const libconfig::Setting &settings);
 };
 
 } // namespace repl
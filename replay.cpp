@@ -0,0 +1,533 @@
+// Open-loop trace replay against a memcached text-protocol server
+// (bin/server, or memcached itself).
+//
+// Requests are sent at their trace times (Request::time), divided by a
+// speed factor, whether or not earlier requests have been answered, so
+// a slow server shows up as latency rather than as a lower offered
+// rate. Traces without times (the partial format) are spaced evenly at
+// UNTIMED_RATE requests/sec times the speed factor.
+//
+// Each key always goes to the same connection, so per-key order is
+// kept. A connection has at most <pipeline depth> requests in flight;
+// requests due while it is full wait at the client, and that wait
+// counts as latency. Two latencies are reported per request:
+//
+// - latency: response time minus scheduled time (what a caller sees)
+// - service: response time minus send time (what the server adds)
+//
+// GETs that miss are followed by a noreply SET of the object (demand
+// fill), as an application would do; fills are not timed. SETs, ADDs
+// and DELETEs are sent as set, add and delete. INCREMENTs are sent as
+// replace, with the trace's value size: like the simulator's
+// INCREMENT, it only writes keys that are cached, and the replayed
+// values aren't numbers that incr could add to. Keys are
+// <appId>:<id>, padded to the trace's key size.
+//
+// The server is flushed (flush_all) before each speed, so every speed
+// starts from an empty cache.
+//
+// Usage: ./bin/replay <trace.csvt> [speeds, e.g. 1,2,4] [connections]
+//                     [pipeline depth] [threads] [port | unix socket path]
+//                     [max requests]
+//
+// Prints one CSV line per speed, then the server's own stats.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "parser.hpp"
+#include "histogram.hpp"
+
+using namespace std;
+
+namespace {
+
+typedef chrono::steady_clock::time_point time_point;
+
+const double UNTIMED_RATE = 100 * 1000;
+const uint32_t MAX_KEY_SIZE = 250;
+const uint32_t MAX_VALUE_SIZE = 1000 * 1000;
+// give up on outstanding responses this long after the last send
+const double DRAIN_SECONDS = 10.;
+
+string address = "11211";
+string values(MAX_VALUE_SIZE, 'x');
+
+struct Options {
+  double speed;
+  uint32_t connections;
+  uint32_t depth;
+  uint32_t threads;
+};
+
+struct Pending {
+  uint64_t request;
+  time_point sent;
+};
+
+struct Connection {
+  int fd;
+  string in;
+  string out;
+  size_t outPos = 0;
+  bool writing = false;
+  deque<Pending> inFlight;
+  deque<uint64_t> backlog;
+};
+
+struct Result {
+  misc::Histogram latency;
+  misc::Histogram service;
+  uint64_t requests = 0;
+  uint64_t gets = 0;
+  uint64_t hits = 0;
+  uint64_t errors = 0;
+  // requests sent more than 1ms after their scheduled time
+  uint64_t late = 0;
+  time_point finished;
+};
+
+int connectTo(const string& address) {
+  int fd;
+  bool tcp = address.find_first_not_of("0123456789") == string::npos;
+
+  if (tcp) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(address.c_str()));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { fd = -1; }
+    int one = 1;
+    if (fd >= 0) { setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); }
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) { fd = -1; }
+  }
+
+  if (fd < 0) {
+    cerr << "Could not connect to " << address << ": " << strerror(errno) << endl;
+    exit(-2);
+  }
+  return fd;
+}
+
+string keyFor(const parser::Request& req) {
+  string key = to_string(req.appId) + ":" + to_string(req.id);
+  uint32_t keySize = min((uint32_t)max(req.keySize, 0), MAX_KEY_SIZE);
+  if (key.size() < keySize) { key.append(keySize - key.size(), '_'); }
+  return key;
+}
+
+// connection of a key, so each key's requests stay in order
+uint32_t connectionOf(const parser::Request& req, uint32_t connections) {
+  return ((uint64_t)req.id * 2654435761u) % connections;
+}
+
+bool isWrite(const parser::Request& req) {
+  return req.type == parser::SET || req.type == parser::ADD || req.type == parser::INCREMENT;
+}
+
+uint32_t valueSizeFor(const parser::Request& req) {
+  return (uint32_t)min(req.valueSize, (int64_t)MAX_VALUE_SIZE);
+}
+
+class Replayer {
+public:
+  Replayer(const vector<parser::Request>& _trace, const vector<double>& _schedule,
+           const vector<uint64_t>& _mine, const Options& _options,
+           uint32_t _firstConnection, uint32_t numConnections)
+    : trace(_trace), schedule(_schedule), mine(_mine), options(_options)
+    , firstConnection(_firstConnection) {
+    epfd = epoll_create1(0);
+    for (uint32_t i = 0; i < numConnections; i++) {
+      conns.emplace_back(new Connection());
+      auto& conn = *conns.back();
+      conn.fd = connectTo(address);
+      fcntl(conn.fd, F_SETFL, fcntl(conn.fd, F_GETFL) | O_NONBLOCK);
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = &conn;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+    }
+  }
+
+  ~Replayer() {
+    for (auto& conn : conns) { close(conn->fd); }
+    close(epfd);
+  }
+
+  void run(time_point start, Result& result) {
+    this->start = start;
+    this->result = &result;
+
+    const int MAX_EVENTS = 64;
+    epoll_event events[MAX_EVENTS];
+    uint64_t next = 0;
+    uint64_t inFlight = 0;
+    time_point lastSend = start;
+
+    while (next < mine.size() || inFlight > 0) {
+      auto now = chrono::steady_clock::now();
+
+      while (next < mine.size() && secondsSince(now) >= schedule[mine[next]]) {
+        uint64_t r = mine[next++];
+        auto& conn = connectionFor(trace[r]);
+        if (conn.inFlight.size() < options.depth) {
+          send(conn, r, now);
+        } else {
+          conn.backlog.push_back(r);
+        }
+        ++inFlight;
+        lastSend = now;
+      }
+
+      if (next == mine.size()
+          && chrono::duration<double>(now - lastSend).count() > DRAIN_SECONDS) {
+        result.errors += inFlight;
+        break;
+      }
+
+      // spin when the next request is due within a millisecond
+      int timeout = 100;
+      if (next < mine.size()) {
+        double wait = schedule[mine[next]] - secondsSince(now);
+        timeout = wait < 1e-3 ? 0 : (int)(wait * 1e3) - 1;
+      }
+
+      int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+      for (int i = 0; i < n; i++) {
+        auto& conn = *(Connection*)events[i].data.ptr;
+        if (events[i].events & EPOLLOUT) { flush(conn); }
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          inFlight -= receive(conn);
+        }
+      }
+    }
+
+    result.finished = chrono::steady_clock::now();
+  }
+
+private:
+  const vector<parser::Request>& trace;
+  const vector<double>& schedule;
+  const vector<uint64_t>& mine;
+  const Options& options;
+
+  int epfd;
+  uint32_t firstConnection;
+  vector<unique_ptr<Connection>> conns;
+  time_point start;
+  Result* result;
+
+  double secondsSince(time_point now) const {
+    return chrono::duration<double>(now - start).count();
+  }
+
+  Connection& connectionFor(const parser::Request& req) {
+    uint32_t c = connectionOf(req, options.connections);
+    return *conns[(c - firstConnection) / options.threads];
+  }
+
+  void send(Connection& conn, uint64_t r, time_point now) {
+    const auto& req = trace[r];
+    string key = keyFor(req);
+
+    if (isWrite(req)) {
+      const char* cmd = req.type == parser::ADD ? "add "
+        : req.type == parser::INCREMENT ? "replace " : "set ";
+      uint32_t size = valueSizeFor(req);
+      conn.out += cmd + key + " 0 0 " + to_string(size) + "\r\n";
+      conn.out.append(values.data(), size);
+      conn.out += "\r\n";
+    } else if (req.type == parser::DELETE) {
+      conn.out += "delete " + key + "\r\n";
+    } else {
+      conn.out += "get " + key + "\r\n";
+    }
+
+    if (secondsSince(now) > schedule[r] + 1e-3) { ++result->late; }
+    conn.inFlight.push_back(Pending{r, now});
+    flush(conn);
+  }
+
+  void fill(Connection& conn, const parser::Request& req) {
+    uint32_t size = valueSizeFor(req);
+    conn.out += "set " + keyFor(req) + " 0 0 " + to_string(size) + " noreply\r\n";
+    conn.out.append(values.data(), size);
+    conn.out += "\r\n";
+  }
+
+  void flush(Connection& conn) {
+    while (conn.outPos < conn.out.size()) {
+      ssize_t written = ::send(conn.fd, conn.out.data() + conn.outPos,
+                               conn.out.size() - conn.outPos, MSG_NOSIGNAL);
+      if (written < 0) {
+        if (errno == EINTR) { continue; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          cerr << "Lost connection: " << strerror(errno) << endl;
+          exit(-2);
+        }
+        setWriting(conn, true);
+        return;
+      }
+      conn.outPos += written;
+    }
+    conn.out.clear();
+    conn.outPos = 0;
+    setWriting(conn, false);
+  }
+
+  void setWriting(Connection& conn, bool writing) {
+    if (conn.writing == writing) { return; }
+    conn.writing = writing;
+    epoll_event ev;
+    ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = &conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+  }
+
+  // returns the number of responses completed
+  uint64_t receive(Connection& conn) {
+    char buf[64 * 1024];
+    while (true) {
+      ssize_t bytes = read(conn.fd, buf, sizeof(buf));
+      if (bytes > 0) {
+        conn.in.append(buf, bytes);
+        continue;
+      }
+      if (bytes == 0) {
+        cerr << "Server closed the connection" << endl;
+        exit(-2);
+      }
+      if (errno == EINTR) { continue; }
+      break;
+    }
+
+    uint64_t completed = 0;
+    size_t pos = 0;
+    while (!conn.inFlight.empty()) {
+      bool hit = false;
+      size_t consumed = parseResponse(conn, pos, hit);
+      if (consumed == 0) { break; }
+      pos += consumed;
+
+      auto now = chrono::steady_clock::now();
+      Pending pending = conn.inFlight.front();
+      conn.inFlight.pop_front();
+      const auto& req = trace[pending.request];
+
+      result->latency.record(chrono::duration_cast<chrono::nanoseconds>(
+        now - start).count() - (int64_t)(schedule[pending.request] * 1e9));
+      result->service.record(chrono::duration_cast<chrono::nanoseconds>(
+        now - pending.sent).count());
+      ++result->requests;
+      ++completed;
+
+      if (!isWrite(req) && req.type != parser::DELETE) {
+        ++result->gets;
+        if (hit) {
+          ++result->hits;
+        } else {
+          fill(conn, req);
+        }
+      }
+
+      if (!conn.backlog.empty()) {
+        uint64_t r = conn.backlog.front();
+        conn.backlog.pop_front();
+        send(conn, r, now);
+      }
+    }
+    conn.in.erase(0, pos);
+    if (!conn.out.empty()) { flush(conn); }
+    return completed;
+  }
+
+  // bytes of one complete response at pos, or 0 if incomplete
+  size_t parseResponse(Connection& conn, size_t pos, bool& hit) {
+    const string& in = conn.in;
+    size_t cur = pos;
+    while (true) {
+      size_t eol = in.find("\r\n", cur);
+      if (eol == string::npos) { return 0; }
+
+      if (in.compare(cur, 6, "VALUE ") == 0) {
+        // VALUE <key> <flags> <bytes>
+        size_t sizeStart = in.rfind(' ', eol) + 1;
+        uint64_t bytes = strtoull(in.c_str() + sizeStart, nullptr, 10);
+        if (in.size() < eol + 2 + bytes + 2) { return 0; }
+        hit = true;
+        cur = eol + 2 + bytes + 2;
+        continue;
+      }
+
+      if (in.compare(cur, 3, "END") != 0 && in.compare(cur, 6, "STORED") != 0
+          && in.compare(cur, 10, "NOT_STORED") != 0
+          && in.compare(cur, 7, "DELETED") != 0 && in.compare(cur, 9, "NOT_FOUND") != 0) {
+        ++result->errors;
+      }
+      return eol + 2 - pos;
+    }
+  }
+};
+
+vector<double> parseSpeeds(const string& list) {
+  vector<double> speeds;
+  stringstream ss(list);
+  string item;
+  while (getline(ss, item, ',')) { speeds.push_back(atof(item.c_str())); }
+  return speeds;
+}
+
+// sends one command on a new connection and returns the response,
+// which ends with end
+string command(const string& cmd, const char* end) {
+  int fd = connectTo(address);
+  ::send(fd, cmd.data(), cmd.size(), MSG_NOSIGNAL);
+
+  string out;
+  char buf[4096];
+  while (out.find(end) == string::npos) {
+    ssize_t bytes = read(fd, buf, sizeof(buf));
+    if (bytes <= 0) { break; }
+    out.append(buf, bytes);
+  }
+  close(fd);
+  return out;
+}
+
+void flushServer() {
+  string response = command("flush_all\r\n", "\r\n");
+  if (response != "OK\r\n") {
+    cerr << "flush_all failed: " << response << endl;
+    exit(-2);
+  }
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <trace.csvt> [speeds, e.g. 1,2,4] [connections]"
+         << " [pipeline depth] [threads] [port | unix socket path] [max requests]" << endl;
+    exit(-2);
+  }
+
+  string tracePath = argv[1];
+  vector<double> speeds = parseSpeeds(argc > 2 ? argv[2] : "1");
+  Options options;
+  options.connections = argc > 3 ? atoi(argv[3]) : 16;
+  options.depth = argc > 4 ? atoi(argv[4]) : 8;
+  options.threads = argc > 5 ? atoi(argv[5]) : 1;
+  if (argc > 6) { address = argv[6]; }
+  uint64_t maxRequests = argc > 7 ? atoll(argv[7]) : -1;
+
+  options.threads = max(1u, min(options.threads, options.connections));
+  options.depth = max(1u, options.depth);
+
+  vector<parser::Request> trace;
+  {
+    parser::CSVParser parser(tracePath);
+    parser.go([&](const parser::Request& req) {
+      trace.push_back(req);
+      return trace.size() < maxRequests;
+    });
+  }
+  if (trace.empty()) {
+    cerr << "Empty trace" << endl;
+    exit(-2);
+  }
+
+  bool timed = trace.back().time > trace.front().time;
+  cout << "Replaying " << trace.size() << " requests"
+       << (timed ? "" : " (untimed)") << endl;
+
+  // each connection belongs to thread (connection % threads)
+  vector<vector<uint64_t>> mine(options.threads);
+  for (uint64_t r = 0; r < trace.size(); r++) {
+    uint32_t c = connectionOf(trace[r], options.connections);
+    mine[c % options.threads].push_back(r);
+  }
+
+  printf("# speed, offered req/s, achieved req/s, hit ratio, errors, late, "
+         "latency p50 us, p99 us, p99.9 us, max us, service p50 us, p99 us, p99.9 us\n");
+
+  for (double speed : speeds) {
+    flushServer();
+    options.speed = speed;
+    vector<double> schedule(trace.size());
+    for (uint64_t r = 0; r < trace.size(); r++) {
+      schedule[r] = timed
+        ? (trace[r].time - trace.front().time) / speed
+        : r / (UNTIMED_RATE * speed);
+    }
+
+    vector<unique_ptr<Replayer>> replayers;
+    for (uint32_t t = 0; t < options.threads; t++) {
+      uint32_t numConnections = (options.connections - t + options.threads - 1) / options.threads;
+      replayers.emplace_back(new Replayer(trace, schedule, mine[t], options, t, numConnections));
+    }
+
+    vector<Result> results(options.threads);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (uint32_t t = 0; t < options.threads; t++) {
+      threads.emplace_back([&, t]() { replayers[t]->run(start, results[t]); });
+    }
+    for (auto& t : threads) { t.join(); }
+
+    Result total;
+    total.finished = start;
+    for (auto& result : results) {
+      total.latency.merge(result.latency);
+      total.service.merge(result.service);
+      total.requests += result.requests;
+      total.gets += result.gets;
+      total.hits += result.hits;
+      total.errors += result.errors;
+      total.late += result.late;
+      total.finished = max(total.finished, result.finished);
+    }
+
+    double seconds = chrono::duration<double>(total.finished - start).count();
+    double offered = trace.size() / max(schedule.back(), 1e-9);
+
+    printf("%g, %g, %g, %g, %lu, %lu, %g, %g, %g, %g, %g, %g, %g\n",
+           speed, offered, total.requests / seconds,
+           total.gets ? 1. * total.hits / total.gets : 0.,
+           total.errors, total.late,
+           total.latency.percentile(0.5) / 1e3, total.latency.percentile(0.99) / 1e3,
+           total.latency.percentile(0.999) / 1e3, total.latency.max() / 1e3,
+           total.service.percentile(0.5) / 1e3, total.service.percentile(0.99) / 1e3,
+           total.service.percentile(0.999) / 1e3);
+    fflush(stdout);
+  }
+
+  cout << command("stats\r\n", "END\r\n");
+  return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+
+#include "parser.hpp"
+#include "cache.hpp"
+
+namespace cache {
+
+struct RunOptions {
+  uint64_t totalAccesses;
+  // ignore requests from other apps; -1 to simulate all apps
+  int32_t filterApp;
+};
+
+// Simulation loop. Policy::create() returns a PolicyRunner that feeds
+// the trace to Cache::access(); other loops (tiered.hpp) drive more
+// than one cache.
+class Runner {
+public:
+  virtual ~Runner() {}
+
+  virtual void run(const std::string& trace, const RunOptions& options) = 0;
+
+  virtual repl::Policy* policy() = 0;
+
+  // stats of the loop itself, if it keeps any (tiered.hpp)
+  virtual void dumpStats() {}
+};
+
+class PolicyRunner : public Runner {
+public:
+  PolicyRunner(Cache* _cache, repl::Policy* _policy)
+    : cache(_cache), repl(_policy) {}
+
+  void run(const std::string& trace, const RunOptions& options) {
+    auto visit = [&](const parser::Request& req) {
+      if (options.filterApp != -1 && req.appId != options.filterApp) {
+        return true;
+      }
+
+      cache->access(req);
+      return cache->accesses < options.totalAccesses - parser::FAST_FORWARD;
+    };
+
+    //parser::BinaryParser parser(trace.c_str(), false);
+    parser::CSVParser parser(trace.c_str());
+    parser.go(visit);
+  }
+
+  repl::Policy* policy() { return repl; }
+
+private:
+  Cache* cache;
+  repl::Policy* repl;
+};
+
+inline Runner* makeRunner(Cache* cache, repl::Policy* policy) {
+  cache->repl = policy;
+  return new PolicyRunner(cache, policy);
+}
+
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include "repl.hpp"
+#include "rand.hpp"
+#include "sampler.hpp"
+
+namespace repl {
+
+// Eviction by random sampling, as in LHD, with the ranking supplied by
+// a Ranker at compile time. Each eviction ranks ASSOCIATIVITY randomly
+// sampled objects plus the last ADMISSIONS admitted ones, and evicts
+// the lowest.
+//
+// A Ranker provides:
+//   struct Tag;  // per-object state, with a candidate_t id
+//   void onInsert(Tag&, const parser::Request&, uint64_t now);
+//   void onHit(Tag&, const parser::Request&, uint64_t now);
+//   void onWrite(Tag&, const parser::Request&, uint64_t now);  // not a hit
+//   void onEvict(const Tag&, uint64_t now);
+//   double rank(const Tag&, uint64_t now) const;  // lowest is evicted
+//   static constexpr const char* NAME;
+// now counts updates.
+template <typename Ranker>
+class SampledPolicy : public Policy {
+public:
+  typedef typename Ranker::Tag Tag;
+  using Policy::rank;
+
+  SampledPolicy(uint32_t _associativity, uint32_t _admissions)
+    : ASSOCIATIVITY(_associativity)
+    , ADMISSIONS(_admissions)
+    , tags(_admissions) {}
+
+  void update(candidate_t id, const parser::Request& req) {
+    ++timestamp;
+    auto idx = tags.find(id);
+    if (idx == tags.NOT_FOUND) {
+      ranker.onInsert(tags.insert(id), req, timestamp);
+      tags.admit(id);
+    } else if (req.type == parser::GET) {
+      ranker.onHit(tags[idx], req, timestamp);
+    } else {
+      ranker.onWrite(tags[idx], req, timestamp);
+    }
+  }
+
+  void replaced(candidate_t id) {
+    auto idx = tags.find(id);
+    assert(idx != tags.NOT_FOUND);
+    ranker.onEvict(tags[idx], timestamp);
+    tags.remove(idx);
+  }
+
+  // not an eviction, so the ranker doesn't age on it
+  void removed(candidate_t id) {
+    auto idx = tags.find(id);
+    assert(idx != tags.NOT_FOUND);
+    tags.remove(idx);
+  }
+
+  candidate_t rank(const parser::Request& req) {
+    uint64_t victim = -1;
+    double victimRank = std::numeric_limits<double>::max();
+
+    auto consider = [&](uint64_t idx) {
+      double rank = ranker.rank(tags[idx], timestamp);
+      if (rank < victimRank) {
+        victim = idx;
+        victimRank = rank;
+      }
+    };
+
+    for (uint32_t i = 0; i < ASSOCIATIVITY; i++) {
+      consider(tags.sample(rand));
+    }
+    tags.forEachAdmitted(consider);
+
+    ++rankings;
+    assert(victim != (uint64_t)-1);
+    return tags[victim].id;
+  }
+
+  candidate_t rankAmong(const parser::Request& req,
+                        const candidate_t* candidates, uint32_t numCandidates) {
+    uint64_t victim = -1;
+    double victimRank = std::numeric_limits<double>::max();
+
+    for (uint32_t i = 0; i < numCandidates; i++) {
+      auto idx = tags.find(candidates[i]);
+      assert(idx != tags.NOT_FOUND);
+      double rank = ranker.rank(tags[idx], timestamp);
+      if (rank < victimRank) {
+        victim = idx;
+        victimRank = rank;
+      }
+    }
+
+    ++rankings;
+    assert(victim != (uint64_t)-1);
+    return tags[victim].id;
+  }
+
+  void dumpStats(cache::Cache* cache) {
+    std::cout << "Sampled " << Ranker::NAME << ": " << rankings << " rankings, "
+              << ASSOCIATIVITY << " samples + " << ADMISSIONS << " admissions each" << std::endl
+              << "  > Metadata: " << tags.bytes() << " bytes ("
+              << (1. * tags.bytes() / std::max<uint64_t>(tags.size(), 1))
+              << " per object)" << std::endl;
+  }
+
+private:
+  const uint32_t ASSOCIATIVITY;
+  const uint32_t ADMISSIONS;
+
+  Sampler<Tag> tags;
+  Ranker ranker;
+  misc::Rand rand;
+  uint64_t timestamp = 0;
+
+  // stats
+  uint64_t rankings = 0;
+};
+
+namespace rankers {
+
+// Greedy-Dual-Size-Frequency (Cherkasova, 1998): priority is
+// L + count / size, where L inflates to each victim's priority so that
+// objects not hit in a while age out.
+struct GDSF {
+  static constexpr const char* NAME = "GDSF";
+
+  struct Tag {
+    candidate_t id;
+    uint32_t count;
+    double priority;
+  };
+
+  double inflation = 0.;
+
+  void onInsert(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.count = 1;
+    tag.priority = inflation + 1. / req.size();
+  }
+
+  void onHit(Tag& tag, const parser::Request& req, uint64_t now) {
+    ++tag.count;
+    tag.priority = inflation + 1. * tag.count / req.size();
+  }
+
+  void onWrite(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.priority = inflation + 1. * tag.count / req.size();
+  }
+
+  void onEvict(const Tag& tag, uint64_t now) {
+    inflation = std::max(inflation, tag.priority);
+  }
+
+  double rank(const Tag& tag, uint64_t now) const { return tag.priority; }
+};
+
+// LFU with dynamic aging (Arlitt et al., 2000): GDSF without the size
+// term, priority is L + count.
+struct LFUDA {
+  static constexpr const char* NAME = "LFUDA";
+
+  struct Tag {
+    candidate_t id;
+    uint32_t count;
+    double priority;
+  };
+
+  double inflation = 0.;
+
+  void onInsert(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.count = 1;
+    tag.priority = inflation + 1.;
+  }
+
+  void onHit(Tag& tag, const parser::Request& req, uint64_t now) {
+    ++tag.count;
+    tag.priority = inflation + tag.count;
+  }
+
+  void onWrite(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.priority = inflation + tag.count;
+  }
+
+  void onEvict(const Tag& tag, uint64_t now) {
+    inflation = std::max(inflation, tag.priority);
+  }
+
+  double rank(const Tag& tag, uint64_t now) const { return tag.priority; }
+};
+
+// Hyperbolic caching (Blankstein et al., 2017): accesses per unit of
+// time in the cache, count / (now - insertion).
+struct Hyperbolic {
+  static constexpr const char* NAME = "Hyperbolic";
+
+  struct Tag {
+    candidate_t id;
+    uint32_t count;
+    uint64_t inserted;
+  };
+
+  void onInsert(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.count = 1;
+    tag.inserted = now;
+  }
+
+  void onHit(Tag& tag, const parser::Request& req, uint64_t now) {
+    ++tag.count;
+  }
+
+  void onWrite(Tag& tag, const parser::Request& req, uint64_t now) {}
+
+  void onEvict(const Tag& tag, uint64_t now) {}
+
+  double rank(const Tag& tag, uint64_t now) const {
+    // inserted <= now, and the just-inserted object ranks highest
+    return 1. * tag.count / (now - tag.inserted + 1);
+  }
+};
+
+// Hyperbolic caching's size-aware variant: count / (age * size), i.e.,
+// hits per byte per unit of time in the cache.
+struct HyperbolicSize {
+  static constexpr const char* NAME = "HyperbolicSize";
+
+  struct Tag {
+    candidate_t id;
+    uint32_t count;
+    uint32_t size;
+    uint64_t inserted;
+  };
+
+  void onInsert(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.count = 1;
+    tag.size = req.size();
+    tag.inserted = now;
+  }
+
+  void onHit(Tag& tag, const parser::Request& req, uint64_t now) {
+    ++tag.count;
+    tag.size = req.size();
+  }
+
+  void onWrite(Tag& tag, const parser::Request& req, uint64_t now) {
+    tag.size = req.size();
+  }
+
+  void onEvict(const Tag& tag, uint64_t now) {}
+
+  double rank(const Tag& tag, uint64_t now) const {
+    return 1. * tag.count / ((now - tag.inserted + 1) * (double)tag.size);
+  }
+};
+
+} // namespace rankers
+
+} // namespace repl
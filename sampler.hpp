@@ -0,0 +1,92 @@
+#pragma once
+
+#include <vector>
+#include "candidate.hpp"
+#include "index_map.hpp"
+#include "rand.hpp"
+
+namespace repl {
+
+// Object metadata for policies that rank a random sample of the cache
+// (LHD, SampledPolicy). Tags are kept in a dense vector so a uniformly
+// random candidate is one index; an IndexMap finds an object's tag, and
+// removal moves the last tag into the hole.
+//
+// The sampler also remembers the last few admitted objects that the
+// policy flagged with admit(). Policies rank these alongside the random
+// sample, so that an object that looks like a victim on arrival does
+// not linger because sampling missed it.
+//
+// TagT must have a candidate_t member named id.
+template <typename TagT>
+class Sampler {
+public:
+  static constexpr uint64_t NOT_FOUND = -1;
+
+  Sampler(uint32_t admissions)
+    : recentlyAdmitted(admissions, INVALID_CANDIDATE) {}
+
+  uint64_t size() const { return tags.size(); }
+
+  TagT& operator[](uint64_t idx) { return tags[idx]; }
+  const TagT& operator[](uint64_t idx) const { return tags[idx]; }
+
+  // index of id's tag, or NOT_FOUND
+  uint64_t find(candidate_t id) const {
+    uint32_t idx = indices.find(id);
+    return idx == IndexMap::NOT_FOUND ? NOT_FOUND : idx;
+  }
+
+  // appends a default tag for id, which must not have one
+  TagT& insert(candidate_t id) {
+    indices.insert(id, tags.size());
+    tags.push_back(TagT{});
+    tags.back().id = id;
+    return tags.back();
+  }
+
+  void remove(uint64_t idx) {
+    indices.erase(tags[idx].id);
+    tags[idx] = tags.back();
+    tags.pop_back();
+
+    if (idx < tags.size()) {
+      indices.assign(tags[idx].id, idx);
+    }
+  }
+
+  // index of a uniformly random tag; the cache must not be empty
+  inline uint64_t sample(misc::Rand& rand) const {
+    return rand.next() % tags.size();
+  }
+
+  void admit(candidate_t id) {
+    if (recentlyAdmitted.empty()) { return; }
+    recentlyAdmitted[recentlyAdmittedHead++ % recentlyAdmitted.size()] = id;
+  }
+
+  // calls visit(idx) for each admitted object that is still cached
+  template <typename Visitor>
+  inline void forEachAdmitted(Visitor visit) const {
+    for (auto id : recentlyAdmitted) {
+      uint64_t idx = find(id);
+      // may have been evicted since
+      if (idx == NOT_FOUND) { continue; }
+      assert(tags[idx].id == id);
+      visit(idx);
+    }
+  }
+
+  size_t bytes() const {
+    return tags.capacity() * sizeof(TagT) + indices.bytes();
+  }
+
+private:
+  std::vector<TagT> tags;
+  IndexMap indices;
+
+  std::vector<candidate_t> recentlyAdmitted;
+  uint64_t recentlyAdmittedHead = 0;
+};
+
+}
@@ -0,0 +1,577 @@
+// memcached text-protocol server over kv::Store (kvstore.hpp), for
+// running LHD or LRU behind existing memcached clients and load tools.
+//
+// Speaks get, set, add, replace, delete, flush_all, stats [reset],
+// version and quit; keys over 250 bytes get CLIENT_ERROR, as in
+// memcached. Flags are kept with the value; exptime is accepted and
+// ignored. flush_all replaces every shard's store with an empty one,
+// so the policy starts cold too; the counters carry over. One thread accepts
+// connections and hands them round-robin to the workers, each of
+// which runs its own epoll loop. The store is split by key hash
+// into one shard per worker, each behind a mutex.
+//
+// Latency is service time: from a complete command in the input buffer
+// to its response in the output buffer, so it covers parsing, store
+// locking and the policy, but not the network.
+//
+// Usage: ./bin/server <LHD|LRU> [capacity MB] [threads] [port | unix socket path]
+//
+// Defaults are 64MB, 4 threads and 127.0.0.1:11211. SIGINT or SIGTERM
+// prints the stats and exits.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvstore.hpp"
+#include "histogram.hpp"
+#include "bytes.hpp"
+
+using namespace std;
+
+namespace {
+
+const uint32_t MAX_KEY_SIZE = 250;
+const uint32_t MAX_TOKENS = 24;
+const size_t READ_SIZE = 16 * 1024;
+
+atomic<bool> stopping(false);
+
+void onSignal(int) { stopping = true; }
+
+struct Shard {
+  mutex lock;
+  unique_ptr<kv::Store> store;
+};
+
+struct Connection {
+  int fd;
+  string in;
+  string out;
+  size_t outPos = 0;
+  bool writing = false;
+  bool closing = false;
+};
+
+struct Worker {
+  int epfd;
+  thread loop;
+
+  // guards latency, which stats commands read from other workers
+  mutex statsLock;
+  misc::Histogram latency;
+
+  // scratch for set: flags followed by the data
+  string value;
+};
+
+struct Server {
+  string policy;
+  uint64_t capacity;
+  vector<unique_ptr<Shard>> shards;
+  vector<unique_ptr<Worker>> workers;
+  atomic<uint64_t> connections;
+  atomic<uint64_t> totalConnections;
+  chrono::steady_clock::time_point start;
+
+  Shard& shardFor(const char* key, uint32_t keySize) {
+    // FNV-1a; high bits, since the store's index uses the same hash
+    uint64_t hash = 14695981039346656037ull;
+    for (uint32_t i = 0; i < keySize; i++) {
+      hash = (hash ^ (uint8_t)key[i]) * 1099511628211ull;
+    }
+    return *shards[(hash >> 32) % shards.size()];
+  }
+};
+
+Server server;
+
+struct Token {
+  const char* data;
+  uint32_t size;
+
+  bool is(const char* str) const {
+    return size == strlen(str) && memcmp(data, str, size) == 0;
+  }
+};
+
+// reads the token at or after line[i] and moves i past it; false at
+// the end of the line
+bool nextToken(const char* line, size_t size, size_t& i, Token& token) {
+  while (i < size && line[i] == ' ') { ++i; }
+  if (i == size) { return false; }
+  size_t start = i;
+  while (i < size && line[i] != ' ') { ++i; }
+  token = Token{line + start, (uint32_t)(i - start)};
+  return true;
+}
+
+uint32_t tokenize(const char* line, size_t size, Token* tokens) {
+  uint32_t n = 0;
+  size_t i = 0;
+  while (n < MAX_TOKENS && nextToken(line, size, i, tokens[n])) { ++n; }
+  return n;
+}
+
+bool parseNumber(const Token& token, uint64_t& value) {
+  if (token.size == 0 || token.size > 19) { return false; }
+  value = 0;
+  for (uint32_t i = 0; i < token.size; i++) {
+    if (token.data[i] < '0' || token.data[i] > '9') { return false; }
+    value = value * 10 + (token.data[i] - '0');
+  }
+  return true;
+}
+
+void appendStat(string& out, const char* name, const string& value) {
+  out += "STAT ";
+  out += name;
+  out += ' ';
+  out += value;
+  out += "\r\n";
+}
+
+template <typename T>
+void appendStat(string& out, const char* name, T value) {
+  appendStat(out, name, to_string(value));
+}
+
+void stats(string& out, bool reset) {
+  uint64_t items = 0, bytes = 0, gets = 0, hits = 0, sets = 0,
+    failedSets = 0, deletes = 0, evictions = 0;
+  for (auto& shard : server.shards) {
+    lock_guard<mutex> guard(shard->lock);
+    auto& store = *shard->store;
+    if (reset) {
+      store.gets = store.hits = store.sets = store.failedSets = 0;
+      store.deletes = store.evictions = 0;
+      continue;
+    }
+    items += store.numItems();
+    bytes += store.keyValueBytes;
+    gets += store.gets;
+    hits += store.hits;
+    sets += store.sets;
+    failedSets += store.failedSets;
+    deletes += store.deletes;
+    evictions += store.evictions;
+  }
+
+  misc::Histogram latency;
+  for (auto& worker : server.workers) {
+    lock_guard<mutex> guard(worker->statsLock);
+    if (reset) {
+      worker->latency.clear();
+    } else {
+      latency.merge(worker->latency);
+    }
+  }
+
+  if (reset) {
+    out += "RESET\r\n";
+    return;
+  }
+
+  auto uptime = chrono::duration_cast<chrono::seconds>(
+    chrono::steady_clock::now() - server.start).count();
+
+  appendStat(out, "pid", getpid());
+  appendStat(out, "uptime", uptime);
+  appendStat(out, "version", string("lhd-1.0"));
+  appendStat(out, "policy", server.policy);
+  appendStat(out, "threads", server.workers.size());
+  appendStat(out, "curr_connections", server.connections.load());
+  appendStat(out, "total_connections", server.totalConnections.load());
+  appendStat(out, "curr_items", items);
+  appendStat(out, "bytes", bytes);
+  appendStat(out, "limit_maxbytes", server.capacity);
+  appendStat(out, "cmd_get", gets);
+  appendStat(out, "get_hits", hits);
+  appendStat(out, "get_misses", gets - hits);
+  appendStat(out, "hit_ratio", to_string(gets ? 1. * hits / gets : 0.));
+  appendStat(out, "cmd_set", sets);
+  appendStat(out, "set_failures", failedSets);
+  appendStat(out, "cmd_delete", deletes);
+  appendStat(out, "evictions", evictions);
+  appendStat(out, "latency_count", latency.count());
+  appendStat(out, "latency_mean_ns", (uint64_t)latency.mean());
+  appendStat(out, "latency_p50_ns", latency.percentile(0.5));
+  appendStat(out, "latency_p90_ns", latency.percentile(0.9));
+  appendStat(out, "latency_p99_ns", latency.percentile(0.99));
+  appendStat(out, "latency_p999_ns", latency.percentile(0.999));
+  appendStat(out, "latency_max_ns", latency.max());
+  out += "END\r\n";
+}
+
+void flushAll() {
+  for (auto& shard : server.shards) {
+    lock_guard<mutex> guard(shard->lock);
+    auto& old = *shard->store;
+    uint64_t gets = old.gets, hits = old.hits, sets = old.sets,
+      failedSets = old.failedSets, deletes = old.deletes, evictions = old.evictions;
+
+    shard->store.reset();
+    shard->store.reset(new kv::Store(server.capacity / server.shards.size(), server.policy));
+    auto& store = *shard->store;
+    store.gets = gets;
+    store.hits = hits;
+    store.sets = sets;
+    store.failedSets = failedSets;
+    store.deletes = deletes;
+    store.evictions = evictions;
+  }
+}
+
+// keys is the rest of the line after "get". it is walked rather than
+// tokenized, since a get may name far more than MAX_TOKENS keys.
+void get(Connection& conn, const char* keys, size_t size) {
+  Token key;
+  size_t i = 0;
+  // as memcached, reject the whole command before answering any key
+  while (nextToken(keys, size, i, key)) {
+    if (key.size > MAX_KEY_SIZE) {
+      conn.out += "CLIENT_ERROR bad command line format\r\n";
+      return;
+    }
+  }
+
+  i = 0;
+  while (nextToken(keys, size, i, key)) {
+    Shard& shard = server.shardFor(key.data, key.size);
+    lock_guard<mutex> guard(shard.lock);
+    kv::ValueView value;
+    if (!shard.store->get(key.data, key.size, value)) { continue; }
+
+    uint32_t flags;
+    memcpy(&flags, value.data, sizeof(flags));
+    conn.out += "VALUE ";
+    conn.out.append(key.data, key.size);
+    conn.out += ' ';
+    conn.out += to_string(flags);
+    conn.out += ' ';
+    conn.out += to_string(value.size - sizeof(flags));
+    conn.out += "\r\n";
+    conn.out.append(value.data + sizeof(flags), value.size - sizeof(flags));
+    conn.out += "\r\n";
+  }
+  conn.out += "END\r\n";
+}
+
+// returns the bytes consumed from in, or 0 if the command is incomplete
+size_t execute(Worker& worker, Connection& conn, size_t pos) {
+  const string& in = conn.in;
+  size_t eol = in.find('\n', pos);
+  if (eol == string::npos) {
+    if (in.size() - pos > 2048) {
+      conn.out += "CLIENT_ERROR line too long\r\n";
+      conn.closing = true;
+      return in.size() - pos;
+    }
+    return 0;
+  }
+
+  size_t lineEnd = (eol > pos && in[eol - 1] == '\r') ? eol - 1 : eol;
+  Token tokens[MAX_TOKENS];
+  uint32_t n = tokenize(in.data() + pos, lineEnd - pos, tokens);
+  size_t consumed = eol + 1 - pos;
+
+  if (n == 0) {
+    conn.out += "ERROR\r\n";
+  } else if (tokens[0].is("get") && n >= 2) {
+    const char* keys = tokens[0].data + tokens[0].size;
+    get(conn, keys, in.data() + lineEnd - keys);
+  } else if ((tokens[0].is("set") || tokens[0].is("add") || tokens[0].is("replace"))
+             && (n == 5 || n == 6)) {
+    uint64_t flags, exptime, bytes;
+    if (!parseNumber(tokens[2], flags) || !parseNumber(tokens[3], exptime)
+        || !parseNumber(tokens[4], bytes) || tokens[1].size > MAX_KEY_SIZE
+        || flags > UINT32_MAX || bytes > kv::SlabAllocator::PAGE_SIZE) {
+      conn.out += "CLIENT_ERROR bad command line format\r\n";
+      // can't tell where the data ends
+      conn.closing = true;
+      return in.size() - pos;
+    }
+
+    // wait for the data block and its \r\n
+    if (in.size() - pos < consumed + bytes + 2) { return 0; }
+    const char* data = in.data() + pos + consumed;
+    consumed += bytes + 2;
+    bool noreply = n == 6 && tokens[5].is("noreply");
+
+    if (data[bytes] != '\r' || data[bytes + 1] != '\n') {
+      conn.out += "CLIENT_ERROR bad data chunk\r\n";
+      return consumed;
+    }
+
+    uint32_t flags32 = flags;
+    worker.value.assign((const char*)&flags32, sizeof(flags32));
+    worker.value.append(data, bytes);
+
+    // add stores only new keys, replace only cached ones
+    bool allowed = true;
+    bool stored = false;
+    {
+      Shard& shard = server.shardFor(tokens[1].data, tokens[1].size);
+      lock_guard<mutex> guard(shard.lock);
+      if (!tokens[0].is("set")) {
+        allowed = shard.store->contains(tokens[1].data, tokens[1].size) == tokens[0].is("replace");
+      }
+      if (allowed) {
+        stored = shard.store->set(tokens[1].data, tokens[1].size,
+                                  worker.value.data(), worker.value.size());
+      }
+    }
+    if (!noreply) {
+      conn.out += !allowed ? "NOT_STORED\r\n"
+        : stored ? "STORED\r\n" : "SERVER_ERROR out of memory storing object\r\n";
+    }
+  } else if (tokens[0].is("delete") && (n == 2 || n == 3)) {
+    bool noreply = n == 3 && tokens[2].is("noreply");
+    bool deleted;
+    {
+      Shard& shard = server.shardFor(tokens[1].data, tokens[1].size);
+      lock_guard<mutex> guard(shard.lock);
+      deleted = shard.store->del(tokens[1].data, tokens[1].size);
+    }
+    if (!noreply) {
+      conn.out += deleted ? "DELETED\r\n" : "NOT_FOUND\r\n";
+    }
+  } else if (tokens[0].is("flush_all") && (n == 1 || n == 2)) {
+    flushAll();
+    if (!(n == 2 && tokens[1].is("noreply"))) { conn.out += "OK\r\n"; }
+  } else if (tokens[0].is("stats")) {
+    stats(conn.out, n == 2 && tokens[1].is("reset"));
+  } else if (tokens[0].is("version")) {
+    conn.out += "VERSION lhd-1.0\r\n";
+  } else if (tokens[0].is("quit")) {
+    conn.closing = true;
+  } else {
+    conn.out += "ERROR\r\n";
+  }
+
+  return consumed;
+}
+
+void setEvents(Worker& worker, Connection& conn, bool writing) {
+  if (conn.writing == writing) { return; }
+  conn.writing = writing;
+  epoll_event ev;
+  ev.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+  ev.data.ptr = &conn;
+  epoll_ctl(worker.epfd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+// returns false once the connection should be closed
+bool flush(Worker& worker, Connection& conn) {
+  while (conn.outPos < conn.out.size()) {
+    ssize_t written = send(conn.fd, conn.out.data() + conn.outPos,
+                           conn.out.size() - conn.outPos, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        setEvents(worker, conn, true);
+        return true;
+      }
+      if (errno == EINTR) { continue; }
+      return false;
+    }
+    conn.outPos += written;
+  }
+
+  conn.out.clear();
+  conn.outPos = 0;
+  setEvents(worker, conn, false);
+  return !conn.closing;
+}
+
+// returns false once the connection should be closed
+bool readable(Worker& worker, Connection& conn) {
+  char buf[READ_SIZE];
+  while (true) {
+    ssize_t bytes = read(conn.fd, buf, sizeof(buf));
+    if (bytes > 0) {
+      conn.in.append(buf, bytes);
+      continue;
+    }
+    if (bytes == 0) { return false; }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+    if (errno == EINTR) { continue; }
+    return false;
+  }
+
+  size_t pos = 0;
+  while (pos < conn.in.size() && !conn.closing) {
+    auto start = chrono::steady_clock::now();
+    size_t consumed = execute(worker, conn, pos);
+    if (consumed == 0) { break; }
+    pos += consumed;
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now() - start).count();
+
+    lock_guard<mutex> guard(worker.statsLock);
+    worker.latency.record(ns);
+  }
+  conn.in.erase(0, pos);
+
+  return flush(worker, conn);
+}
+
+void close(Connection* conn) {
+  ::close(conn->fd);
+  delete conn;
+  --server.connections;
+}
+
+void workerLoop(Worker* worker) {
+  const int MAX_EVENTS = 64;
+  epoll_event events[MAX_EVENTS];
+
+  while (!stopping) {
+    int n = epoll_wait(worker->epfd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < n; i++) {
+      auto* conn = (Connection*)events[i].data.ptr;
+      bool open = true;
+      if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        open = readable(*worker, *conn);
+      }
+      if (open && (events[i].events & EPOLLOUT)) {
+        open = flush(*worker, *conn);
+      }
+      if (!open) { close(conn); }
+    }
+  }
+}
+
+int listenOn(const string& address) {
+  int fd;
+  bool tcp = address.find_first_not_of("0123456789") == string::npos;
+
+  if (tcp) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(address.c_str()));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      cerr << "Could not bind 127.0.0.1:" << address << ": " << strerror(errno) << endl;
+      exit(-2);
+    }
+  } else {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(address.c_str());
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path) - 1);
+    if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+      cerr << "Could not bind " << address << ": " << strerror(errno) << endl;
+      exit(-2);
+    }
+  }
+
+  if (listen(fd, 1024) < 0) {
+    cerr << "Could not listen: " << strerror(errno) << endl;
+    exit(-2);
+  }
+  return fd;
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0]
+         << " <LHD|LRU> [capacity MB] [threads] [port | unix socket path]" << endl;
+    exit(-2);
+  }
+
+  server.policy = argv[1];
+  server.capacity = (argc > 2 ? atoll(argv[2]) : 64) * 1024 * 1024;
+  uint32_t threads = argc > 3 ? atoi(argv[3]) : 4;
+  string address = argc > 4 ? argv[4] : "11211";
+
+  if (threads == 0 || server.capacity / threads < kv::SlabAllocator::PAGE_SIZE) {
+    cerr << "Need at least one thread and one " << misc::bytes(kv::SlabAllocator::PAGE_SIZE)
+         << " page per thread" << endl;
+    exit(-2);
+  }
+
+  for (uint32_t i = 0; i < threads; i++) {
+    server.shards.emplace_back(new Shard());
+    server.shards.back()->store.reset(new kv::Store(server.capacity / threads, server.policy));
+  }
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listenFd = listenOn(address);
+  server.start = chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < threads; i++) {
+    server.workers.emplace_back(new Worker());
+    Worker* worker = server.workers.back().get();
+    worker->epfd = epoll_create1(0);
+    worker->loop = thread(workerLoop, worker);
+  }
+
+  cout << "Serving " << server.policy << " (" << misc::bytes(server.capacity)
+       << ", " << threads << " threads) on " << address << endl;
+
+  uint64_t next = 0;
+  pollfd pfd{listenFd, POLLIN, 0};
+  while (!stopping) {
+    if (poll(&pfd, 1, 100) <= 0) { continue; }
+
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) { continue; }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    auto* conn = new Connection();
+    conn->fd = fd;
+    ++server.connections;
+    ++server.totalConnections;
+
+    Worker& worker = *server.workers[next++ % threads];
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(worker.epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+
+  for (auto& worker : server.workers) { worker->loop.join(); }
+  ::close(listenFd);
+  if (address.find_first_not_of("0123456789") != string::npos) { unlink(address.c_str()); }
+
+  string out;
+  stats(out, false);
+  cout << out;
+  for (auto& shard : server.shards) { shard->store->dumpStats(); }
+
+  return 0;
+}
@@ -0,0 +1,268 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+
+#include "bytes.hpp"
+#include "rand.hpp"
+#include "repl.hpp"
+
+namespace cache {
+
+struct SlabParams {
+  uint32_t pageSize = 1024 * 1024;
+  uint32_t minChunkSize = 96;
+  double growthFactor = 1.25;
+  // candidates sampled per eviction within a class
+  uint32_t associativity = 32;
+  // move pages from idle classes to evicting ones (memcached's
+  // slab_automove=1)
+  bool automove = false;
+  uint64_t automoveInterval = 100 * 1000;
+};
+
+// Model of memcached's slab allocator for cache::Cache. Capacity is cut
+// into pages; a page belongs to one slab class and holds chunks of that
+// class's size, and an object takes one chunk of the smallest class it
+// fits. Once all pages are assigned, an object can only be stored by
+// evicting another object of its own class, so the policy ranks a
+// random sample of that class (Policy::rankAmong). Objects larger than
+// a page are not stored.
+//
+// With automove, every automoveInterval accesses the class with the
+// most evictions (or failed placements) is noted. When the same class
+// has led for AUTOMOVE_WINDOWS windows and some other class has evicted
+// nothing for as long, a page moves from the idle class to it; a class
+// with failed placements takes a page from the largest class instead. The moved page's
+// objects are whatever happened to be on it, so the model evicts
+// random objects of the source class to empty one page's worth of
+// chunks.
+class SlabModel {
+public:
+  static constexpr uint32_t AUTOMOVE_WINDOWS = 3;
+
+  SlabModel(uint64_t capacity, const SlabParams& _params)
+    : params(_params)
+    , numPages(capacity / _params.pageSize)
+    , freePages(capacity / _params.pageSize)
+    , rand(capacity) {
+    assert(numPages > 0);
+
+    double size = params.minChunkSize;
+    while (true) {
+      // memcached keeps chunks 8-byte aligned
+      uint32_t chunkSize = ((uint32_t)size + 7) & ~7u;
+      if (chunkSize >= params.pageSize / 2) { break; }
+      classes.push_back(SlabClass(chunkSize, params.pageSize / chunkSize));
+      size = chunkSize * params.growthFactor;
+    }
+    // largest objects get a page each
+    classes.push_back(SlabClass(params.pageSize, 1));
+  }
+
+  // smallest class whose chunks fit size; -1 if size > pageSize
+  uint32_t classFor(uint32_t size) const {
+    auto itr = std::lower_bound(classes.begin(), classes.end(), size,
+                                [](const SlabClass& sc, uint32_t size) {
+                                  return sc.chunkSize < size;
+                                });
+    return itr == classes.end() ? -1u : itr - classes.begin();
+  }
+
+  // frees the chunk of id
+  void remove(repl::candidate_t id) {
+    auto itr = positions.find(id);
+    assert(itr != positions.end());
+
+    auto& sc = classes[itr->second.cls];
+    uint32_t pos = itr->second.pos;
+    positions.erase(itr);
+
+    if (pos != sc.objects.size() - 1) {
+      sc.objects[pos] = sc.objects.back();
+      positions[sc.objects[pos]].pos = pos;
+    }
+    sc.objects.pop_back();
+  }
+
+  // finds a chunk for id, assigning a free page to its class or
+  // evicting objects of its class if needed. victims are replaced() in
+  // repl and appended to victims. returns false if id cannot be stored.
+  bool place(repl::Policy* repl, const parser::Request& req, repl::candidate_t id,
+             uint32_t size, std::vector<repl::candidate_t>& victims) {
+    uint32_t cls = classFor(size);
+    if (cls == -1u) {
+      ++tooLarge;
+      return false;
+    }
+
+    auto& sc = classes[cls];
+    while (sc.objects.size() >= sc.pages * sc.chunksPerPage) {
+      if (freePages > 0) {
+        --freePages;
+        ++sc.pages;
+        continue;
+      }
+
+      // a class that never got a page can't evict anything; automove
+      // counts this as demand for a page
+      if (sc.objects.empty()) {
+        ++unplaceable;
+        ++sc.windowEvictions;
+        ++sc.windowStarved;
+        return false;
+      }
+
+      samples.clear();
+      for (uint32_t i = 0; i < params.associativity; i++) {
+        samples.push_back(sc.objects[(rand.next() >> 16) % sc.objects.size()]);
+      }
+      auto victim = repl->rankAmong(req, samples.data(), samples.size());
+      ++rankings;
+
+      evict(repl, victim, victims, true);
+      ++sc.evictions;
+      ++sc.windowEvictions;
+    }
+
+    positions[id] = Position{cls, (uint32_t)sc.objects.size()};
+    sc.objects.push_back(id);
+    return true;
+  }
+
+  // called once per access; runs automove at the end of each window.
+  // objects dropped to free the moved page are removed() from repl,
+  // since it didn't choose them, and appended to victims.
+  void tick(repl::Policy* repl, std::vector<repl::candidate_t>& victims) {
+    if (!params.automove || ++accesses % params.automoveInterval != 0) { return; }
+
+    uint32_t busiest = -1u;
+    uint64_t mostEvictions = 0;
+    for (uint32_t cls = 0; cls < classes.size(); cls++) {
+      auto& sc = classes[cls];
+      if (sc.windowEvictions > mostEvictions) {
+        busiest = cls;
+        mostEvictions = sc.windowEvictions;
+      }
+      sc.idleWindows = sc.windowEvictions == 0 ? sc.idleWindows + 1 : 0;
+      sc.windowEvictions = 0;
+    }
+    bool starved = busiest != -1u && classes[busiest].windowStarved > 0;
+    for (auto& sc : classes) { sc.windowStarved = 0; }
+
+    busiestWindows = (busiest != -1u && busiest == lastBusiest) ? busiestWindows + 1 : 1;
+    lastBusiest = busiest;
+    if (busiest == -1u || busiestWindows < AUTOMOVE_WINDOWS) { return; }
+
+    // the idle class with the most pages gives one up. a class that
+    // couldn't store objects at all takes one from the largest class,
+    // idle or not.
+    uint32_t source = -1u;
+    for (uint32_t cls = 0; cls < classes.size(); cls++) {
+      auto& sc = classes[cls];
+      if (cls == busiest || sc.pages < 2) { continue; }
+      if (sc.idleWindows < AUTOMOVE_WINDOWS && !starved) { continue; }
+      if (source == -1u || sc.pages > classes[source].pages) { source = cls; }
+    }
+    if (source == -1u) { return; }
+
+    auto& src = classes[source];
+    while (src.objects.size() > (src.pages - 1) * src.chunksPerPage) {
+      auto victim = src.objects[(rand.next() >> 16) % src.objects.size()];
+      evict(repl, victim, victims, false);
+      ++pageMoveEvictions;
+    }
+    --src.pages;
+    ++classes[busiest].pages;
+    // keep moving a page per window for as long as this holds
+    ++pageMoves;
+  }
+
+  uint64_t capacity() const { return numPages * (uint64_t)params.pageSize; }
+
+  // objectBytes is the total size of stored objects
+  void dumpStats(uint64_t objectBytes) const {
+    using std::endl;
+    uint64_t chunkBytes = 0;
+    for (auto& sc : classes) { chunkBytes += sc.objects.size() * sc.chunkSize; }
+
+    std::cout
+      << "Slabs: " << (numPages - freePages) << " / " << numPages << " pages assigned, "
+      << misc::bytes(objectBytes) << " of objects in " << misc::bytes(chunkBytes)
+      << " of chunks" << endl
+      << "  > Effective capacity: " << (100. * objectBytes / capacity()) << "% ("
+      << (100. * chunkBytes / capacity()) << "% in chunks)" << endl
+      << "  > Rankings: " << rankings << endl
+      << "  > Too large to store: " << tooLarge << endl
+      << "  > No page for class: " << unplaceable << endl
+      << "  > Page moves: " << pageMoves << " (" << pageMoveEvictions << " evictions)" << endl;
+
+    for (uint32_t cls = 0; cls < classes.size(); cls++) {
+      auto& sc = classes[cls];
+      if (sc.pages == 0) { continue; }
+      std::cout << "  > Class " << cls << " (" << sc.chunkSize << "B): "
+                << sc.pages << " pages, "
+                << sc.objects.size() << " / " << (sc.pages * sc.chunksPerPage) << " chunks used, "
+                << sc.evictions << " evictions" << endl;
+    }
+  }
+
+private:
+  struct SlabClass {
+    uint32_t chunkSize;
+    uint32_t chunksPerPage;
+    uint64_t pages = 0;
+    // objects in the class, in no order; positions has their indices
+    std::vector<repl::candidate_t> objects;
+    uint64_t evictions = 0;
+    // evictions and failed placements in this automove window
+    uint64_t windowEvictions = 0;
+    uint64_t windowStarved = 0;
+    uint32_t idleWindows = 0;
+
+    SlabClass(uint32_t _chunkSize, uint32_t _chunksPerPage)
+      : chunkSize(_chunkSize), chunksPerPage(_chunksPerPage) {}
+  };
+
+  struct Position {
+    uint32_t cls;
+    uint32_t pos;
+  };
+
+  // evicted: chosen by the policy, rather than dropped to free a page
+  // for automove
+  void evict(repl::Policy* repl, repl::candidate_t victim,
+             std::vector<repl::candidate_t>& victims, bool evicted) {
+    if (evicted) {
+      repl->replaced(victim);
+    } else {
+      repl->removed(victim);
+    }
+    remove(victim);
+    victims.push_back(victim);
+  }
+
+  const SlabParams params;
+  const uint64_t numPages;
+  uint64_t freePages;
+  std::vector<SlabClass> classes;
+  std::unordered_map<repl::candidate_t, Position> positions;
+
+  misc::Rand rand;
+  std::vector<repl::candidate_t> samples;
+
+  uint64_t accesses = 0;
+  uint32_t lastBusiest = -1u;
+  uint32_t busiestWindows = 0;
+
+  // stats
+  uint64_t rankings = 0;
+  uint64_t tooLarge = 0;
+  uint64_t unplaceable = 0;
+  uint64_t pageMoves = 0;
+  uint64_t pageMoveEvictions = 0;
+};
+
+}
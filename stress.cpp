@@ -0,0 +1,100 @@
+// Multi-threaded stress benchmark for ConcurrentLHD.
+//
+// Every thread replays its own stream of skewed synthetic requests
+// against one shared ConcurrentLHD, acting as a cache that holds at
+// most <capacity> objects: misses evict (rank() + replaced()) until
+// there is room, and every access calls update(). Runs with
+// 1, 2, 4, ... up to <max threads> threads and prints one line per run.
+//
+// Usage: ./bin/stress [max threads] [requests per thread] [objects] [capacity]
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "concurrent_lhd.hpp"
+
+using namespace std;
+
+// of the value sizes worker() draws, 100 + [0, 4000)
+const uint64_t MEAN_VALUE_SIZE = 2100;
+
+struct Result {
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+};
+
+static void worker(repl::ConcurrentLHD* lhd, uint32_t thread,
+                   uint64_t requests, uint64_t objects, uint64_t capacity,
+                   Result* result) {
+  misc::Rand rand(thread + 1);
+
+  for (uint64_t i = 0; i < requests; i++) {
+    // cubing a uniform variate gives a heavy head, like a zipf
+    double u = (rand.next() >> 11) * (1. / (1ull << 53));
+    int64_t id = (int64_t)(objects * u * u * u);
+    int32_t app = id % 8;
+    int64_t valueSize = 100 + (id * 2654435761u) % 4000;
+
+    parser::Request req{0., app, parser::GET, 0, valueSize, id, false};
+    repl::candidate_t candidate = repl::candidate_t::make(req);
+
+    if (lhd->contains(candidate)) {
+      ++result->hits;
+    } else {
+      ++result->misses;
+      while (lhd->numObjects() >= capacity) {
+        lhd->replaced(lhd->rank(req));
+      }
+    }
+
+    lhd->update(candidate, req);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  uint32_t maxThreads = argc > 1 ? atoi(argv[1]) : thread::hardware_concurrency();
+  uint64_t requests = argc > 2 ? atoll(argv[2]) : 4 * 1000 * 1000;
+  uint64_t objects = argc > 3 ? atoll(argv[3]) : 1000 * 1000;
+  uint64_t capacity = argc > 4 ? atoll(argv[4]) : objects / 10;
+
+  repl::LHDParams params;
+  params.associativity = 64;
+  params.accsPerReconfiguration = 1 << 18;
+
+  printf("# threads, requests, seconds, requests/sec, speedup, hit ratio\n");
+
+  double baseline = 0;
+  for (uint32_t threads = 1; threads <= std::max(maxThreads, 1u); threads *= 2) {
+    // objects average MEAN_VALUE_SIZE bytes
+    repl::ConcurrentLHD lhd(params, capacity * MEAN_VALUE_SIZE);
+    vector<Result> results(threads);
+    vector<thread> workers;
+
+    auto start = chrono::steady_clock::now();
+    for (uint32_t t = 0; t < threads; t++) {
+      workers.emplace_back(worker, &lhd, t, requests, objects, capacity, &results[t]);
+    }
+    for (auto& w : workers) { w.join(); }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    uint64_t hits = 0, misses = 0;
+    for (auto& r : results) {
+      hits += r.hits;
+      misses += r.misses;
+    }
+
+    double rate = (hits + misses) / seconds;
+    if (threads == 1) { baseline = rate; }
+
+    printf("%u, %lu, %g, %g, %g, %g\n",
+           threads, hits + misses, seconds, rate, rate / baseline,
+           1. * hits / (hits + misses));
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "parser.hpp"
+#include "cache.hpp"
+#include "runner.hpp"
+#include "fifo.hpp"
+#include "rand.hpp"
+
+namespace cache {
+
+struct TierParams {
+  // which DRAM victims are written to flash: "all", "probabilistic"
+  // (admitProbability), "rejectFirst" (victims evicted before, among
+  // the last rejectFirstHistory) or "hit" (victims hit in DRAM)
+  std::string admission = "all";
+  double admitProbability = 0.5;
+  uint64_t rejectFirstHistory = 1000 * 1000;
+  // copy flash hits into DRAM
+  bool promote = true;
+  // estimated service time in microseconds
+  double dramLatency = 1;
+  double flashLatency = 100;
+  double missLatency = 1000;
+};
+
+// DRAM cache in front of a flash cache, each a cache::Cache with its
+// own policy. A request is looked up in DRAM, then in flash, and on a
+// miss in both is filled into DRAM. Flash hits are filled into DRAM
+// too if promote is set (the flash copy stays). Objects evicted from
+// DRAM that flash doesn't have are offered to flash, and written if
+// the admission filter accepts them; those writes are flash's only
+// inserts.
+//
+// Each tier's Cache counts its own accesses (for flash, lookups that
+// hit plus inserts), so the tiered stats are kept here.
+class TieredRunner : public Runner {
+public:
+  TieredRunner(Cache* _dram, Runner* _dramRunner, Cache* _flash, const TierParams& _params)
+    : dram(_dram)
+    , dramRunner(_dramRunner)
+    , flash(_flash)
+    , params(_params) {
+    dram->evictionLog = &dramVictims;
+
+    if (params.admission != "all" && params.admission != "probabilistic"
+        && params.admission != "rejectFirst" && params.admission != "hit") {
+      std::cerr << "Invalid flash admission: " << params.admission << std::endl;
+      exit(-2);
+    }
+  }
+
+  void run(const std::string& trace, const RunOptions& options) {
+    auto visit = [&](const parser::Request& req) {
+      if (options.filterApp != -1 && req.appId != options.filterApp) {
+        return true;
+      }
+      if (req.type != parser::GET) { return true; }
+
+      access(req);
+      return requests < options.totalAccesses - parser::FAST_FORWARD;
+    };
+
+    parser::CSVParser parser(trace.c_str());
+    parser.go(visit);
+  }
+
+  repl::Policy* policy() { return dram->repl; }
+
+  void dumpStats() {
+    using std::endl;
+    double latency = (dramHits * params.dramLatency + flashHits * params.flashLatency
+                      + misses * params.missLatency) / std::max<uint64_t>(requests, 1);
+
+    std::cout
+      << "Tiers: " << requests << " requests" << endl
+      << "  > DRAM hits: " << dramHits << " " << (100. * dramHits / requests) << "%" << endl
+      << "  > Flash hits: " << flashHits << " " << (100. * flashHits / requests) << "% ("
+      << (100. * flashHits / std::max<uint64_t>(requests - dramHits, 1)) << "% of DRAM misses)" << endl
+      << "  > Misses: " << misses << " " << (100. * misses / requests) << "%" << endl
+      << "  > Promotions: " << promotions << endl
+      << "  > Flash admission (" << params.admission << "): " << admitted << " of "
+      << (admitted + rejected) << " DRAM victims" << endl
+      << "  > Flash written: " << misc::bytes(flashBytesWritten) << ", "
+      << (1. * flashBytesWritten / requests) << " bytes per request, "
+      << (1. * flashBytesWritten / std::max<uint64_t>(flashBytesRead, 1)) << " bytes written per byte read" << endl
+      << "  > Estimated latency: " << latency << " us per request" << endl
+      << "Flash tier:" << endl;
+    flash->dumpStats();
+    flash->repl->dumpStats(flash);
+  }
+
+private:
+  void access(const parser::Request& req) {
+    ++requests;
+    auto id = repl::candidate_t::make(req);
+
+    if (dram->sizeMap.count(id)) {
+      ++dramHits;
+      if (params.admission == "hit") { hitInDram.insert(id); }
+      dram->access(req);
+      return;
+    }
+
+    bool flashHit = flash->sizeMap.count(id);
+    if (flashHit) {
+      ++flashHits;
+      flashBytesRead += req.size();
+      flash->access(req);
+      if (!params.promote) { return; }
+      ++promotions;
+    } else {
+      ++misses;
+    }
+
+    dramVictims.clear();
+    dram->access(req);
+
+    for (auto& victim : dramVictims) {
+      bool hit = hitInDram.erase(victim.first) > 0;
+      if (flash->sizeMap.count(victim.first)) { continue; }
+
+      if (admit(victim.first, hit)) {
+        ++admitted;
+        flashBytesWritten += victim.second;
+        parser::Request write{req.time, victim.first.appId, parser::GET, 0,
+                              (int64_t)victim.second - parser::MEMCACHED_OVERHEAD,
+                              victim.first.id, false};
+        flash->access(write);
+      } else {
+        ++rejected;
+      }
+    }
+  }
+
+  bool admit(repl::candidate_t id, bool hitInDram) {
+    if (params.admission == "probabilistic") {
+      return (rand.next() >> 11) * (1. / (1ull << 53)) < params.admitProbability;
+    } else if (params.admission == "rejectFirst") {
+      if (seen.find(id) != seen.NOT_FOUND) {
+        seen.erase(id);
+        return true;
+      }
+      seen.push_back(id, true);
+      if (seen.size() > params.rejectFirstHistory) { seen.pop_front(); }
+      return false;
+    } else if (params.admission == "hit") {
+      return hitInDram;
+    } else {
+      return true;
+    }
+  }
+
+  Cache* dram;
+  std::unique_ptr<Runner> dramRunner;
+  Cache* flash;
+  const TierParams params;
+
+  std::vector<std::pair<repl::candidate_t, uint32_t>> dramVictims;
+  // DRAM objects hit since they were inserted, for admission = "hit"
+  std::unordered_set<repl::candidate_t> hitInDram;
+  // recent DRAM victims, for admission = "rejectFirst"
+  repl::FifoQueue<bool> seen;
+  misc::Rand rand;
+
+  // stats
+  uint64_t requests = 0;
+  uint64_t dramHits = 0;
+  uint64_t flashHits = 0;
+  uint64_t misses = 0;
+  uint64_t promotions = 0;
+  uint64_t admitted = 0;
+  uint64_t rejected = 0;
+  uint64_t flashBytesWritten = 0;
+  uint64_t flashBytesRead = 0;
+};
+
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <cstdio>
+#include <x86intrin.h>
+
+#include "histogram.hpp"
+
+namespace misc {
+
+// Cycle counts of the simulator's hot operations, compiled in only
+// when built with -DOP_TIMING (make TIMING=1); otherwise OpTimer is
+// empty and every use of it compiles away. Each operation records its
+// rdtsc delta into a log-bucketed Histogram. Cache::access() prints
+// and restarts the per-interval histograms every STATS_INTERVAL
+// accesses, and main() prints the totals, so the tail (p99, p999) and
+// outliers like LHD's reconfigurations are visible, not just the
+// average the throughput line gives.
+//
+// Times are inclusive: an access's time includes the rank(), update()
+// and replaced() calls it makes. Values are converted to nanoseconds
+// by the TSC rate measured over the run.
+#ifdef OP_TIMING
+constexpr bool OP_TIMING_ENABLED = true;
+#else
+constexpr bool OP_TIMING_ENABLED = false;
+#endif
+
+enum {
+  OP_ACCESS = 0,
+  OP_RANK,
+  OP_UPDATE,
+  OP_REPLACED,
+  OP_RECONFIGURE,
+  NUM_OPS
+};
+
+class OpTimes {
+public:
+  OpTimes()
+    : startCycles(__rdtsc())
+    , startTime(std::chrono::steady_clock::now()) {}
+
+  inline void record(uint32_t op, uint64_t cycles) {
+    interval[op].record(cycles);
+  }
+
+  // prints the operations timed since the last interval, and folds
+  // them into the totals
+  void dumpInterval(uint64_t accesses) {
+    char label[64];
+    snprintf(label, sizeof(label), "Timing at %lu", accesses);
+    dump(label, interval);
+    for (uint32_t op = 0; op < NUM_OPS; op++) {
+      total[op].merge(interval[op]);
+      interval[op].clear();
+    }
+  }
+
+  void dumpTotal() {
+    for (uint32_t op = 0; op < NUM_OPS; op++) {
+      total[op].merge(interval[op]);
+      interval[op].clear();
+    }
+    printf("Timing | TSC %g GHz\n", cyclesPerNs());
+    dump("Timing", total);
+  }
+
+private:
+  double cyclesPerNs() const {
+    double ns = std::chrono::duration<double, std::nano>(
+      std::chrono::steady_clock::now() - startTime).count();
+    return ns > 0 ? (__rdtsc() - startCycles) / ns : 1.;
+  }
+
+  void dump(const char* label, const Histogram* histograms) const {
+    static const char* NAMES[NUM_OPS] = {
+      "access", "rank", "update", "replaced", "reconfigure" };
+    double scale = 1. / cyclesPerNs();
+
+    for (uint32_t op = 0; op < NUM_OPS; op++) {
+      auto& h = histograms[op];
+      if (h.count() == 0) { continue; }
+      printf("%s | %s: %lu ops, mean %g ns, p50 %g ns, p99 %g ns, p999 %g ns, max %g ns\n",
+             label, NAMES[op], h.count(),
+             scale * h.mean(),
+             scale * h.percentile(0.5),
+             scale * h.percentile(0.99),
+             scale * h.percentile(0.999),
+             scale * h.max());
+    }
+  }
+
+  const uint64_t startCycles;
+  const std::chrono::steady_clock::time_point startTime;
+  Histogram interval[NUM_OPS];
+  Histogram total[NUM_OPS];
+};
+
+inline OpTimes& opTimes() {
+  static OpTimes times;
+  return times;
+}
+
+// times its scope as op
+class OpTimer {
+public:
+  explicit OpTimer(uint32_t _op) {
+    if (OP_TIMING_ENABLED) {
+      op = _op;
+      start = __rdtsc();
+    }
+  }
+
+  ~OpTimer() {
+    if (OP_TIMING_ENABLED) { opTimes().record(op, __rdtsc() - start); }
+  }
+
+private:
+  uint32_t op = 0;
+  uint64_t start = 0;
+};
+
+}